@@ -0,0 +1,286 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY	0x82F63B78	// reversed Castagnoli polynomial
+/*
+  The crc32 instruction has a latency of 3 cycles but a throughput of 1.
+  So the hardware version computes 3 streams of CRC32C_STRIPE bytes in
+  parallel and combines them. 3 stripes fit in a 4K sector.
+*/
+#define CRC32C_STRIPE	1360
+/*
+  With VPCLMULQDQ the data is folded 4 vectors of 64 bytes at a time with
+  carry-less multiplies, which run on another port than crc32 and do 4
+  lanes of 16 bytes each. The folded 16 bytes are finished with crc32.
+*/
+#define CRC32C_FOLD	256
+
+// tables for slicing-by-8
+static uint32_t crc32c_table[8][256];
+// tables for shifting a crc by CRC32C_STRIPE zero bytes
+static uint32_t crc32c_stripe_table[4][256];
+// the constants to fold 16 bytes forward by 256, 64, 48, 32 and 16 bytes
+static uint64_t crc32c_fold_k[5][2];
+static uint32_t (*crc32c_fp)(uint32_t crc, const void *buf, size_t len);
+static const char *crc32c_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/*
+  The portable version, processes 8 bytes for each iteration
+*/
+static uint32_t
+crc32c_sb8(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	crc = ~crc;
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		--len;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = crc32c_table[7][v & 0xFF] ^
+		    crc32c_table[6][(v >> 8) & 0xFF] ^
+		    crc32c_table[5][(v >> 16) & 0xFF] ^
+		    crc32c_table[4][(v >> 24) & 0xFF] ^
+		    crc32c_table[3][(v >> 32) & 0xFF] ^
+		    crc32c_table[2][(v >> 40) & 0xFF] ^
+		    crc32c_table[1][(v >> 48) & 0xFF] ^
+		    crc32c_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		--len;
+	}
+	return ~crc;
+}
+
+/*
+  Apply CRC32C_STRIPE zero bytes to the crc without pre and post conditioning
+*/
+static inline uint32_t
+crc32c_stripe_shift(uint32_t crc)
+{
+
+	return crc32c_stripe_table[0][crc & 0xFF] ^
+	    crc32c_stripe_table[1][(crc >> 8) & 0xFF] ^
+	    crc32c_stripe_table[2][(crc >> 16) & 0xFF] ^
+	    crc32c_stripe_table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+/*
+  The SSE4.2 version, the crc32 instruction processes 8 bytes each time
+*/
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t crc64;
+
+	crc = ~crc;
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+		--len;
+	}
+	crc64 = crc;
+	while (len >= CRC32C_STRIPE * 3) {
+		uint64_t crc1 = 0, crc2 = 0;
+
+		for (const uint8_t *end = p + CRC32C_STRIPE; p < end; p += 8) {
+			uint64_t v0, v1, v2;
+
+			memcpy(&v0, p, 8);
+			memcpy(&v1, p + CRC32C_STRIPE, 8);
+			memcpy(&v2, p + CRC32C_STRIPE * 2, 8);
+			crc64 = __builtin_ia32_crc32di(crc64, v0);
+			crc1 = __builtin_ia32_crc32di(crc1, v1);
+			crc2 = __builtin_ia32_crc32di(crc2, v2);
+		}
+		crc64 = crc32c_stripe_shift(crc64) ^ crc1;
+		crc64 = crc32c_stripe_shift(crc64) ^ crc2;
+		p += CRC32C_STRIPE * 2;
+		len -= CRC32C_STRIPE * 3;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = crc64;
+	while (len > 0) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+		--len;
+	}
+	return ~crc;
+}
+
+// fold the 16 byte lanes of @x forward over the distance of @k into @y
+#define CRC32C_FOLD512(x, k, y)	_mm512_ternarylogic_epi64(			\
+	_mm512_clmulepi64_epi128(x, k, 0x00),					\
+	_mm512_clmulepi64_epi128(x, k, 0x11), y, 0x96)
+#define CRC32C_FOLD128(x, k, y)	_mm_xor_si128(_mm_xor_si128(		\
+	_mm_clmulepi64_si128(x, k, 0x00),					\
+	_mm_clmulepi64_si128(x, k, 0x11)), y)
+
+static inline __m128i
+crc32c_k128(int i)
+{
+
+	return _mm_set_epi64x(crc32c_fold_k[i][1], crc32c_fold_k[i][0]);
+}
+
+/*
+  The VPCLMULQDQ version, buffers shorter than CRC32C_FOLD go to crc32c_hw()
+*/
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2")))
+static uint32_t
+crc32c_clmul(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	__m512i x0, x1, x2, x3, k;
+	__m128i x;
+	uint64_t crc64;
+
+	if (len < CRC32C_FOLD)
+		return crc32c_hw(crc, buf, len);
+	// the initial crc is added to the first bytes
+	x0 = _mm512_xor_si512(_mm512_loadu_si512(p),
+	    _mm512_castsi128_si512(_mm_cvtsi32_si128(~crc)));
+	x1 = _mm512_loadu_si512(p + 64);
+	x2 = _mm512_loadu_si512(p + 128);
+	x3 = _mm512_loadu_si512(p + 192);
+	p += CRC32C_FOLD;
+	len -= CRC32C_FOLD;
+	k = _mm512_broadcast_i32x4(crc32c_k128(0));
+	while (len >= CRC32C_FOLD) {
+		x0 = CRC32C_FOLD512(x0, k, _mm512_loadu_si512(p));
+		x1 = CRC32C_FOLD512(x1, k, _mm512_loadu_si512(p + 64));
+		x2 = CRC32C_FOLD512(x2, k, _mm512_loadu_si512(p + 128));
+		x3 = CRC32C_FOLD512(x3, k, _mm512_loadu_si512(p + 192));
+		p += CRC32C_FOLD;
+		len -= CRC32C_FOLD;
+	}
+	// the 4 vectors into one, then its 4 lanes into one
+	k = _mm512_broadcast_i32x4(crc32c_k128(1));
+	x1 = CRC32C_FOLD512(x0, k, x1);
+	x2 = CRC32C_FOLD512(x1, k, x2);
+	x3 = CRC32C_FOLD512(x2, k, x3);
+	x = _mm512_extracti32x4_epi32(x3, 3);
+	x = CRC32C_FOLD128(_mm512_extracti32x4_epi32(x3, 0), crc32c_k128(2), x);
+	x = CRC32C_FOLD128(_mm512_extracti32x4_epi32(x3, 1), crc32c_k128(3), x);
+	x = CRC32C_FOLD128(_mm512_extracti32x4_epi32(x3, 2), crc32c_k128(4), x);
+	crc64 = __builtin_ia32_crc32di(0, _mm_cvtsi128_si64(x));
+	crc64 = __builtin_ia32_crc32di(crc64, _mm_extract_epi64(x, 1));
+	return crc32c_hw(~(uint32_t)crc64, p, len);
+}
+#endif
+
+// x^@n mod P, bit reflected
+static uint32_t
+crc32c_xnmodp(unsigned n)
+{
+	uint32_t r = 0x80000000;	// x^0
+
+	while (n-- > 0)
+		r = (r >> 1) ^ (CRC32C_POLY & -(r & 1));
+	return r;
+}
+
+static void
+crc32c_init(void)
+{
+	for (int i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+
+		for (int j = 0; j < 8; ++j)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crc32c_table[0][i] = crc;
+	}
+	for (int i = 0; i < 256; ++i)
+		for (int t = 1; t < 8; ++t)
+			crc32c_table[t][i] = crc32c_table[0][crc32c_table[t-1][i] & 0xFF] ^
+			    (crc32c_table[t-1][i] >> 8);
+
+	// shifting is linear so the tables are built from the shifts of each byte
+	for (int t = 0; t < 4; ++t)
+		for (int i = 0; i < 256; ++i) {
+			uint32_t crc = (uint32_t)i << (t * 8);
+
+			for (int j = 0; j < CRC32C_STRIPE; ++j)
+				crc = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+			crc32c_stripe_table[t][i] = crc;
+		}
+
+	// folding 16 bytes forward by d bytes multiplies its low half by
+	// x^(8d+31) and its high half by x^(8d-33)
+	for (int i = 0; i < 5; ++i) {
+		static const unsigned dist[5] = { CRC32C_FOLD, 64, 48, 32, 16 };
+
+		crc32c_fold_k[i][0] = crc32c_xnmodp(8 * dist[i] + 31);
+		crc32c_fold_k[i][1] = crc32c_xnmodp(8 * dist[i] - 33);
+	}
+
+	crc32c_fp = crc32c_sb8;
+	crc32c_name = "software";
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_fp = crc32c_hw;
+		crc32c_name = "sse4.2";
+	}
+	if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq")) {
+		crc32c_fp = crc32c_clmul;
+		crc32c_name = "vpclmulqdq";
+	}
+#endif
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_fp(crc, buf, len);
+}
+
+const char *
+crc32c_impl(void)
+{
+
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_name;
+}
+
+uint32_t
+crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_sb8(crc, buf, len);
+}
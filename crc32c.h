@@ -0,0 +1,17 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  CRC32C (Castagnoli)
+
+  crc32c() folds the data with VPCLMULQDQ or uses the SSE4.2 crc32
+  instruction if the CPU supports it and falls back to crc32c_sw()
+  otherwise. The initial value of @crc is 0 and the returned value can be
+  passed as @crc to continue the checksum. crc32c_impl() names the
+  version used.
+*/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_impl(void);
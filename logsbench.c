@@ -0,0 +1,436 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  Workload benchmark for logstor
+
+  The working set is the first fill percent of the blocks. It is written
+  sequentially before the measurement so the reads hit mapped blocks and
+  the writes overwrite them. Each thread then issues reads, writes and
+  trims with the selected address distribution until the duration or the
+  operation count is reached. With -q a thread keeps that many requests
+  in flight with the asynchronous interface instead of blocking on each.
+  With -F every write is durable when it completes, the asynchronous
+  FUA writes that are in flight together share a flush.
+  The result is printed as JSON.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "logstor.h"
+#include "logsreport.h"
+#include "logsworkload.h"
+
+struct bench_conf {
+	int workload;
+	double zipf_theta;
+	int hot_pct;		// percent of the working set that is hot
+	int hot_access_pct;	// percent of the accesses that go to the hot blocks
+	int read_pct;
+	int trim_pct;
+	int fill_pct;
+	int duration;		// in seconds
+	uint64_t op_cnt;	// total operations, 0 means run for the duration
+	int thread_cnt;
+	unsigned seed;
+	bool compress;
+	bool dedup;
+	bool fua;		// the writes are forced unit access
+	bool prefetch;		// prefetch the forward map
+	unsigned wbuf;		// blocks in the write buffer, 0 for none
+	unsigned rcache;	// blocks in the read cache, 0 for none
+	int depth;		// asynchronous requests in flight per thread, 0 for blocking calls
+	int async_cnt;		// worker threads for the asynchronous requests
+	const char *output;	// the file for the result, NULL for stdout
+	const char *trace;	// the file for the event trace, NULL for none
+};
+
+struct bench_thread {
+	pthread_t tid;
+	int idx;
+	uint64_t rng;
+	uint32_t seq_next;	// next block of the sequential workload
+	uint64_t op_cnt;	// operations to do, 0 means until stopped
+	uint64_t op_done;	// operations started
+	struct report_thread rt;
+	uint32_t buf[SECTOR_SIZE/4] __attribute__((aligned(16)));
+};
+
+static struct bench_conf conf = {
+	.workload = WL_UNIFORM,
+	.zipf_theta = 0.99,
+	.hot_pct = 20,
+	.hot_access_pct = 80,
+	.read_pct = 0,
+	.trim_pct = 0,
+	.fill_pct = 80,
+	.duration = 10,
+	.op_cnt = 0,
+	.thread_cnt = 1,
+	.seed = 0,
+	.prefetch = true,
+	.async_cnt = 2,
+};
+
+static struct g_logstor_softc *sc;
+static struct wl_gen gen;	// the working set is gen.n blocks
+static atomic_bool stop;
+
+
+// an asynchronous request of a thread
+struct bench_req {
+	struct logstor_req req;
+	uint64_t start_ns;
+	int op;
+	uint32_t buf[SECTOR_SIZE/4] __attribute__((aligned(16)));
+};
+
+// fill @buf with incompressible data that differs for every write
+static inline void
+data_fill(struct bench_thread *t, uint32_t *buf, uint32_t ba)
+{
+
+	buf[0] = ba;
+	buf[1] = rng_next(&t->rng);
+	buf[SECTOR_SIZE/4 - 1] = buf[1];
+}
+
+// choose the next operation of the thread @t, false if it is done
+static bool
+bench_next(struct bench_thread *t, int *op, uint32_t *ba)
+{
+
+	if ((t->op_cnt != 0 && t->op_done == t->op_cnt) ||
+	    atomic_load_explicit(&stop, memory_order_relaxed))
+		return false;
+	++t->op_done;
+	int r = rng_next(&t->rng) % 100;
+	*op = r < conf.read_pct ? REP_READ :
+	    r < conf.read_pct + conf.trim_pct ? REP_TRIM : REP_WRITE;
+	*ba = wl_gen_next(&gen, &t->rng, &t->seq_next);
+	return true;
+}
+
+// keep conf.depth asynchronous requests in flight
+static void
+bench_thread_async(struct bench_thread *t)
+{
+	static const int req_op[REP_CNT] = {
+		[REP_READ] = LOGSTOR_REQ_READ,
+		[REP_WRITE] = LOGSTOR_REQ_WRITE,
+		[REP_TRIM] = LOGSTOR_REQ_DELETE,
+		[REP_FLUSH] = LOGSTOR_REQ_FLUSH,
+	};
+	struct logstor_cq *cq = logstor_cq_create();
+	struct bench_req *reqs = calloc(conf.depth, sizeof(*reqs));
+	struct logstor_req *req;
+	struct bench_req *br;
+	int i = 0;
+
+	if (reqs == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	// data_fill() only sets a few words, the rest must not compress
+	for (i = 0; i < conf.depth; ++i)
+		for (int j = 0; j < SECTOR_SIZE/4; ++j)
+			reqs[i].buf[j] = rng_next(&t->rng);
+	i = 0;
+	while ((req = i < conf.depth ? &reqs[i++].req : logstor_reap(cq, true)) != NULL) {
+		br = (struct bench_req *)req;
+		if (req->cnt != 0)
+			report_add(&t->rt, br->op, SECTOR_SIZE, report_time_ns() - br->start_ns);
+		if (!bench_next(t, &br->op, &req->ba))
+			continue;
+		if (br->op == REP_WRITE)
+			data_fill(t, br->buf, req->ba);
+		*req = (struct logstor_req){ .op = req_op[br->op], .ba = req->ba,
+		    .cnt = 1, .data = br->buf, .cq = cq,
+		    .flags = conf.fua ? LOGSTOR_FUA : 0 };
+		br->start_ns = report_time_ns();
+		while (logstor_submit(sc, req) == EAGAIN)
+			sched_yield();
+	}
+	logstor_cq_destroy(cq);
+	free(reqs);
+}
+
+static void *
+bench_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	uint64_t start, end;
+	uint32_t ba;
+	int op;
+
+	if (conf.depth != 0) {
+		bench_thread_async(t);
+		return NULL;
+	}
+	while (bench_next(t, &op, &ba)) {
+		if (op == REP_WRITE)
+			data_fill(t, t->buf, ba);
+		start = report_time_ns();
+		switch (op) {
+		case REP_READ:
+			logstor_read(sc, ba, t->buf);
+			break;
+		case REP_WRITE:
+			logstor_write(sc, ba, t->buf, conf.fua ? LOGSTOR_FUA : 0);
+			break;
+		case REP_TRIM:
+			logstor_delete(sc, (off_t)ba * SECTOR_SIZE, NULL, SECTOR_SIZE);
+			break;
+		}
+		end = report_time_ns();
+		report_add(&t->rt, op, SECTOR_SIZE, end - start);
+	}
+	return NULL;
+}
+
+static void
+usage(const char *prog)
+{
+
+	fprintf(stderr,
+	    "usage: %s [options]\n"
+	    "  -w workload   uniform, zipf, hotcold or seq (%s)\n"
+	    "  -z theta      skew of zipf, not 1 (%.2f)\n"
+	    "  -H hot:access percent of the blocks that are hot and percent\n"
+	    "                of the accesses to them for hotcold (%d:%d)\n"
+	    "  -r percent    reads in the operations (%d)\n"
+	    "  -t percent    trims in the operations (%d)\n"
+	    "  -f percent    fill level, the working set in percent of the blocks (%d)\n"
+	    "  -d seconds    duration (%d)\n"
+	    "  -n count      number of operations instead of the duration\n"
+	    "  -j threads    number of threads (%d)\n"
+	    "  -s seed       random seed (%u)\n"
+	    "  -C            compress the data blocks\n"
+	    "  -D            deduplicate the data blocks\n"
+	    "  -F            make every write durable when it completes (FUA)\n"
+	    "  -P            do not prefetch the forward map\n"
+	    "  -W blocks     buffer the writes in a write buffer of the blocks\n"
+	    "  -R blocks     cache the reads in a read cache of the blocks\n"
+	    "  -q depth      submit asynchronous requests, depth of them in flight per thread\n"
+	    "  -A workers    worker threads for the asynchronous requests (%d)\n"
+	    "  -o file       write the result to the file instead of stdout\n"
+	    "  -T file       dump the event trace to the file at the end\n",
+	    prog, wl_name[conf.workload], conf.zipf_theta, conf.hot_pct,
+	    conf.hot_access_pct, conf.read_pct, conf.trim_pct, conf.fill_pct,
+	    conf.duration, conf.thread_cnt, conf.seed, conf.async_cnt);
+	exit(1);
+}
+
+static void
+parse_args(int argc, char *argv[])
+{
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "w:z:H:r:t:f:d:n:j:s:CDFPW:R:q:A:o:T:h")) != -1) {
+		switch (ch) {
+		case 'w':
+			for (i = 0; i < WL_CNT; ++i)
+				if (strcmp(optarg, wl_name[i]) == 0)
+					break;
+			if (i == WL_CNT)
+				usage(argv[0]);
+			conf.workload = i;
+			break;
+		case 'z':
+			conf.zipf_theta = atof(optarg);
+			break;
+		case 'H':
+			if (sscanf(optarg, "%d:%d", &conf.hot_pct, &conf.hot_access_pct) != 2)
+				usage(argv[0]);
+			break;
+		case 'r':
+			conf.read_pct = atoi(optarg);
+			break;
+		case 't':
+			conf.trim_pct = atoi(optarg);
+			break;
+		case 'f':
+			conf.fill_pct = atoi(optarg);
+			break;
+		case 'd':
+			conf.duration = atoi(optarg);
+			break;
+		case 'n':
+			conf.op_cnt = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			conf.thread_cnt = atoi(optarg);
+			break;
+		case 's':
+			conf.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			conf.compress = true;
+			break;
+		case 'D':
+			conf.dedup = true;
+			break;
+		case 'F':
+			conf.fua = true;
+			break;
+		case 'P':
+			conf.prefetch = false;
+			break;
+		case 'W':
+			conf.wbuf = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			conf.rcache = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			conf.depth = atoi(optarg);
+			break;
+		case 'A':
+			conf.async_cnt = atoi(optarg);
+			break;
+		case 'o':
+			conf.output = optarg;
+			break;
+		case 'T':
+			conf.trace = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (conf.zipf_theta <= 0 || conf.zipf_theta == 1 ||
+	    conf.hot_pct < 0 || conf.hot_pct > 100 ||
+	    conf.hot_access_pct < 0 || conf.hot_access_pct > 100 ||
+	    conf.read_pct < 0 || conf.trim_pct < 0 ||
+	    conf.read_pct + conf.trim_pct > 100 ||
+	    conf.fill_pct <= 0 || conf.fill_pct > 100 ||
+	    conf.duration <= 0 || conf.thread_cnt <= 0 || conf.depth < 0 ||
+	    conf.async_cnt <= 0)
+		usage(argv[0]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_thread *threads;
+	struct report rep;
+	uint32_t buf[SECTOR_SIZE/4];
+	uint32_t block_cnt;
+	char config[512];
+	int len;
+	FILE *fp = stdout;
+
+	parse_args(argc, argv);
+	if (conf.output != NULL && (fp = fopen(conf.output, "w")) == NULL) {
+		perror(conf.output);
+		exit(1);
+	}
+	block_cnt = logstor_init_disk();
+	sc = logstor_open();
+	gen = (struct wl_gen){
+		.workload = conf.workload,
+		.n = (uint64_t)block_cnt * conf.fill_pct / 100,
+		.zipf_theta = conf.zipf_theta,
+		.hot_pct = conf.hot_pct,
+		.hot_access_pct = conf.hot_access_pct,
+	};
+	wl_gen_init(&gen);
+
+	// fill the working set
+	srandom(conf.seed);
+	for (int i = 0; i < SECTOR_SIZE/4; ++i)
+		buf[i] = random();
+	for (uint32_t ba = 0; ba < gen.n; ++ba) {
+		buf[0] = ba;
+		logstor_write(sc, ba, buf, 0);
+	}
+	logstor_flush(sc);
+	logstor_set_compress(sc, conf.compress);
+	logstor_set_dedup(sc, conf.dedup);
+	logstor_set_prefetch(sc, conf.prefetch);
+	logstor_set_wbuf(sc, conf.wbuf);
+	logstor_set_rcache(sc, conf.rcache);
+	if (conf.depth != 0)
+		logstor_set_async(sc, conf.async_cnt);
+
+	threads = calloc(conf.thread_cnt, sizeof(*threads));
+	if (threads == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	report_start(&rep, sc);
+	for (int i = 0; i < conf.thread_cnt; ++i) {
+		struct bench_thread *t = &threads[i];
+
+		t->idx = i;
+		t->rng = (conf.seed + 1) * 0x9E3779B97F4A7C15ULL + i;
+		t->seq_next = (uint64_t)gen.n * i / conf.thread_cnt;
+		t->op_cnt = conf.op_cnt / conf.thread_cnt +
+		    (i < conf.op_cnt % conf.thread_cnt);
+		if (conf.op_cnt != 0 && t->op_cnt == 0)
+			t->op_cnt = 1;
+		for (int j = 0; j < SECTOR_SIZE/4; ++j)
+			t->buf[j] = rng_next(&t->rng);
+		if (pthread_create(&t->tid, NULL, bench_thread, t) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	if (conf.op_cnt == 0) {
+		struct timespec ts = { .tv_sec = conf.duration };
+
+		while (nanosleep(&ts, &ts) != 0)
+			;
+		atomic_store(&stop, true);
+	}
+	for (int i = 0; i < conf.thread_cnt; ++i) {
+		pthread_join(threads[i].tid, NULL);
+		report_merge(&rep, &threads[i].rt);
+	}
+	report_stop(&rep, sc);
+	if (conf.trace != NULL) {
+		int error = logstor_trace_dump(conf.trace);
+
+		if (error != 0)
+			fprintf(stderr, "%s: %s\n", conf.trace, strerror(error));
+	}
+
+	len = snprintf(config, sizeof(config), "\"workload\": \"%s\", ",
+	    wl_name[conf.workload]);
+	if (conf.workload == WL_ZIPF)
+		len += snprintf(config + len, sizeof(config) - len,
+		    "\"zipf_theta\": %.3f, ", conf.zipf_theta);
+	if (conf.workload == WL_HOTCOLD)
+		len += snprintf(config + len, sizeof(config) - len,
+		    "\"hot_pct\": %d, \"hot_access_pct\": %d, ",
+		    conf.hot_pct, conf.hot_access_pct);
+	snprintf(config + len, sizeof(config) - len,
+	    "\"read_pct\": %d, \"trim_pct\": %d, \"fill_pct\": %d, "
+	    "\"threads\": %d, \"seed\": %u, "
+	    "\"compress\": %s, \"dedup\": %s, \"fua\": %s, \"prefetch\": %s, \"wbuf\": %u, \"rcache\": %u, "
+	    "\"queue_depth\": %d, \"async_workers\": %d, \"block_cnt\": %u",
+	    conf.read_pct, conf.trim_pct, conf.fill_pct, conf.thread_cnt,
+	    conf.seed, conf.compress ? "true" : "false",
+	    conf.dedup ? "true" : "false", conf.fua ? "true" : "false", conf.prefetch ? "true" : "false", conf.wbuf,
+	    conf.rcache, conf.depth, conf.depth != 0 ? conf.async_cnt : 0, block_cnt);
+	report_print(&rep, fp, config);
+
+	if (fp != stdout)
+		fclose(fp);
+	report_fini(&rep);
+	free(threads);
+	logstor_close(sc);
+	logstor_fini();
+	return 0;
+}
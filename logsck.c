@@ -0,0 +1,680 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  Offline consistency checker for logstor
+
+  logstor_check() translates every block with ba2sa_fp() and then looks
+  up the reverse map with sa2ba(), which caches a single segment summary,
+  so the sectors in random order cost a segment summary read per block.
+  This checker reads the disk directly without opening logstor:
+
+    pass 1  the segment summaries are read in segment order into a reverse
+            map and a checksum table of all the sectors
+    pass 2  the mapping files are walked leaf by leaf. The effective
+            mapping of each block (%fd_cur, then %fd_prev during a
+            snapshot, then %fd_snap) is checked against the reverse map
+            and the sectors it uses are counted. The indirect blocks are
+            checked against their reverse map and checksum.
+    pass 3  every sector is classified by its reverse map and the counts
+            of pass 2
+
+  Each pass is split over the threads, by segment range for passes 1 and
+  3 and by leaf range for pass 2. A block is mapped to a sector whose
+  reverse map is the block itself or, after deduplication, another block.
+  Reported errors are bad segment summaries, mappings to sectors that do
+  not hold block data, indirect blocks with a wrong reverse map or
+  checksum and, with -c, live sectors whose data does not match their
+  checksum. Orphaned sectors, those with a block in their reverse map
+  that no block maps to any more, are reclaimable and only counted.
+  Double mapped sectors, used by more than one block, are errors with -s
+  for volumes written without deduplication.
+
+  Without -i a volume is created and written with random blocks first.
+  The exit status is 1 if there are errors.
+*/
+#include "logstor.c"
+
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#define CK_ERR_PRINT_MAX	20	// errors printed in detail
+
+#define SEC_SEG_SUM	((uint32_t)BLOCK_INVALID - 1)	// reverse map of the segment summary sectors
+
+enum {
+	CK_SEG_SUM_BAD,		// segment summary with a wrong checksum
+	CK_MAP_BAD,		// block mapped to a sector that does not hold it
+	CK_META_BAD,		// indirect block with a wrong reverse map or checksum
+	CK_RM_BAD,		// unknown reverse map
+	CK_CSUM_BAD,		// live sector with a wrong checksum
+	CK_DOUBLE,		// sector used by more than one block
+	CK_ERR_CNT,
+	// the rest are not errors
+	CK_MAPPED = CK_ERR_CNT,	// blocks mapped to their own sector
+	CK_SHARED,		// blocks mapped to the sector of another block
+	CK_FRAG,		// blocks mapped to a fragment
+	CK_LIVE,		// sectors used by blocks
+	CK_ORPHAN,		// sectors of blocks that are mapped elsewhere
+	CK_PACKED,		// packed sectors in use
+	CK_META,		// indirect blocks in use
+	CK_META_STALE,		// indirect blocks replaced
+	CK_WARM,		// warm state sectors
+	CK_FREE,		// never written or invalidated sectors
+	CK_CNT,
+};
+
+static const char *ck_name[CK_CNT] = {
+	[CK_SEG_SUM_BAD] = "bad segment summaries",
+	[CK_MAP_BAD] = "bad mappings",
+	[CK_META_BAD] = "bad indirect blocks",
+	[CK_RM_BAD] = "bad reverse maps",
+	[CK_CSUM_BAD] = "bad sector checksums",
+	[CK_DOUBLE] = "double mapped sectors",
+	[CK_MAPPED] = "mapped blocks",
+	[CK_SHARED] = "shared blocks",
+	[CK_FRAG] = "compressed blocks",
+	[CK_LIVE] = "live data sectors",
+	[CK_ORPHAN] = "orphaned sectors",
+	[CK_PACKED] = "packed sectors",
+	[CK_META] = "indirect blocks",
+	[CK_META_STALE] = "stale indirect blocks",
+	[CK_WARM] = "warm state sectors",
+	[CK_FREE] = "free sectors",
+};
+
+struct ck_conf {
+	int thread_cnt;
+	const char *input;	// the image to check, NULL to create a volume
+	const char *output;	// the file to save the created volume to
+	uint64_t write_cnt;	// writes to the created volume, 0 for half the blocks
+	uint32_t seg_size;	// segment size of the created volume in bytes, 0 for the default
+	bool compress;
+	bool dedup;
+	bool csum;		// verify the checksum of the live sectors
+	bool strict;		// double mapped sectors are errors
+	bool compare;		// also run logstor_check() and time it
+};
+
+struct ck_thread {
+	pthread_t tid;
+	int idx;
+	uint64_t cnt[CK_CNT];
+	uint32_t node_sa[FD_COUNT];	// the depth 1 block in %node
+	uint32_t node[FD_COUNT][SECTOR_SIZE/4];
+	uint32_t leaf[FD_COUNT][SECTOR_SIZE/4];
+	uint32_t pack_sa;		// the packed sector in %pack
+	union _pack_sec pack;
+};
+
+static struct ck_conf conf = {
+	.thread_cnt = 0,
+};
+
+static struct _superblock sb;
+static struct g_logstor_softc *sb_sc;	// only has the superblock, for seg_sum_read()
+static uint32_t sec_cnt;
+static uint32_t *rm;		// reverse map of all the sectors
+static uint32_t *csum;		// checksum of all the sectors
+static atomic_uchar *ref;	// uses of each sector, saturated at 2
+static uint8_t chain[3];	// the files of the effective mapping
+static int chain_cnt;
+static uint32_t root[FD_COUNT][SECTOR_SIZE/4];
+static atomic_int err_printed;
+
+static uint64_t
+time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+ck_err(struct ck_thread *t, int kind, const char *fmt, ...)
+{
+	va_list ap;
+
+	++t->cnt[kind];
+	if (atomic_fetch_add(&err_printed, 1) >= CK_ERR_PRINT_MAX)
+		return;
+	va_start(ap, fmt);
+	printf("ERROR %s: ", ck_name[kind]);
+	vprintf(fmt, ap);
+	printf("\n");
+	va_end(ap);
+}
+
+static inline bool
+is_root_valid(uint8_t fd)
+{
+
+	return sb.fh[fd].root != SECTOR_NULL && sb.fh[fd].root != SECTOR_DEL;
+}
+
+// count a use of sector @sa
+static inline void
+ref_inc(uint32_t sa)
+{
+
+	if (atomic_load_explicit(&ref[sa], memory_order_relaxed) < 2)
+		atomic_fetch_add_explicit(&ref[sa], 1, memory_order_relaxed);
+}
+
+// the range of the items [0, @n) for thread @idx
+static inline void
+ck_range(int idx, uint32_t n, uint32_t *start, uint32_t *end)
+{
+
+	*start = (uint64_t)n * idx / conf.thread_cnt;
+	*end = (uint64_t)n * (idx + 1) / conf.thread_cnt;
+}
+
+/*
+Description:
+    Read and check the indirect block of metadata address @ma at @sa
+
+Return:
+    false if the block is bad, @buf is zeroed then
+*/
+static bool
+ck_meta_read(struct ck_thread *t, union fbuf_addr ma, uint32_t sa, uint32_t *buf)
+{
+
+	if (sa == SECTOR_NULL) {
+		memset(buf, 0, SECTOR_SIZE);
+		return true;
+	}
+	if (sa < SB_CNT || sa >= sec_cnt) {
+		ck_err(t, CK_META_BAD, "ma 0x%08x sa %u out of range", ma.uint32, sa);
+		memset(buf, 0, SECTOR_SIZE);
+		return false;
+	}
+	if (rm[sa] != ma.uint32) {
+		ck_err(t, CK_META_BAD, "ma 0x%08x sa %u reverse map 0x%08x",
+		    ma.uint32, sa, rm[sa]);
+		memset(buf, 0, SECTOR_SIZE);
+		return false;
+	}
+	my_read(NULL, buf, sa, LOGSTOR_IO_FBUF);
+	if (crc32c(0, buf, SECTOR_SIZE) != csum[sa]) {
+		ck_err(t, CK_META_BAD, "ma 0x%08x sa %u checksum", ma.uint32, sa);
+		memset(buf, 0, SECTOR_SIZE);
+		return false;
+	}
+	atomic_store_explicit(&ref[sa], 1, memory_order_relaxed);
+	return true;
+}
+
+// read the leaf of file @fd for the leaf index @index into %t->leaf[@fd]
+static void
+ck_leaf_read(struct ck_thread *t, uint8_t fd, uint32_t index)
+{
+	union fbuf_addr ma = {.meta = 0x7F};
+	uint32_t sa;
+
+	ma.fd = fd;
+	ma.index = index;
+	ma.depth = FBUF_LEAF_DEPTH;
+	sa = root[fd][ma.index0];
+	if (sa != t->node_sa[fd]) {
+		union fbuf_addr ima = {.meta = 0x7F};
+
+		ima.fd = fd;
+		ima.depth = 1;
+		ima.index0 = ma.index0;
+		// a bad block is zeroed and reported once by each thread
+		t->node_sa[fd] = sa;
+		ck_meta_read(t, ima, sa, t->node[fd]);
+	}
+	ck_meta_read(t, ma, t->node[fd][ma.index1], t->leaf[fd]);
+}
+
+// check the mapping of block @ba to @sa
+static void
+ck_map(struct ck_thread *t, uint32_t ba, uint32_t sa)
+{
+	uint32_t base = sa & SA_MASK;
+	uint32_t rev;
+
+	if (base < SB_CNT || base >= sec_cnt) {
+		ck_err(t, CK_MAP_BAD, "ba %u sa 0x%08x out of range", ba, sa);
+		return;
+	}
+	rev = rm[base];
+	if (SA_IS_FRAG(sa)) {
+		if (rev != BLOCK_PACKED) {
+			ck_err(t, CK_MAP_BAD, "ba %u sa 0x%08x reverse map %u is not packed",
+			    ba, sa, rev);
+			return;
+		}
+		if (t->pack_sa != base) {
+			my_read(NULL, &t->pack, base, LOGSTOR_IO_DATA);
+			t->pack_sa = base;
+		}
+		if (SA_FRAG_IDX(sa) >= t->pack.hdr.ph_cnt) {
+			ck_err(t, CK_MAP_BAD, "ba %u sa 0x%08x fragment count %u",
+			    ba, sa, t->pack.hdr.ph_cnt);
+			return;
+		}
+		rev = t->pack.hdr.ph_frag[SA_FRAG_IDX(sa)].ba;
+		++t->cnt[CK_FRAG];
+		// the fragments of a packed sector are not double mapped
+		atomic_store_explicit(&ref[base], 1, memory_order_relaxed);
+	} else
+		ref_inc(base);
+	if (IS_BLOCK_SNAP(rev))
+		rev -= BLOCK_SNAP;
+	if (rev == ba)
+		++t->cnt[CK_MAPPED];
+	else if (rev < sb.block_cnt)
+		++t->cnt[CK_SHARED];
+	else
+		ck_err(t, CK_MAP_BAD, "ba %u sa 0x%08x reverse map 0x%08x", ba, sa, rev);
+}
+
+// pass 1: read the segment summaries
+static void *
+ck_seg_sum(void *arg)
+{
+	struct ck_thread *t = arg;
+	struct _seg_sum ss;
+	uint32_t start, end;
+
+	ck_range(t->idx, sb.seg_cnt, &start, &end);
+	for (uint32_t sega = start; sega < end; ++sega) {
+		uint32_t sa = sega2sa(sega);
+
+		if (!seg_sum_read(sb_sc, sega, &ss)) {
+			ck_err(t, CK_SEG_SUM_BAD, "segment %u", sega);
+			memset(&ss, 0xFF, sizeof(ss));	// the sectors are BLOCK_INVALID
+		}
+		memcpy(&rm[sa], ss.ss_rm, BLOCKS_PER_SEG * sizeof(uint32_t));
+		memcpy(&csum[sa], ss.ss_csum, BLOCKS_PER_SEG * sizeof(uint32_t));
+		// the segment summaries of a zoned volume are marked after this pass
+		for (int i = SEG_SUM_OFFSET; i < SECTORS_PER_SEG; ++i)
+			rm[sa + i] = geom.zoned ? BLOCK_INVALID : SEC_SEG_SUM;
+	}
+	return NULL;
+}
+
+// pass 2: check the forward map
+static void *
+ck_map_walk(void *arg)
+{
+	struct ck_thread *t = arg;
+	uint32_t start, end;
+
+	for (int fd = 0; fd < FD_COUNT; ++fd)
+		t->node_sa[fd] = BLOCK_INVALID;
+	t->pack_sa = SECTOR_NULL;
+	ck_range(t->idx, howmany(sb.block_cnt, SECTOR_SIZE/4), &start, &end);
+	for (uint32_t index = start; index < end; ++index) {
+		// the indirect blocks of the files not in the chain are checked too
+		for (int fd = 0; fd < FD_COUNT; ++fd)
+			if (is_root_valid(fd))
+				ck_leaf_read(t, fd, index);
+		for (int i = 0; i < SECTOR_SIZE/4; ++i) {
+			uint32_t ba = index * (SECTOR_SIZE/4) + i;
+			uint32_t sa = SECTOR_NULL;
+
+			if (ba >= sb.block_cnt)
+				break;
+			for (int j = 0; j < chain_cnt; ++j) {
+				if (!is_root_valid(chain[j]))
+					continue;
+				sa = t->leaf[chain[j]][i] & 0x7fffffff;
+				if (sa != SECTOR_NULL)
+					break;
+			}
+			if (sa != SECTOR_NULL && sa != SECTOR_DEL)
+				ck_map(t, ba, sa);
+		}
+	}
+	return NULL;
+}
+
+// pass 3: classify the sectors
+static void *
+ck_sector(void *arg)
+{
+	struct ck_thread *t = arg;
+	uint32_t buf[SECTOR_SIZE/4];
+	uint32_t start, end;
+
+	ck_range(t->idx, sb.seg_cnt, &start, &end);
+	for (uint32_t sa = sega2sa(start); sa < sega2sa(end); ++sa) {
+		uint32_t rev = rm[sa];
+		unsigned uses = ref[sa];
+
+		if (sa < SB_CNT || rev == SEC_SEG_SUM)
+			continue;
+		if (IS_BLOCK_SNAP(rev))
+			rev -= BLOCK_SNAP;
+		if (rev == BLOCK_INVALID) {
+			++t->cnt[CK_FREE];
+			continue;
+		}
+		if (rev < sb.block_cnt) {
+			if (uses == 0)
+				++t->cnt[CK_ORPHAN];
+			else {
+				++t->cnt[CK_LIVE];
+				if (uses > 1) {
+					if (conf.strict)
+						ck_err(t, CK_DOUBLE, "sa %u ba %u", sa, rev);
+					else
+						++t->cnt[CK_DOUBLE];
+				}
+			}
+		} else if (rev == BLOCK_PACKED)
+			++t->cnt[uses ? CK_PACKED : CK_ORPHAN];
+		else if (IS_FBUF_ADDR(rev))
+			++t->cnt[uses ? CK_META : CK_META_STALE];
+		else if (rev == BLOCK_WARM)
+			++t->cnt[CK_WARM];
+		else {
+			ck_err(t, CK_RM_BAD, "sa %u reverse map 0x%08x", sa, rev);
+			continue;
+		}
+		if (conf.csum && uses != 0) {
+			my_read(NULL, buf, sa, LOGSTOR_IO_DATA);
+			if (crc32c(0, buf, SECTOR_SIZE) != csum[sa])
+				ck_err(t, CK_CSUM_BAD, "sa %u reverse map 0x%08x", sa, rev);
+		}
+	}
+	return NULL;
+}
+
+// run @func on all the threads and return the time it took in seconds
+static double
+ck_pass(struct ck_thread *threads, void *(*func)(void *))
+{
+	uint64_t start = time_ns();
+
+	for (int i = 0; i < conf.thread_cnt; ++i)
+		if (pthread_create(&threads[i].tid, NULL, func, &threads[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	for (int i = 0; i < conf.thread_cnt; ++i)
+		pthread_join(threads[i].tid, NULL);
+	return (time_ns() - start) / 1e9;
+}
+
+/*
+Description:
+    Check the volume on the RAM disk
+
+Return:
+    the number of errors
+*/
+static uint64_t
+logstor_check_offline(void)
+{
+	struct ck_thread *threads;
+	uint64_t cnt[CK_CNT] = {0};
+	uint64_t err_cnt = 0;
+	double sec[3];
+
+	// superblock_read() only uses the superblock of @sb_sc
+	if (sb_sc == NULL) {
+		sb_sc = calloc(1, sizeof(*sb_sc));
+		MY_ASSERT(sb_sc != NULL);
+	}
+	if (superblock_read(sb_sc) != 0) {
+		printf("no valid superblock\n");
+		exit(1);
+	}
+	sb = sb_sc->superblock;
+	sec_cnt = sb.seg_cnt * SECTORS_PER_SEG;
+	chain_cnt = 0;
+	chain[chain_cnt++] = sb.fd_cur;
+	if (sb.fd_prev != FD_INVALID)
+		chain[chain_cnt++] = sb.fd_prev;
+	chain[chain_cnt++] = sb.fd_snap;
+
+	rm = malloc((size_t)sec_cnt * sizeof(*rm));
+	csum = malloc((size_t)sec_cnt * sizeof(*csum));
+	ref = calloc(sec_cnt, sizeof(*ref));
+	threads = calloc(conf.thread_cnt, sizeof(*threads));
+	MY_ASSERT(rm != NULL && csum != NULL && ref != NULL && threads != NULL);
+	for (int i = 0; i < conf.thread_cnt; ++i)
+		threads[i].idx = i;
+
+	sec[0] = ck_pass(threads, ck_seg_sum);
+	if (geom.zoned)
+		for (uint32_t sa = SB_CNT; sa < seg_sum_sa(sb.seg_cnt); ++sa)
+			rm[sa] = SEC_SEG_SUM;
+	// the roots are checked here since they are read by all the threads
+	for (int fd = 0; fd < FD_COUNT; ++fd) {
+		union fbuf_addr ma = {.meta = 0x7F};
+
+		ma.fd = fd;
+		if (is_root_valid(fd))
+			ck_meta_read(&threads[0], ma, sb.fh[fd].root, root[fd]);
+	}
+	sec[1] = ck_pass(threads, ck_map_walk);
+	sec[2] = ck_pass(threads, ck_sector);
+
+	for (int i = 0; i < conf.thread_cnt; ++i)
+		for (int kind = 0; kind < CK_CNT; ++kind)
+			cnt[kind] += threads[i].cnt[kind];
+	printf("segments %u sectors %u blocks %u threads %d\n",
+	    sb.seg_cnt, sec_cnt, sb.block_cnt, conf.thread_cnt);
+	printf("seconds seg_sum %.3f map %.3f sector %.3f total %.3f\n",
+	    sec[0], sec[1], sec[2], sec[0] + sec[1] + sec[2]);
+	for (int kind = 0; kind < CK_CNT; ++kind) {
+		if (kind < CK_ERR_CNT && !(kind == CK_DOUBLE && !conf.strict))
+			err_cnt += cnt[kind];
+		printf("%-24s %lu\n", ck_name[kind], cnt[kind]);
+	}
+	free(threads);
+	free(ref);
+	free(csum);
+	free(rm);
+	return err_cnt;
+}
+
+// create a volume and write it with random blocks
+static void
+volume_create(void)
+{
+	struct g_logstor_softc *sc;
+	uint32_t buf[SECTOR_SIZE/4];
+	uint32_t block_cnt;
+	uint64_t write_cnt;
+
+	block_cnt = conf.seg_size != 0 ? logstor_init_disk_geom(conf.seg_size) :
+	    logstor_init_disk();
+	sc = logstor_open();
+	logstor_set_compress(sc, conf.compress);
+	logstor_set_dedup(sc, conf.dedup);
+	write_cnt = conf.write_cnt ? conf.write_cnt : block_cnt / 2;
+	for (int i = 0; i < SECTOR_SIZE/4; ++i)
+		buf[i] = random();
+	for (uint64_t i = 0; i < write_cnt; ++i) {
+		uint32_t ba = random() % block_cnt;
+
+		// with deduplication a few contents are repeated
+		buf[0] = conf.dedup ? ba % 64 : i;
+		if (conf.compress)
+			memset(&buf[2], buf[0], SECTOR_SIZE - 2 * sizeof(buf[0]));
+		logstor_write(sc, ba, buf, 0);
+	}
+	logstor_close(sc);
+}
+
+// load the image @path into the RAM disk
+static void
+image_load(const char *path)
+{
+	static char buf[SB_CNT][SECTOR_SIZE];
+	uint32_t seg_shift = 0;
+	FILE *fp;
+	size_t len;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	// the segments are striped over the devices so the segment size
+	// of the image is needed to place them
+	len = fread(buf, SECTOR_SIZE, SB_CNT, fp);
+	for (int i = 0; i < len && seg_shift == 0; ++i) {
+		struct _superblock *sbp = (struct _superblock *)buf[i];
+
+		if (sbp->magic == G_LOGSTOR_MAGIC &&
+		    sbp->seg_shift >= SEG_SHIFT_MIN && sbp->seg_shift <= SEG_SHIFT_MAX)
+			seg_shift = sbp->seg_shift;
+	}
+	if (seg_shift != 0)
+		logstor_init_disk_geom((uint32_t)SECTOR_SIZE << seg_shift);
+	else
+		logstor_init_disk();
+	rewind(fp);
+	len = 0;
+	for (uint32_t sa = 0; sa < get_mediasize() / SECTOR_SIZE; sa += SECTORS_PER_SEG) {
+		size_t n = fread(ram_sec(sa), 1, SEG_SIZE, fp);
+
+		len += n;
+		if (n < SEG_SIZE)
+			break;
+	}
+	if (len < SB_CNT * SECTOR_SIZE || ferror(fp)) {
+		fprintf(stderr, "%s: not a logstor image\n", path);
+		exit(1);
+	}
+	if (fgetc(fp) != EOF) {
+		fprintf(stderr, "%s: the image is larger than the RAM disk\n", path);
+		exit(1);
+	}
+	fclose(fp);
+}
+
+// save the volume on the RAM disk to @path
+static void
+image_save(const char *path)
+{
+	struct _superblock *sbp = (struct _superblock *)ram_sec(0);
+	uint32_t seg_cnt = sbp->seg_cnt;
+	FILE *fp;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	// the image is the segments in order, whatever the devices are
+	for (uint32_t sega = 0; sega < seg_cnt; ++sega)
+		if (fwrite(ram_sec(sega2sa(sega)), 1, SEG_SIZE, fp) != SEG_SIZE) {
+			perror(path);
+			exit(1);
+		}
+	if (fclose(fp) != 0) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static void
+usage(const char *prog)
+{
+
+	fprintf(stderr,
+	    "usage: %s [options]\n"
+	    "  -j threads    number of threads (the number of CPUs)\n"
+	    "  -i image      check the image instead of creating a volume\n"
+	    "  -o image      save the created volume to the image\n"
+	    "  -n count      writes to the created volume (half the blocks)\n"
+	    "  -S KiB        segment size of the created volume (the zone size or %u)\n"
+	    "  -C            compress the data blocks of the created volume\n"
+	    "  -D            deduplicate the data blocks of the created volume\n"
+	    "  -c            verify the checksum of the live sectors\n"
+	    "  -s            double mapped sectors are errors\n"
+	    "  -l            also run logstor_check() and time it\n",
+	    prog, SECTOR_SIZE << SEG_SHIFT_DEFAULT >> 10);
+	exit(1);
+}
+
+static void
+parse_args(int argc, char *argv[])
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "j:i:o:n:S:CDcslh")) != -1) {
+		switch (ch) {
+		case 'j':
+			conf.thread_cnt = atoi(optarg);
+			break;
+		case 'i':
+			conf.input = optarg;
+			break;
+		case 'o':
+			conf.output = optarg;
+			break;
+		case 'n':
+			conf.write_cnt = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			conf.seg_size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'C':
+			conf.compress = true;
+			break;
+		case 'D':
+			conf.dedup = true;
+			break;
+		case 'c':
+			conf.csum = true;
+			break;
+		case 's':
+			conf.strict = true;
+			break;
+		case 'l':
+			conf.compare = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || conf.thread_cnt < 0 ||
+	    (conf.input != NULL && conf.output != NULL))
+		usage(argv[0]);
+	if (conf.thread_cnt == 0)
+		conf.thread_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t err_cnt;
+
+	parse_args(argc, argv);
+	if (conf.input != NULL)
+		image_load(conf.input);
+	else {
+		volume_create();
+		if (conf.output != NULL)
+			image_save(conf.output);
+	}
+	err_cnt = logstor_check_offline();
+	printf("%lu errors\n", err_cnt);
+
+	if (conf.compare) {
+		struct g_logstor_softc *sc;
+		uint64_t start;
+
+		// logstor_check() is also run by logstor_open() in the debug build
+		sc = logstor_open();
+		start = time_ns();
+		logstor_check(sc);
+		printf("logstor_check seconds %.3f\n", (time_ns() - start) / 1e9);
+		logstor_close(sc);
+	}
+	logstor_fini();
+	return err_cnt != 0;
+}
@@ -0,0 +1,94 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  Measure the cost of the sector checksum against the 4K write latency
+  of logstor. logstor.c is included so that both are built with -O2.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "logstor.c"
+
+#define	RAND_SEED	0
+#define CSUM_LOOP_COUNT	1000000
+
+static uint64_t
+time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+Description:
+    Return the average time in ns to checksum a sector
+*/
+static double
+csum_time(uint32_t (*csum)(uint32_t crc, const void *buf, size_t len))
+{
+	uint32_t buf[SECTOR_SIZE/4];
+	uint32_t crc = 0;
+	uint64_t start;
+
+	for (int i = 0; i < SECTOR_SIZE/4; ++i)
+		buf[i] = random();
+	start = time_ns();
+	for (int i = 0; i < CSUM_LOOP_COUNT; ++i) {
+		buf[0] = i;
+		crc ^= csum(0, buf, SECTOR_SIZE);
+	}
+	// use the result so the loop is not optimized out
+	if (crc == 0x12345678)
+		printf("\n");
+	return (double)(time_ns() - start) / CSUM_LOOP_COUNT;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct g_logstor_softc *sc;
+	uint32_t buf[SECTOR_SIZE/4];
+	uint32_t block_cnt, write_cnt;
+	uint64_t start;
+	double wr_ns, rd_ns, hw_ns, sw_ns;
+
+	srandom(RAND_SEED);
+	block_cnt = logstor_init_disk();
+	write_cnt = block_cnt / 4;
+	sc = logstor_open();
+
+	for (int i = 0; i < SECTOR_SIZE/4; ++i)
+		buf[i] = random();
+	start = time_ns();
+	for (uint32_t i = 0; i < write_cnt; ++i) {
+		buf[0] = i;
+		logstor_write(sc, random() % block_cnt, buf, 0);
+	}
+	wr_ns = (double)(time_ns() - start) / write_cnt;
+
+	start = time_ns();
+	for (uint32_t i = 0; i < write_cnt; ++i)
+		logstor_read(sc, random() % block_cnt, buf);
+	rd_ns = (double)(time_ns() - start) / write_cnt;
+
+	logstor_close(sc);
+	logstor_fini();
+
+	hw_ns = csum_time(crc32c);
+	sw_ns = csum_time(crc32c_sw);
+	printf("4K write %.1f ns, 4K read %.1f ns\n", wr_ns, rd_ns);
+	printf("crc32c %s %.1f ns, %.2f%% of write\n",
+	    crc32c_impl(), hw_ns, hw_ns * 100 / wr_ns);
+	printf("crc32c software %.1f ns, %.2f%% of write\n",
+	    sw_ns, sw_ns * 100 / wr_ns);
+	return 0;
+}
@@ -0,0 +1,405 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  Microbenchmarks of the forward map cache
+
+  logstor.c is included so the static functions of the fbuf cache can be
+  called directly. Each benchmark runs single threaded with sc_mtx held,
+  on a cache of the given size, and prints the time per operation in ns
+  and in time stamp counter cycles.
+
+    search_hit    fbuf_search for leaves in the cache
+    search_miss   fbuf_search for leaves not in the cache
+    access_hit    fbuf_access for leaves in the cache
+    access        fbuf_access over all the leaves, split by the depth of
+                  the miss: hit, leaf missed and leaf and parent missed
+    alloc         fbuf_alloc with the given number of hits between the
+                  allocations, which sets the length of the clock sweep
+    write_clean   file_write_4byte to a clean leaf, moving it to the
+                  dirty queue
+    write_dirty   file_write_4byte to a dirty leaf
+    cache_flush   fbuf_cache_flush of the given number of dirty leaves
+
+  The asserts of logstor.h are compiled in when MY_DEBUG is defined so
+  the absolute numbers are of that build.
+*/
+#include "logstor.c"
+
+#include <unistd.h>
+
+enum {
+	MB_SEARCH_HIT,
+	MB_SEARCH_MISS,
+	MB_ACCESS_HIT,
+	MB_ACCESS_MISS0,
+	MB_ACCESS_MISS1,
+	MB_ACCESS_MISS2,
+	MB_ALLOC,
+	MB_WRITE_CLEAN,
+	MB_WRITE_DIRTY,
+	MB_CACHE_FLUSH,
+	MB_CNT,
+};
+
+static const char *mb_name[MB_CNT] = {
+	[MB_SEARCH_HIT] = "search_hit",
+	[MB_SEARCH_MISS] = "search_miss",
+	[MB_ACCESS_HIT] = "access_hit",
+	[MB_ACCESS_MISS0] = "access/hit",
+	[MB_ACCESS_MISS1] = "access/miss1",
+	[MB_ACCESS_MISS2] = "access/miss2",
+	[MB_ALLOC] = "alloc",
+	[MB_WRITE_CLEAN] = "write_clean",
+	[MB_WRITE_DIRTY] = "write_dirty",
+	[MB_CACHE_FLUSH] = "cache_flush",
+};
+
+struct micro_conf {
+	int fbuf_cnt;		// number of fbufs in the cache
+	int ws_pct;		// leaves accessed by the hit benchmarks in percent of the cache
+	uint64_t op_cnt;	// operations of each benchmark
+	int alloc_hits;		// hits between two allocations
+	int flush_dirty;	// dirty leaves for each cache flush
+	bool seq;		// access the leaves sequentially instead of randomly
+	unsigned seed;
+};
+
+static struct micro_conf conf = {
+	.fbuf_cnt = 512,
+	.ws_pct = 50,
+	.op_cnt = 1000000,
+	.alloc_hits = 4,
+	.flush_dirty = 256,
+	.seed = 0,
+};
+
+#define	LEAF_INDEX_CNT	(1u << (IDX_BITS * 2))
+
+static struct {
+	uint64_t cnt;
+	uint64_t ticks;
+} mb[MB_CNT];
+
+static double ns_per_tick;
+static uint32_t leaf_cnt;	// number of leaves of the mapping file
+static uint32_t *leaf;		// the leaves to access for each operation
+static uint8_t fd;
+
+static inline uint64_t
+ticks(void)
+{
+#if defined(__x86_64__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+#else
+	return stats_time();
+#endif
+}
+
+// the ns of a tick, measured against CLOCK_MONOTONIC
+static void
+ticks_calibrate(void)
+{
+	struct timespec ts = { .tv_nsec = 100000000 };
+	uint64_t ns, t;
+
+	ns = stats_time();
+	t = ticks();
+	while (nanosleep(&ts, &ts) != 0)
+		;
+	ns_per_tick = (double)(stats_time() - ns) / (ticks() - t);
+}
+
+static inline union fbuf_addr
+leaf_ma(uint32_t index)
+{
+	union fbuf_addr ma = {.meta = 0x7F};
+
+	ma.index = index;
+	ma.depth = FBUF_LEAF_DEPTH;
+	ma.fd = fd;
+	return ma;
+}
+
+// fill @leaf with leaf indexes in [0, @n)
+static void
+leaf_fill(uint32_t n)
+{
+
+	for (uint64_t i = 0; i < conf.op_cnt; ++i)
+		leaf[i] = conf.seq ? i % n : random() % n;
+}
+
+// bring the leaves [0, @n) into the cache
+static void
+leaf_load(uint32_t n)
+{
+
+	for (uint32_t i = 0; i < n; ++i) {
+		fbuf_clean_queue_check(&softc);
+		fbuf_access(&softc, leaf_ma(i));
+	}
+}
+
+static uint32_t
+ws_cnt(void)
+{
+	uint32_t n = (uint64_t)conf.fbuf_cnt * conf.ws_pct / 100;
+
+	return MAX(1, MIN(n, leaf_cnt));
+}
+
+static void
+bench_search(struct g_logstor_softc *sc)
+{
+	uint32_t n = ws_cnt();
+	struct _fbuf *fbuf;
+	uint64_t sum = 0;
+	uint64_t start;
+
+	leaf_load(n);
+	leaf_fill(n);
+	start = ticks();
+	for (uint64_t i = 0; i < conf.op_cnt; ++i)
+		sum += fbuf_search(sc, leaf_ma(leaf[i])) != NULL;
+	mb[MB_SEARCH_HIT].ticks += ticks() - start;
+	mb[MB_SEARCH_HIT].cnt += conf.op_cnt;
+
+	// the leaves past the end of the file are never in the cache
+	start = ticks();
+	for (uint64_t i = 0; i < conf.op_cnt; ++i)
+		sum += fbuf_search(sc, leaf_ma(leaf_cnt + leaf[i])) != NULL;
+	mb[MB_SEARCH_MISS].ticks += ticks() - start;
+	mb[MB_SEARCH_MISS].cnt += conf.op_cnt;
+
+	start = ticks();
+	for (uint64_t i = 0; i < conf.op_cnt; ++i) {
+		fbuf = fbuf_access(sc, leaf_ma(leaf[i]));
+		sum += fbuf->data[0];
+	}
+	mb[MB_ACCESS_HIT].ticks += ticks() - start;
+	mb[MB_ACCESS_HIT].cnt += conf.op_cnt;
+
+	// use the result so the loops are not optimized out
+	if (sum == 1)
+		printf("\n");
+}
+
+/*
+Description:
+    Access all the leaves and classify each access by the depth of the
+    miss, which is found by searching for the leaf and its parent first
+*/
+static void
+bench_access(struct g_logstor_softc *sc)
+{
+	union fbuf_addr ma;
+	unsigned pindex;
+	uint64_t start;
+	int which;
+
+	leaf_fill(leaf_cnt);
+	for (uint64_t i = 0; i < conf.op_cnt; ++i) {
+		ma = leaf_ma(leaf[i]);
+		fbuf_clean_queue_check(sc);
+		if (fbuf_search(sc, ma) != NULL)
+			which = MB_ACCESS_MISS0;
+		else if (fbuf_search(sc, ma2pma(ma, &pindex)) != NULL)
+			which = MB_ACCESS_MISS1;
+		else
+			which = MB_ACCESS_MISS2;
+		start = ticks();
+		fbuf_access(sc, ma);
+		mb[which].ticks += ticks() - start;
+		++mb[which].cnt;
+	}
+}
+
+/*
+Description:
+    Allocate the fbufs for leaves past the end of the file
+    The hits in between set the accessed bits that the clock sweep of
+    fbuf_alloc() clears. The allocated fbufs are never searched for so
+    they are replaced like any other clean leaf.
+*/
+static void
+bench_alloc(struct g_logstor_softc *sc)
+{
+	uint32_t n = ws_cnt();
+	struct _fbuf *fbuf;
+	uint64_t start;
+	uint64_t k = 0;
+
+	leaf_load(n);
+	leaf_fill(n);
+	for (uint64_t i = 0; i < conf.op_cnt; ++i) {
+		for (int j = 0; j < conf.alloc_hits; ++j, ++k)
+			fbuf_access(sc, leaf_ma(leaf[k % conf.op_cnt]));
+		start = ticks();
+		fbuf = fbuf_alloc(sc, leaf_ma(leaf_cnt + i % (LEAF_INDEX_CNT - leaf_cnt)),
+		    FBUF_LEAF_DEPTH);
+		mb[MB_ALLOC].ticks += ticks() - start;
+		++mb[MB_ALLOC].cnt;
+		fbuf->parent = NULL;
+	}
+}
+
+/*
+Description:
+    Rewrite the mapping of the leaves with their current value so the
+    mapping does not change, and flush the cache every
+    conf.flush_dirty leaves
+*/
+static void
+bench_write(struct g_logstor_softc *sc)
+{
+	uint32_t n = MIN(ws_cnt(), conf.flush_dirty);
+	struct _fbuf *fbuf;
+	uint32_t ba, sa;
+	uint64_t start;
+	uint32_t dirty = 0;
+	int which;
+
+	md_flush(sc);
+	leaf_load(n);
+	leaf_fill(n);
+	for (uint64_t i = 0; i < conf.op_cnt; ++i) {
+		ba = leaf[i] * (SECTOR_SIZE / 4) + i % (SECTOR_SIZE / 4);
+		fbuf = fbuf_search(sc, leaf_ma(leaf[i]));
+		MY_ASSERT(fbuf != NULL);
+		if (fbuf->fc.modified)
+			which = MB_WRITE_DIRTY;
+		else {
+			which = MB_WRITE_CLEAN;
+			++dirty;
+		}
+		sa = file_read_4byte(sc, fd, ba);
+		start = ticks();
+		file_write_4byte(sc, fd, ba, sa);
+		mb[which].ticks += ticks() - start;
+		++mb[which].cnt;
+		if (dirty == n) {
+			start = ticks();
+			fbuf_cache_flush(sc);
+			mb[MB_CACHE_FLUSH].ticks += ticks() - start;
+			++mb[MB_CACHE_FLUSH].cnt;
+			dirty = 0;
+		}
+	}
+	md_flush(sc);
+}
+
+static void
+usage(const char *prog)
+{
+
+	fprintf(stderr,
+	    "usage: %s [options]\n"
+	    "  -c count      fbufs in the cache, logstor uses %d (%d)\n"
+	    "  -l percent    leaves of the hit benchmarks in percent of the cache (%d)\n"
+	    "  -n count      operations of each benchmark (%lu)\n"
+	    "  -a count      hits between two allocations (%d)\n"
+	    "  -d count      dirty leaves for each cache flush (%d)\n"
+	    "  -S            access the leaves sequentially instead of randomly\n"
+	    "  -s seed       random seed (%u)\n",
+	    prog, FBUF_MIN, conf.fbuf_cnt, conf.ws_pct, conf.op_cnt,
+	    conf.alloc_hits, conf.flush_dirty, conf.seed);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct g_logstor_softc *sc;
+	uint32_t buf[SECTOR_SIZE/4];
+	uint32_t block_cnt;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "c:l:n:a:d:Ss:h")) != -1) {
+		switch (ch) {
+		case 'c':
+			conf.fbuf_cnt = atoi(optarg);
+			break;
+		case 'l':
+			conf.ws_pct = atoi(optarg);
+			break;
+		case 'n':
+			conf.op_cnt = strtoull(optarg, NULL, 0);
+			break;
+		case 'a':
+			conf.alloc_hits = atoi(optarg);
+			break;
+		case 'd':
+			conf.flush_dirty = atoi(optarg);
+			break;
+		case 'S':
+			conf.seq = true;
+			break;
+		case 's':
+			conf.seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (conf.fbuf_cnt <= FBUF_CLEAN_THRESHOLD * 2 || conf.ws_pct <= 0 ||
+	    conf.ws_pct > 100 || conf.op_cnt == 0 || conf.alloc_hits < 0 ||
+	    conf.flush_dirty <= 0)
+		usage(argv[0]);
+	leaf = malloc(conf.op_cnt * sizeof(*leaf));
+	if (leaf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	srandom(conf.seed);
+	ticks_calibrate();
+
+	// map one block of every leaf so all the leaves are on the disk
+	block_cnt = logstor_init_disk();
+	sc = logstor_open();
+	leaf_cnt = howmany(block_cnt, SECTOR_SIZE / 4);
+	for (int i = 0; i < SECTOR_SIZE/4; ++i)
+		buf[i] = random();
+	for (uint32_t i = 0; i < leaf_cnt; ++i) {
+		buf[0] = i;
+		logstor_write(sc, i * (SECTOR_SIZE / 4), buf, 0);
+	}
+	logstor_flush(sc);
+
+	pthread_mutex_lock(&sc->sc_mtx);
+	fd = sc->superblock.fd_cur;
+	// replace the cache with one of the size to measure
+	fbuf_mod_fini(sc);
+	fbuf_mod_init(sc, conf.fbuf_cnt);
+	bench_search(sc);
+	bench_access(sc);
+	bench_alloc(sc);
+	bench_write(sc);
+	pthread_mutex_unlock(&sc->sc_mtx);
+
+	printf("fbufs %d, leaves %u, working set %u, %s, %s build, %.3f ns/cycle\n",
+	    conf.fbuf_cnt, leaf_cnt, ws_cnt(), conf.seq ? "sequential" : "random",
+#if defined(MY_DEBUG)
+	    "debug",
+#else
+	    "release",
+#endif
+	    ns_per_tick);
+	printf("%-13s %10s %10s %10s\n", "benchmark", "count", "ns/op", "cycles/op");
+	for (int i = 0; i < MB_CNT; ++i) {
+		if (mb[i].cnt == 0)
+			continue;
+		printf("%-13s %10lu %10.1f %10.1f\n", mb_name[i], mb[i].cnt,
+		    mb[i].ticks * ns_per_tick / mb[i].cnt, (double)mb[i].ticks / mb[i].cnt);
+	}
+
+	free(leaf);
+	logstor_close(sc);
+	logstor_fini();
+	return 0;
+}
@@ -0,0 +1,1339 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  NBD server for logstor
+
+  The logstor disk is exported with the NBD protocol on a Unix socket or
+  on a TCP port of the loopback interface, so it can be attached with
+  nbd-client or used by qemu. Only the fixed newstyle handshake is
+  supported, with the options EXPORT_NAME, INFO, GO, LIST,
+  STRUCTURED_REPLY and ABORT. There is one export and its name is not
+  checked. The requests must be aligned to SECTOR_SIZE, it is advertised
+  as the minimum block size.
+
+  Each connection has a thread that receives its requests and puts them
+  on a queue shared by the worker threads. A worker executes a request
+  on logstor and sends the reply, so the requests of a connection are
+  executed at the same time and complete out of order. A connection has
+  at most CONN_REQ_MAX requests in flight, its replies are serialized by
+  its send lock.
+
+  SIGINT or SIGTERM stops the server. The receiving of the connections is
+  shut down, their threads are joined once their requests in flight are
+  replied, then the workers are stopped and joined before logstor is
+  closed.
+
+  With -c the program is a client instead. It connects to a server,
+  fills the working set and then keeps the queue depth of requests in
+  flight with the addresses of a synthetic workload. The result is
+  printed as JSON in the format of logsbench. With -B the server runs in
+  the same process on a socket pair and the client drives it, so the
+  logstor statistics are in the result too.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if __linux
+#include <endian.h>
+#else
+#include <sys/endian.h>
+#endif
+
+#include "logstor.h"
+#include "logsreport.h"
+#include "logsworkload.h"
+
+// the constants of the NBD protocol
+#define NBD_MAGIC	0x4E42444D41474943ULL	// "NBDMAGIC"
+#define NBD_OPT_MAGIC	0x49484156454F5054ULL	// "IHAVEOPT"
+#define NBD_REP_MAGIC	0x0003E889045565A9ULL
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC	0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC	0x668E33EF
+
+// handshake flags
+#define NBD_FLAG_FIXED_NEWSTYLE	0x1
+#define NBD_FLAG_NO_ZEROES	0x2
+
+// transmission flags
+#define NBD_FLAG_HAS_FLAGS	0x1
+#define NBD_FLAG_SEND_FLUSH	0x4
+#define NBD_FLAG_SEND_FUA	0x8
+#define NBD_FLAG_SEND_TRIM	0x20
+#define NBD_FLAG_CAN_MULTI_CONN	0x100
+
+enum {
+	NBD_OPT_EXPORT_NAME = 1,
+	NBD_OPT_ABORT = 2,
+	NBD_OPT_LIST = 3,
+	NBD_OPT_INFO = 6,
+	NBD_OPT_GO = 7,
+	NBD_OPT_STRUCTURED_REPLY = 8,
+};
+
+#define NBD_REP_ACK	1
+#define NBD_REP_SERVER	2
+#define NBD_REP_INFO	3
+#define NBD_REP_ERR_UNSUP	0x80000001
+#define NBD_REP_ERR_INVALID	0x80000003
+
+#define NBD_INFO_EXPORT	0
+#define NBD_INFO_BLOCK_SIZE	3
+
+enum {
+	NBD_CMD_READ = 0,
+	NBD_CMD_WRITE = 1,
+	NBD_CMD_DISC = 2,
+	NBD_CMD_FLUSH = 3,
+	NBD_CMD_TRIM = 4,
+};
+
+#define NBD_CMD_FLAG_FUA	0x1
+
+#define NBD_REPLY_FLAG_DONE	0x1
+#define NBD_REPLY_TYPE_NONE	0
+#define NBD_REPLY_TYPE_OFFSET_DATA	1
+#define NBD_REPLY_TYPE_ERROR	0x8001
+
+#define NBD_EIO		5
+#define NBD_ENOMEM	12
+#define NBD_EINVAL	22
+#define NBD_ENOSPC	28
+
+#define NBD_MAX_LEN	(32 << 20)	// the largest request
+#define NBD_OPT_MAX	4096	// the longest option data
+#define NBD_EXPORT_NAME	"logstor"
+
+#define CONN_REQ_MAX	256	// requests in flight on a connection
+#define FILL_BLOCKS	64	// blocks in a request that fills the working set
+
+enum {
+	MODE_SERVER,
+	MODE_CLIENT,
+	MODE_BENCH,	// the server and the client in one process
+};
+
+struct nbd_conf {
+	int mode;
+	const char *path;	// the Unix socket
+	int port;		// the TCP port on the loopback interface
+	int worker_cnt;
+	bool compress;
+	bool dedup;
+	unsigned wbuf;		// blocks in the write buffer, 0 for none
+	unsigned rcache;	// blocks in the read cache, 0 for none
+	// the client
+	int workload;
+	double zipf_theta;
+	int hot_pct;
+	int hot_access_pct;
+	int read_pct;
+	int trim_pct;
+	int fill_pct;
+	int duration;		// in seconds
+	uint64_t op_cnt;	// total operations, 0 means run for the duration
+	int depth;		// requests in flight
+	unsigned req_blocks;	// blocks in a read, write or trim
+	bool simple;		// do not ask for structured replies
+	unsigned seed;
+	const char *output;	// the file for the result, NULL for stdout
+};
+
+static struct nbd_conf conf = {
+	.mode = MODE_SERVER,
+	.worker_cnt = 4,
+	.workload = WL_UNIFORM,
+	.zipf_theta = 0.99,
+	.hot_pct = 20,
+	.hot_access_pct = 80,
+	.read_pct = 50,
+	.trim_pct = 0,
+	.fill_pct = 80,
+	.duration = 10,
+	.depth = 32,
+	.req_blocks = 1,
+};
+
+struct conn {
+	LIST_ENTRY(conn) link;	// on conn_list
+	pthread_t tid;
+	bool done;		// the thread has ended, protected by conn_mtx
+	int fd;
+	bool structured;	// the client asked for structured replies
+	int req_cnt;		// requests in flight
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;	// a request is done
+	pthread_mutex_t send_mtx;
+};
+
+struct req {
+	TAILQ_ENTRY(req) link;
+	struct conn *conn;
+	uint64_t cookie;
+	uint64_t from;
+	uint32_t len;
+	uint16_t type;
+	uint16_t flags;
+	int error;	// NBD_EXXX, the request is not executed if not 0
+	char *buf;
+};
+
+static struct g_logstor_softc *sc;
+static uint64_t export_size;
+static TAILQ_HEAD(, req) req_queue = TAILQ_HEAD_INITIALIZER(req_queue);
+static pthread_mutex_t req_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t req_cv = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t stop;
+static LIST_HEAD(, conn) conn_list = LIST_HEAD_INITIALIZER(conn_list);
+static pthread_mutex_t conn_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t *workers;
+static bool workers_stop;	// protected by req_mtx
+
+static inline void
+put16(uint8_t *p, uint16_t v)
+{
+	v = htobe16(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void
+put32(uint8_t *p, uint32_t v)
+{
+	v = htobe32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void
+put64(uint8_t *p, uint64_t v)
+{
+	v = htobe64(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline uint16_t
+get16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return be16toh(v);
+}
+
+static inline uint32_t
+get32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return be32toh(v);
+}
+
+static inline uint64_t
+get64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return be64toh(v);
+}
+
+// read exactly @len bytes, -1 on an error or the end of the stream
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len != 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// write all the buffers of @iov, they are modified
+static int
+writev_full(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt != 0) {
+		n = writev(fd, iov, cnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		for (; cnt != 0 && (size_t)n >= iov->iov_len; ++iov, --cnt)
+			n -= iov->iov_len;
+		if (cnt != 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static int
+write_full(int fd, const void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return writev_full(fd, &iov, 1);
+}
+
+static void *
+xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	return p;
+}
+
+/*******************************
+ *          server             *
+ *******************************/
+
+static int
+opt_reply(int fd, uint32_t opt, uint32_t type, const void *data, uint32_t len)
+{
+	uint8_t hdr[20];
+	struct iovec iov[2] = {
+		{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = (void *)data, .iov_len = len },
+	};
+
+	put64(hdr, NBD_REP_MAGIC);
+	put32(hdr + 8, opt);
+	put32(hdr + 12, type);
+	put32(hdr + 16, len);
+	return writev_full(fd, iov, len == 0 ? 1 : 2);
+}
+
+static uint16_t
+trans_flags(void)
+{
+
+	return NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+	    NBD_FLAG_SEND_TRIM | NBD_FLAG_CAN_MULTI_CONN;
+}
+
+/*
+Description:
+    Reply to NBD_OPT_INFO or NBD_OPT_GO with the data @data of @len bytes
+Return:
+    1 if the export is described, 0 if the option is bad, -1 on an error
+*/
+static int
+opt_info(int fd, uint32_t opt, const uint8_t *data, uint32_t len)
+{
+	uint8_t info[14];
+	uint32_t name_len;
+
+	if (len < 6 || (name_len = get32(data)) > len - 6 ||
+	    len != 6 + name_len + 2 * get16(data + 4 + name_len))
+		return opt_reply(fd, opt, NBD_REP_ERR_INVALID, NULL, 0) != 0 ? -1 : 0;
+	put16(info, NBD_INFO_EXPORT);
+	put64(info + 2, export_size);
+	put16(info + 10, trans_flags());
+	if (opt_reply(fd, opt, NBD_REP_INFO, info, 12) != 0)
+		return -1;
+	// the block size is sent even if it is not asked for, the requests
+	// smaller than a sector are rejected
+	put16(info, NBD_INFO_BLOCK_SIZE);
+	put32(info + 2, SECTOR_SIZE);
+	put32(info + 6, SECTOR_SIZE);
+	put32(info + 10, NBD_MAX_LEN);
+	if (opt_reply(fd, opt, NBD_REP_INFO, info, 14) != 0)
+		return -1;
+	return opt_reply(fd, opt, NBD_REP_ACK, NULL, 0) != 0 ? -1 : 1;
+}
+
+/*
+Description:
+    Do the handshake of the connection @c
+Return:
+    0 to start the transmission, -1 to close the connection
+*/
+static int
+handshake(struct conn *c)
+{
+	uint8_t buf[NBD_OPT_MAX];
+	uint8_t hdr[18];
+	uint32_t flags, opt, len;
+	bool no_zeroes;
+	int rc;
+
+	put64(hdr, NBD_MAGIC);
+	put64(hdr + 8, NBD_OPT_MAGIC);
+	put16(hdr + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (write_full(c->fd, hdr, 18) != 0 || read_full(c->fd, hdr, 4) != 0)
+		return -1;
+	flags = get32(hdr);
+	if ((flags & NBD_FLAG_FIXED_NEWSTYLE) == 0)
+		return -1;
+	no_zeroes = (flags & NBD_FLAG_NO_ZEROES) != 0;
+	for (;;) {
+		if (read_full(c->fd, hdr, 16) != 0 || get64(hdr) != NBD_OPT_MAGIC)
+			return -1;
+		opt = get32(hdr + 8);
+		len = get32(hdr + 12);
+		if (len > sizeof(buf) || read_full(c->fd, buf, len) != 0)
+			return -1;
+		switch (opt) {
+		case NBD_OPT_EXPORT_NAME:
+			memset(buf, 0, 134);
+			put64(buf, export_size);
+			put16(buf + 8, trans_flags());
+			return write_full(c->fd, buf, no_zeroes ? 10 : 134);
+		case NBD_OPT_ABORT:
+			opt_reply(c->fd, opt, NBD_REP_ACK, NULL, 0);
+			return -1;
+		case NBD_OPT_LIST:
+			put32(buf, strlen(NBD_EXPORT_NAME));
+			memcpy(buf + 4, NBD_EXPORT_NAME, strlen(NBD_EXPORT_NAME));
+			if (opt_reply(c->fd, opt, NBD_REP_SERVER, buf, 4 + strlen(NBD_EXPORT_NAME)) != 0 ||
+			    opt_reply(c->fd, opt, NBD_REP_ACK, NULL, 0) != 0)
+				return -1;
+			break;
+		case NBD_OPT_STRUCTURED_REPLY:
+			if (len != 0) {
+				if (opt_reply(c->fd, opt, NBD_REP_ERR_INVALID, NULL, 0) != 0)
+					return -1;
+				break;
+			}
+			c->structured = true;
+			if (opt_reply(c->fd, opt, NBD_REP_ACK, NULL, 0) != 0)
+				return -1;
+			break;
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			// a bad NBD_OPT_GO is answered with an error and the
+			// client may try again
+			if ((rc = opt_info(c->fd, opt, buf, len)) < 0)
+				return -1;
+			if (opt == NBD_OPT_GO && rc == 1)
+				return 0;
+			break;
+		default:
+			if (opt_reply(c->fd, opt, NBD_REP_ERR_UNSUP, NULL, 0) != 0)
+				return -1;
+		}
+	}
+}
+
+static void
+reply_send(struct req *req, int error)
+{
+	struct conn *c = req->conn;
+	uint8_t hdr[28];
+	struct iovec iov[2] = {
+		{ .iov_base = hdr },
+		{ .iov_base = req->buf, .iov_len = req->len },
+	};
+	bool data = error == 0 && req->type == NBD_CMD_READ;
+
+	if (c->structured) {
+		put32(hdr, NBD_STRUCTURED_REPLY_MAGIC);
+		put16(hdr + 4, NBD_REPLY_FLAG_DONE);
+		put64(hdr + 8, req->cookie);
+		if (error != 0) {
+			put16(hdr + 6, NBD_REPLY_TYPE_ERROR);
+			put32(hdr + 16, 6);
+			put32(hdr + 20, error);
+			put16(hdr + 24, 0);	// no message
+			iov[0].iov_len = 26;
+		} else if (data) {
+			put16(hdr + 6, NBD_REPLY_TYPE_OFFSET_DATA);
+			put32(hdr + 16, 8 + req->len);
+			put64(hdr + 20, req->from);
+			iov[0].iov_len = 28;
+		} else {
+			put16(hdr + 6, NBD_REPLY_TYPE_NONE);
+			put32(hdr + 16, 0);
+			iov[0].iov_len = 20;
+		}
+	} else {
+		put32(hdr, NBD_SIMPLE_REPLY_MAGIC);
+		put32(hdr + 4, error);
+		put64(hdr + 8, req->cookie);
+		iov[0].iov_len = 16;
+	}
+	// a failed send ends the connection when its next request is received
+	pthread_mutex_lock(&c->send_mtx);
+	writev_full(c->fd, iov, data ? 2 : 1);
+	pthread_mutex_unlock(&c->send_mtx);
+}
+
+static int
+req_exec(struct req *req)
+{
+	uint32_t ba = req->from / SECTOR_SIZE;
+	uint32_t cnt = req->len / SECTOR_SIZE;
+	bool fua = (req->flags & NBD_CMD_FLAG_FUA) != 0;
+
+	switch (req->type) {
+	case NBD_CMD_READ:
+		for (uint32_t i = 0; i < cnt; ++i)
+			logstor_read(sc, ba + i, req->buf + (size_t)i * SECTOR_SIZE);
+		break;
+	case NBD_CMD_WRITE:
+		// a FUA write is made durable by one flush, not one per block
+		for (uint32_t i = 0; i < cnt; ++i)
+			logstor_write(sc, ba + i, req->buf + (size_t)i * SECTOR_SIZE, 0);
+		if (fua && logstor_flush(sc) != 0)
+			return NBD_EIO;
+		break;
+	case NBD_CMD_TRIM:
+		if (cnt != 0)
+			logstor_delete(sc, req->from, NULL, req->len);
+		if (fua && logstor_flush(sc) != 0)
+			return NBD_EIO;
+		break;
+	case NBD_CMD_FLUSH:
+		if (logstor_flush(sc) != 0)
+			return NBD_EIO;
+		break;
+	}
+	return 0;
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct req *req;
+	struct conn *c;
+	int error;
+
+	for (;;) {
+		pthread_mutex_lock(&req_mtx);
+		while ((req = TAILQ_FIRST(&req_queue)) == NULL && !workers_stop)
+			pthread_cond_wait(&req_cv, &req_mtx);
+		if (req == NULL) {
+			pthread_mutex_unlock(&req_mtx);
+			break;
+		}
+		TAILQ_REMOVE(&req_queue, req, link);
+		pthread_mutex_unlock(&req_mtx);
+
+		error = req->error != 0 ? req->error : req_exec(req);
+		reply_send(req, error);
+		c = req->conn;
+		free(req->buf);
+		free(req);
+		pthread_mutex_lock(&c->mtx);
+		--c->req_cnt;
+		pthread_cond_signal(&c->cv);
+		pthread_mutex_unlock(&c->mtx);
+	}
+	return NULL;
+}
+
+// check the range of the request @req
+static int
+req_check(const struct req *req)
+{
+
+	if (req->type == NBD_CMD_FLUSH)
+		return 0;
+	if (req->type != NBD_CMD_READ && req->type != NBD_CMD_WRITE &&
+	    req->type != NBD_CMD_TRIM)
+		return NBD_EINVAL;
+	if (req->from % SECTOR_SIZE != 0 || req->len % SECTOR_SIZE != 0)
+		return NBD_EINVAL;
+	if (req->from > export_size || req->len > export_size - req->from)
+		return req->type == NBD_CMD_WRITE ? NBD_ENOSPC : NBD_EINVAL;
+	return 0;
+}
+
+/*
+Description:
+    Receive the requests of the connection @arg and queue them to the
+    workers until the client disconnects
+*/
+static void *
+conn_thread(void *arg)
+{
+	struct conn *c = arg;
+	struct req *req;
+	uint8_t hdr[28];
+
+	if (handshake(c) != 0)
+		goto out;
+	for (;;) {
+		if (read_full(c->fd, hdr, sizeof(hdr)) != 0 ||
+		    get32(hdr) != NBD_REQUEST_MAGIC)
+			break;
+		req = xmalloc(sizeof(*req));
+		req->conn = c;
+		req->flags = get16(hdr + 4);
+		req->type = get16(hdr + 6);
+		req->cookie = get64(hdr + 8);
+		req->from = get64(hdr + 16);
+		req->len = get32(hdr + 24);
+		req->buf = NULL;
+		if (req->type == NBD_CMD_DISC) {
+			free(req);
+			break;
+		}
+		// the data of a write is received even if the request is bad
+		if (req->len > NBD_MAX_LEN &&
+		    (req->type == NBD_CMD_READ || req->type == NBD_CMD_WRITE)) {
+			free(req);
+			break;
+		}
+		req->error = req_check(req);
+		if (req->type == NBD_CMD_READ || req->type == NBD_CMD_WRITE) {
+			req->buf = malloc(req->len);
+			if (req->buf == NULL) {
+				free(req);
+				break;
+			}
+		}
+		if (req->type == NBD_CMD_WRITE &&
+		    read_full(c->fd, req->buf, req->len) != 0) {
+			free(req->buf);
+			free(req);
+			break;
+		}
+
+		pthread_mutex_lock(&c->mtx);
+		while (c->req_cnt == CONN_REQ_MAX)
+			pthread_cond_wait(&c->cv, &c->mtx);
+		++c->req_cnt;
+		pthread_mutex_unlock(&c->mtx);
+		pthread_mutex_lock(&req_mtx);
+		TAILQ_INSERT_TAIL(&req_queue, req, link);
+		pthread_cond_signal(&req_cv);
+		pthread_mutex_unlock(&req_mtx);
+	}
+	// the requests in flight are replied before the connection is closed
+	pthread_mutex_lock(&c->mtx);
+	while (c->req_cnt != 0)
+		pthread_cond_wait(&c->cv, &c->mtx);
+	pthread_mutex_unlock(&c->mtx);
+out:
+	// the fd is closed by conn_reap() so it is not reused while the
+	// connection is on the list
+	shutdown(c->fd, SHUT_RDWR);
+	pthread_mutex_lock(&conn_mtx);
+	c->done = true;
+	pthread_mutex_unlock(&conn_mtx);
+	return NULL;
+}
+
+// start a thread of the server, the signals that stop it go to the main thread
+static pthread_t
+thread_start(void *(*func)(void *), void *arg)
+{
+	sigset_t set, oset;
+	pthread_t tid;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	if (pthread_create(&tid, NULL, func, arg) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	return tid;
+}
+
+static void
+conn_start(int fd)
+{
+	struct conn *c = calloc(1, sizeof(*c));
+
+	if (c == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	c->fd = fd;
+	pthread_mutex_init(&c->mtx, NULL);
+	pthread_cond_init(&c->cv, NULL);
+	pthread_mutex_init(&c->send_mtx, NULL);
+	pthread_mutex_lock(&conn_mtx);
+	LIST_INSERT_HEAD(&conn_list, c, link);
+	c->tid = thread_start(conn_thread, c);
+	pthread_mutex_unlock(&conn_mtx);
+}
+
+/*
+Description:
+    Join and free the connections that have ended. With @all the
+    receiving of the others is shut down and they are joined too, the
+    requests in flight are still replied.
+*/
+static void
+conn_reap(bool all)
+{
+	LIST_HEAD(, conn) ended = LIST_HEAD_INITIALIZER(ended);
+	struct conn *c, *next;
+
+	pthread_mutex_lock(&conn_mtx);
+	for (c = LIST_FIRST(&conn_list); c != NULL; c = next) {
+		next = LIST_NEXT(c, link);
+		if (!all && !c->done)
+			continue;
+		if (!c->done)
+			shutdown(c->fd, SHUT_RD);
+		LIST_REMOVE(c, link);
+		LIST_INSERT_HEAD(&ended, c, link);
+	}
+	pthread_mutex_unlock(&conn_mtx);
+	while ((c = LIST_FIRST(&ended)) != NULL) {
+		LIST_REMOVE(c, link);
+		pthread_join(c->tid, NULL);
+		close(c->fd);
+		pthread_mutex_destroy(&c->mtx);
+		pthread_cond_destroy(&c->cv);
+		pthread_mutex_destroy(&c->send_mtx);
+		free(c);
+	}
+}
+
+static void
+server_init(void)
+{
+
+	export_size = (uint64_t)logstor_init_disk() * SECTOR_SIZE;
+	sc = logstor_open();
+	logstor_set_compress(sc, conf.compress);
+	logstor_set_dedup(sc, conf.dedup);
+	logstor_set_wbuf(sc, conf.wbuf);
+	logstor_set_rcache(sc, conf.rcache);
+	workers = xmalloc(conf.worker_cnt * sizeof(*workers));
+	for (int i = 0; i < conf.worker_cnt; ++i)
+		workers[i] = thread_start(worker_thread, NULL);
+}
+
+static void
+server_fini(void)
+{
+
+	// the connections wait for their requests in flight, so the workers
+	// have no request left when they are stopped
+	conn_reap(true);
+	pthread_mutex_lock(&req_mtx);
+	workers_stop = true;
+	pthread_cond_broadcast(&req_cv);
+	pthread_mutex_unlock(&req_mtx);
+	for (int i = 0; i < conf.worker_cnt; ++i)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	logstor_close(sc);
+	logstor_fini();
+}
+
+static void
+stop_handler(int sig)
+{
+
+	stop = 1;
+}
+
+static void
+server(void)
+{
+	struct sigaction sa = { .sa_handler = stop_handler };
+	int lfd, fd, on = 1;
+
+	if (conf.path != NULL) {
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+		if (strlen(conf.path) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "%s: the path is too long\n", conf.path);
+			exit(1);
+		}
+		strcpy(sun.sun_path, conf.path);
+		unlink(conf.path);
+		lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (lfd < 0 || bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+			perror(conf.path);
+			exit(1);
+		}
+	} else {
+		struct sockaddr_in sin = {
+			.sin_family = AF_INET,
+			.sin_port = htons(conf.port),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+
+		lfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (lfd >= 0)
+			setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (lfd < 0 || bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+			perror("bind");
+			exit(1);
+		}
+	}
+	if (listen(lfd, 16) != 0) {
+		perror("listen");
+		exit(1);
+	}
+	server_init();
+	// accept() is interrupted by the signals to stop the server
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	while (!stop) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+		if (conf.path == NULL)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		conn_start(fd);
+		conn_reap(false);
+	}
+	close(lfd);
+	if (conf.path != NULL)
+		unlink(conf.path);
+	server_fini();
+}
+
+/*******************************
+ *          client             *
+ *******************************/
+
+struct slot {
+	uint64_t start_ns;
+	uint32_t len;
+	int op;		// REP_XXX
+	int next;	// the next free slot
+};
+
+struct client {
+	int fd;
+	bool structured;
+	uint64_t size;
+	struct slot *slots;
+	int free;	// the first free slot, -1 if none
+	int busy;	// slots in use
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;	// a slot is freed
+	struct report_thread rt;	// only the receiver thread adds to it
+	int error;	// the first error replied
+	char *rbuf;	// the data of a read reply
+	size_t rbuf_len;
+};
+
+static struct client cl;
+
+static void
+client_fail(const char *msg)
+{
+
+	fprintf(stderr, "%s\n", msg);
+	exit(1);
+}
+
+// read the reply of option @opt, return its type and put its data in @data
+static uint32_t
+opt_reply_read(uint32_t opt, uint8_t *data, uint32_t *len)
+{
+	uint8_t hdr[20];
+
+	if (read_full(cl.fd, hdr, sizeof(hdr)) != 0 || get64(hdr) != NBD_REP_MAGIC ||
+	    get32(hdr + 8) != opt)
+		client_fail("bad option reply");
+	*len = get32(hdr + 16);
+	if (*len > NBD_OPT_MAX || read_full(cl.fd, data, *len) != 0)
+		client_fail("bad option reply");
+	return get32(hdr + 12);
+}
+
+static void
+client_handshake(void)
+{
+	uint8_t buf[NBD_OPT_MAX];
+	uint32_t type, len;
+
+	if (read_full(cl.fd, buf, 18) != 0 || get64(buf) != NBD_MAGIC ||
+	    get64(buf + 8) != NBD_OPT_MAGIC ||
+	    (get16(buf + 16) & NBD_FLAG_FIXED_NEWSTYLE) == 0)
+		client_fail("not a fixed newstyle NBD server");
+	put32(buf, NBD_FLAG_FIXED_NEWSTYLE | (get16(buf + 16) & NBD_FLAG_NO_ZEROES));
+	if (write_full(cl.fd, buf, 4) != 0)
+		client_fail("handshake failed");
+
+	if (!conf.simple) {
+		put64(buf, NBD_OPT_MAGIC);
+		put32(buf + 8, NBD_OPT_STRUCTURED_REPLY);
+		put32(buf + 12, 0);
+		if (write_full(cl.fd, buf, 16) != 0)
+			client_fail("handshake failed");
+		cl.structured = opt_reply_read(NBD_OPT_STRUCTURED_REPLY, buf, &len) == NBD_REP_ACK;
+	}
+	// go to the default export and ask for the block size
+	put64(buf, NBD_OPT_MAGIC);
+	put32(buf + 8, NBD_OPT_GO);
+	put32(buf + 12, 8);
+	put32(buf + 16, 0);
+	put16(buf + 20, 1);
+	put16(buf + 22, NBD_INFO_BLOCK_SIZE);
+	if (write_full(cl.fd, buf, 24) != 0)
+		client_fail("handshake failed");
+	while ((type = opt_reply_read(NBD_OPT_GO, buf, &len)) != NBD_REP_ACK) {
+		if (type != NBD_REP_INFO)
+			client_fail("the export is refused");
+		if (len >= 12 && get16(buf) == NBD_INFO_EXPORT)
+			cl.size = get64(buf + 2);
+	}
+	if (cl.size < SECTOR_SIZE)
+		client_fail("the export is too small");
+}
+
+static int
+slot_get(void)
+{
+	int i;
+
+	pthread_mutex_lock(&cl.mtx);
+	while (cl.free < 0)
+		pthread_cond_wait(&cl.cv, &cl.mtx);
+	i = cl.free;
+	cl.free = cl.slots[i].next;
+	++cl.busy;
+	pthread_mutex_unlock(&cl.mtx);
+	return i;
+}
+
+static void
+slot_put(int i)
+{
+
+	pthread_mutex_lock(&cl.mtx);
+	cl.slots[i].next = cl.free;
+	cl.free = i;
+	--cl.busy;
+	pthread_cond_broadcast(&cl.cv);
+	pthread_mutex_unlock(&cl.mtx);
+}
+
+// wait until all the requests sent are replied
+static void
+slot_wait_idle(void)
+{
+
+	pthread_mutex_lock(&cl.mtx);
+	while (cl.busy != 0)
+		pthread_cond_wait(&cl.cv, &cl.mtx);
+	pthread_mutex_unlock(&cl.mtx);
+}
+
+static void
+req_send(int op, uint64_t from, uint32_t len, const void *data)
+{
+	static const uint16_t nbd_cmd[REP_CNT] = {
+		[REP_READ] = NBD_CMD_READ,
+		[REP_WRITE] = NBD_CMD_WRITE,
+		[REP_TRIM] = NBD_CMD_TRIM,
+		[REP_FLUSH] = NBD_CMD_FLUSH,
+	};
+	uint8_t hdr[28];
+	struct iovec iov[2] = {
+		{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = (void *)data, .iov_len = len },
+	};
+	int i = slot_get();
+
+	cl.slots[i].op = op;
+	cl.slots[i].len = len;
+	put32(hdr, NBD_REQUEST_MAGIC);
+	put16(hdr + 4, 0);
+	put16(hdr + 6, nbd_cmd[op]);
+	put64(hdr + 8, i);
+	put64(hdr + 16, from);
+	put32(hdr + 24, len);
+	cl.slots[i].start_ns = report_time_ns();
+	if (writev_full(cl.fd, iov, op == REP_WRITE ? 2 : 1) != 0)
+		client_fail("send failed");
+}
+
+// receive the replies until the server closes the connection
+static void *
+recv_thread(void *arg)
+{
+	uint8_t hdr[20];
+	uint64_t cookie;
+	uint32_t len;
+	int error, hdr_len = cl.structured ? 20 : 16;
+	struct slot *s;
+
+	while (read_full(cl.fd, hdr, hdr_len) == 0) {
+		cookie = get64(hdr + 8);
+		if (cookie >= conf.depth)
+			client_fail("bad reply");
+		s = &cl.slots[cookie];
+		error = 0;
+		if (!cl.structured) {
+			if (get32(hdr) != NBD_SIMPLE_REPLY_MAGIC)
+				client_fail("bad reply");
+			error = get32(hdr + 4);
+			if (error == 0 && s->op == REP_READ &&
+			    read_full(cl.fd, cl.rbuf, s->len) != 0)
+				client_fail("bad reply");
+		} else {
+			if (get32(hdr) != NBD_STRUCTURED_REPLY_MAGIC ||
+			    (get16(hdr + 4) & NBD_REPLY_FLAG_DONE) == 0)
+				client_fail("bad reply");
+			len = get32(hdr + 16);
+			if (len > cl.rbuf_len || read_full(cl.fd, cl.rbuf, len) != 0)
+				client_fail("bad reply");
+			if (get16(hdr + 6) == NBD_REPLY_TYPE_ERROR)
+				error = len >= 4 ? get32((uint8_t *)cl.rbuf) : NBD_EIO;
+		}
+		if (error != 0 && cl.error == 0)
+			cl.error = error;
+		report_add(&cl.rt, s->op, s->len, report_time_ns() - s->start_ns);
+		slot_put(cookie);
+	}
+	return NULL;
+}
+
+static int
+client_connect(void)
+{
+	int fd, on = 1;
+
+	if (conf.path != NULL) {
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+		if (strlen(conf.path) >= sizeof(sun.sun_path))
+			client_fail("the path is too long");
+		strcpy(sun.sun_path, conf.path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+			perror(conf.path);
+			exit(1);
+		}
+	} else {
+		struct sockaddr_in sin = {
+			.sin_family = AF_INET,
+			.sin_port = htons(conf.port),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+			perror("connect");
+			exit(1);
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	return fd;
+}
+
+/*
+Description:
+    Fill the working set, then run the workload and print the result
+    @fd is connected to the server
+*/
+static void
+client(int fd)
+{
+	struct wl_gen gen;
+	struct report rep;
+	pthread_t tid;
+	uint64_t rng = (conf.seed + 1) * 0x9E3779B97F4A7C15ULL;
+	uint32_t seq_next = 0, block_cnt, ba, cnt;
+	uint32_t *wbuf;
+	size_t buf_len = (size_t)MAX(conf.req_blocks, FILL_BLOCKS) * SECTOR_SIZE;
+	uint8_t hdr[28];
+	char config[512];
+	int len;
+	FILE *fp = stdout;
+
+	if (conf.output != NULL && (fp = fopen(conf.output, "w")) == NULL) {
+		perror(conf.output);
+		exit(1);
+	}
+	cl.fd = fd;
+	client_handshake();
+	block_cnt = cl.size / SECTOR_SIZE;
+	gen = (struct wl_gen){
+		.workload = conf.workload,
+		.n = (uint64_t)block_cnt * conf.fill_pct / 100,
+		.zipf_theta = conf.zipf_theta,
+		.hot_pct = conf.hot_pct,
+		.hot_access_pct = conf.hot_access_pct,
+	};
+	if (gen.n < conf.req_blocks)
+		client_fail("the working set is smaller than a request");
+	wl_gen_init(&gen);
+	cl.slots = calloc(conf.depth, sizeof(*cl.slots));
+	cl.rbuf_len = buf_len + 8;
+	cl.rbuf = xmalloc(cl.rbuf_len);
+	wbuf = xmalloc(buf_len);
+	if (cl.slots == NULL)
+		client_fail("out of memory");
+	for (int i = 0; i < conf.depth; ++i)
+		cl.slots[i].next = i + 1 < conf.depth ? i + 1 : -1;
+	pthread_mutex_init(&cl.mtx, NULL);
+	pthread_cond_init(&cl.cv, NULL);
+	for (size_t i = 0; i < buf_len / 4; ++i)
+		wbuf[i] = rng_next(&rng);
+	if (pthread_create(&tid, NULL, recv_thread, NULL) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+
+	// fill the working set
+	for (ba = 0; ba < gen.n; ba += cnt) {
+		cnt = MIN(FILL_BLOCKS, gen.n - ba);
+		req_send(REP_WRITE, (uint64_t)ba * SECTOR_SIZE, cnt * SECTOR_SIZE, wbuf);
+	}
+	req_send(REP_FLUSH, 0, 0, NULL);
+	slot_wait_idle();
+	memset(&cl.rt, 0, sizeof(cl.rt));
+
+	report_start(&rep, sc);
+	for (uint64_t n = 0; conf.op_cnt == 0 || n < conf.op_cnt; ++n) {
+		int r = rng_next(&rng) % 100;
+		int op = r < conf.read_pct ? REP_READ :
+		    r < conf.read_pct + conf.trim_pct ? REP_TRIM : REP_WRITE;
+
+		if (conf.op_cnt == 0 && (n & 63) == 0 &&
+		    report_time_ns() - rep.start_ns >= (uint64_t)conf.duration * 1000000000)
+			break;
+		ba = wl_gen_next(&gen, &rng, &seq_next);
+		if (ba > gen.n - conf.req_blocks)
+			ba = gen.n - conf.req_blocks;
+		if (conf.workload == WL_SEQ)
+			seq_next = ba + conf.req_blocks == gen.n ? 0 : ba + conf.req_blocks;
+		if (op == REP_WRITE) {
+			// every write differs
+			wbuf[0] = ba;
+			wbuf[1] = rng_next(&rng);
+		}
+		req_send(op, (uint64_t)ba * SECTOR_SIZE, conf.req_blocks * SECTOR_SIZE, wbuf);
+	}
+	slot_wait_idle();
+	report_stop(&rep, sc);
+
+	// disconnect, the server closes the connection after the replies
+	put32(hdr, NBD_REQUEST_MAGIC);
+	put16(hdr + 4, 0);
+	put16(hdr + 6, NBD_CMD_DISC);
+	memset(hdr + 8, 0, 20);
+	write_full(cl.fd, hdr, sizeof(hdr));
+	shutdown(cl.fd, SHUT_WR);
+	pthread_join(tid, NULL);
+	close(cl.fd);
+	if (cl.error != 0)
+		fprintf(stderr, "the server replied error %d\n", cl.error);
+	report_merge(&rep, &cl.rt);
+
+	len = snprintf(config, sizeof(config), "\"workload\": \"%s\", \"read_pct\": %d, "
+	    "\"trim_pct\": %d, \"fill_pct\": %d, \"transport\": \"%s\", "
+	    "\"queue_depth\": %d, \"request_blocks\": %u, \"structured_reply\": %s, ",
+	    wl_name[conf.workload], conf.read_pct, conf.trim_pct, conf.fill_pct,
+	    conf.mode == MODE_BENCH ? "socketpair" : conf.path != NULL ? "unix" : "tcp",
+	    conf.depth, conf.req_blocks, cl.structured ? "true" : "false");
+	// the server options are known only if it runs in this process
+	if (conf.mode == MODE_BENCH)
+		len += snprintf(config + len, sizeof(config) - len,
+		    "\"workers\": %d, \"wbuf\": %u, \"rcache\": %u, ",
+		    conf.worker_cnt, conf.wbuf, conf.rcache);
+	snprintf(config + len, sizeof(config) - len, "\"block_cnt\": %u", block_cnt);
+	report_print(&rep, fp, config);
+	if (fp != stdout)
+		fclose(fp);
+	report_fini(&rep);
+	free(cl.slots);
+	free(cl.rbuf);
+	free(wbuf);
+}
+
+static void
+usage(const char *prog)
+{
+
+	fprintf(stderr,
+	    "usage: %s [options]\n"
+	    "  -u path       serve or connect to the Unix socket\n"
+	    "  -p port       serve or connect to the TCP port on the loopback interface\n"
+	    "  -c            be the client\n"
+	    "  -B            run the server and the client in this process\n"
+	    "server options:\n"
+	    "  -j workers    number of worker threads (%d)\n"
+	    "  -C            compress the data blocks\n"
+	    "  -D            deduplicate the data blocks\n"
+	    "  -W blocks     buffer the writes in a write buffer of the blocks\n"
+	    "  -R blocks     cache the reads in a read cache of the blocks\n"
+	    "client options:\n"
+	    "  -w workload   uniform, zipf, hotcold or seq (%s)\n"
+	    "  -z theta      skew of zipf, not 1 (%.2f)\n"
+	    "  -H hot:access percent of the blocks that are hot and percent\n"
+	    "                of the accesses to them for hotcold (%d:%d)\n"
+	    "  -r percent    reads in the operations (%d)\n"
+	    "  -t percent    trims in the operations (%d)\n"
+	    "  -f percent    fill level, the working set in percent of the blocks (%d)\n"
+	    "  -d seconds    duration (%d)\n"
+	    "  -n count      number of operations instead of the duration\n"
+	    "  -q depth      requests in flight (%d)\n"
+	    "  -l blocks     blocks in a request (%u)\n"
+	    "  -S            use simple replies\n"
+	    "  -s seed       random seed (%u)\n"
+	    "  -o file       write the result to the file instead of stdout\n",
+	    prog, conf.worker_cnt, wl_name[conf.workload], conf.zipf_theta,
+	    conf.hot_pct, conf.hot_access_pct, conf.read_pct, conf.trim_pct,
+	    conf.fill_pct, conf.duration, conf.depth, conf.req_blocks, conf.seed);
+	exit(1);
+}
+
+static void
+parse_args(int argc, char *argv[])
+{
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "u:p:cBj:CDW:R:w:z:H:r:t:f:d:n:q:l:Ss:o:h")) != -1) {
+		switch (ch) {
+		case 'u':
+			conf.path = optarg;
+			break;
+		case 'p':
+			conf.port = atoi(optarg);
+			break;
+		case 'c':
+			conf.mode = MODE_CLIENT;
+			break;
+		case 'B':
+			conf.mode = MODE_BENCH;
+			break;
+		case 'j':
+			conf.worker_cnt = atoi(optarg);
+			break;
+		case 'C':
+			conf.compress = true;
+			break;
+		case 'D':
+			conf.dedup = true;
+			break;
+		case 'W':
+			conf.wbuf = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			conf.rcache = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			for (i = 0; i < WL_CNT; ++i)
+				if (strcmp(optarg, wl_name[i]) == 0)
+					break;
+			if (i == WL_CNT)
+				usage(argv[0]);
+			conf.workload = i;
+			break;
+		case 'z':
+			conf.zipf_theta = atof(optarg);
+			break;
+		case 'H':
+			if (sscanf(optarg, "%d:%d", &conf.hot_pct, &conf.hot_access_pct) != 2)
+				usage(argv[0]);
+			break;
+		case 'r':
+			conf.read_pct = atoi(optarg);
+			break;
+		case 't':
+			conf.trim_pct = atoi(optarg);
+			break;
+		case 'f':
+			conf.fill_pct = atoi(optarg);
+			break;
+		case 'd':
+			conf.duration = atoi(optarg);
+			break;
+		case 'n':
+			conf.op_cnt = strtoull(optarg, NULL, 0);
+			break;
+		case 'q':
+			conf.depth = atoi(optarg);
+			break;
+		case 'l':
+			conf.req_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			conf.simple = true;
+			break;
+		case 's':
+			conf.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			conf.output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((conf.mode != MODE_BENCH && (conf.path == NULL) == (conf.port == 0)) ||
+	    conf.port < 0 || conf.port > 65535 || conf.worker_cnt <= 0 ||
+	    conf.zipf_theta <= 0 || conf.zipf_theta == 1 ||
+	    conf.hot_pct < 0 || conf.hot_pct > 100 ||
+	    conf.hot_access_pct < 0 || conf.hot_access_pct > 100 ||
+	    conf.read_pct < 0 || conf.trim_pct < 0 ||
+	    conf.read_pct + conf.trim_pct > 100 ||
+	    conf.fill_pct <= 0 || conf.fill_pct > 100 || conf.duration <= 0 ||
+	    conf.depth <= 0 || conf.req_blocks == 0 ||
+	    conf.req_blocks > NBD_MAX_LEN / SECTOR_SIZE)
+		usage(argv[0]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int sv[2];
+
+	parse_args(argc, argv);
+	// a reply to a closed connection must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+	switch (conf.mode) {
+	case MODE_SERVER:
+		server();
+		break;
+	case MODE_CLIENT:
+		client(client_connect());
+		break;
+	case MODE_BENCH:
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+			perror("socketpair");
+			exit(1);
+		}
+		server_init();
+		conn_start(sv[0]);
+		client(sv[1]);
+		server_fini();
+		break;
+	}
+	return 0;
+}
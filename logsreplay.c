@@ -0,0 +1,294 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  Block trace replay for logstor
+
+  The trace is loaded into memory before the replay. Three formats are
+  understood:
+    csv       timestamp_us,op,offset,length with op R, W, D or F and
+              the offset and length in bytes
+    blkparse  the default text output of blkparse, only the events of one
+              action (Q by default) are replayed
+    logstor   the event trace written by logstor_trace_dump()
+  The byte ranges are converted to blocks and wrapped around the block
+  count of the disk. The threads take the records in trace order, so with
+  more than one thread the requests overlap as they would on a queue of
+  that depth. With a time scale the records are issued no earlier than
+  their timestamp divided by the scale. The result is printed as JSON in
+  the same format as logsbench.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "logstor.h"
+#include "logsreport.h"
+#include "logsworkload.h"
+
+struct replay_conf {
+	int format;
+	const char *action;	// the blkparse action to replay
+	double speed;		// time scale, 0 means as fast as possible
+	int thread_cnt;
+	int fill_pct;
+	bool compress;
+	bool dedup;
+	const char *output;	// the file for the result, NULL for stdout
+	const char *trace;	// the file for the event trace, NULL for none
+	const char *input;
+};
+
+struct replay_thread {
+	pthread_t tid;
+	uint64_t rng;
+	struct report_thread rt;
+	uint32_t buf[SECTOR_SIZE/4] __attribute__((aligned(16)));
+};
+
+static struct replay_conf conf = {
+	.format = FMT_AUTO,
+	.action = "Q",
+	.speed = 0,
+	.thread_cnt = 1,
+	.fill_pct = 0,
+};
+
+static struct g_logstor_softc *sc;
+static uint32_t block_cnt;
+static struct wl_trace tr;
+static atomic_uint_fast64_t rec_next;	// next record to replay
+static uint64_t replay_start;		// time the replay started
+
+// wait until the time record @rec is due
+static void
+rec_wait(const struct wl_rec *rec)
+{
+	uint64_t due = replay_start + rec->ts_ns / conf.speed;
+	struct timespec ts = {
+		.tv_sec = due / 1000000000,
+		.tv_nsec = due % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+		;
+}
+
+static void
+rec_replay(struct replay_thread *t, const struct wl_rec *rec)
+{
+	uint32_t ba = rec->ba % block_cnt;
+	uint32_t cnt, size;
+
+	switch (rec->op) {
+	case REP_READ:
+		for (cnt = 0; cnt < rec->cnt; ++cnt)
+			logstor_read(sc, (ba + cnt) % block_cnt, t->buf);
+		break;
+	case REP_WRITE:
+		for (cnt = 0; cnt < rec->cnt; ++cnt) {
+			// incompressible data that differs for every write
+			t->buf[0] = (ba + cnt) % block_cnt;
+			t->buf[1] = rng_next(&t->rng);
+			t->buf[SECTOR_SIZE/4 - 1] = t->buf[1];
+			logstor_write(sc, (ba + cnt) % block_cnt, t->buf, 0);
+		}
+		break;
+	case REP_TRIM:
+		// split the range where it wraps around the disk
+		for (cnt = rec->cnt; cnt != 0; cnt -= size) {
+			size = cnt < block_cnt - ba ? cnt : block_cnt - ba;
+			logstor_delete(sc, (off_t)ba * SECTOR_SIZE, NULL,
+			    (off_t)size * SECTOR_SIZE);
+			ba = (ba + size) % block_cnt;
+		}
+		break;
+	case REP_FLUSH:
+		logstor_flush(sc);
+		break;
+	}
+}
+
+static void *
+replay_thread(void *arg)
+{
+	struct replay_thread *t = arg;
+	const struct wl_rec *rec;
+	uint64_t start, end;
+	uint64_t i;
+
+	while ((i = atomic_fetch_add(&rec_next, 1)) < tr.cnt) {
+		rec = &tr.recs[i];
+		if (conf.speed > 0)
+			rec_wait(rec);
+		start = report_time_ns();
+		rec_replay(t, rec);
+		end = report_time_ns();
+		report_add(&t->rt, rec->op, (uint64_t)rec->cnt * SECTOR_SIZE, end - start);
+	}
+	return NULL;
+}
+
+static void
+usage(const char *prog)
+{
+
+	fprintf(stderr,
+	    "usage: %s [options] trace_file\n"
+	    "  -i format     csv, blkparse, logstor or auto (%s)\n"
+	    "  -a action     blkparse action to replay (%s)\n"
+	    "  -x scale      replay at scale times the recorded speed,\n"
+	    "                0 is as fast as possible (%g)\n"
+	    "  -j threads    number of threads (%d)\n"
+	    "  -f percent    blocks written before the replay (%d)\n"
+	    "  -C            compress the data blocks\n"
+	    "  -D            deduplicate the data blocks\n"
+	    "  -o file       write the result to the file instead of stdout\n"
+	    "  -T file       dump the event trace to the file at the end\n",
+	    prog, fmt_name[conf.format], conf.action, conf.speed,
+	    conf.thread_cnt, conf.fill_pct);
+	exit(1);
+}
+
+static void
+parse_args(int argc, char *argv[])
+{
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "i:a:x:j:f:CDo:T:h")) != -1) {
+		switch (ch) {
+		case 'i':
+			for (i = 0; i < FMT_CNT; ++i)
+				if (strcmp(optarg, fmt_name[i]) == 0)
+					break;
+			if (i == FMT_CNT)
+				usage(argv[0]);
+			conf.format = i;
+			break;
+		case 'a':
+			conf.action = optarg;
+			break;
+		case 'x':
+			conf.speed = atof(optarg);
+			break;
+		case 'j':
+			conf.thread_cnt = atoi(optarg);
+			break;
+		case 'f':
+			conf.fill_pct = atoi(optarg);
+			break;
+		case 'C':
+			conf.compress = true;
+			break;
+		case 'D':
+			conf.dedup = true;
+			break;
+		case 'o':
+			conf.output = optarg;
+			break;
+		case 'T':
+			conf.trace = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || conf.speed < 0 || conf.thread_cnt <= 0 ||
+	    conf.fill_pct < 0 || conf.fill_pct > 100)
+		usage(argv[0]);
+	conf.input = argv[optind];
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct replay_thread *threads;
+	struct report rep;
+	uint32_t buf[SECTOR_SIZE/4];
+	uint32_t fill_cnt;
+	char config[512];
+	FILE *fp = stdout;
+
+	parse_args(argc, argv);
+	tr.path = conf.input;
+	tr.format = conf.format;
+	tr.action = conf.action;
+	wl_trace_load(&tr);
+	conf.format = tr.format;
+	if (conf.output != NULL && (fp = fopen(conf.output, "w")) == NULL) {
+		perror(conf.output);
+		exit(1);
+	}
+	block_cnt = logstor_init_disk();
+	sc = logstor_open();
+
+	// fill the first blocks so the reads of the trace hit mapped blocks
+	fill_cnt = (uint64_t)block_cnt * conf.fill_pct / 100;
+	srandom(0);
+	for (int i = 0; i < SECTOR_SIZE/4; ++i)
+		buf[i] = random();
+	for (uint32_t ba = 0; ba < fill_cnt; ++ba) {
+		buf[0] = ba;
+		logstor_write(sc, ba, buf, 0);
+	}
+	logstor_flush(sc);
+	logstor_set_compress(sc, conf.compress);
+	logstor_set_dedup(sc, conf.dedup);
+
+	threads = calloc(conf.thread_cnt, sizeof(*threads));
+	if (threads == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	report_start(&rep, sc);
+	replay_start = report_time_ns();
+	for (int i = 0; i < conf.thread_cnt; ++i) {
+		struct replay_thread *t = &threads[i];
+
+		t->rng = 0x9E3779B97F4A7C15ULL + i;
+		for (int j = 0; j < SECTOR_SIZE/4; ++j)
+			t->buf[j] = rng_next(&t->rng);
+		if (pthread_create(&t->tid, NULL, replay_thread, t) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (int i = 0; i < conf.thread_cnt; ++i) {
+		pthread_join(threads[i].tid, NULL);
+		report_merge(&rep, &threads[i].rt);
+	}
+	report_stop(&rep, sc);
+	if (conf.trace != NULL) {
+		int error = logstor_trace_dump(conf.trace);
+
+		if (error != 0)
+			fprintf(stderr, "%s: %s\n", conf.trace, strerror(error));
+	}
+
+	snprintf(config, sizeof(config),
+	    "\"trace\": \"%s\", \"format\": \"%s\", \"records\": %lu, "
+	    "\"trace_seconds\": %.3f, \"scale\": %g, \"threads\": %d, "
+	    "\"fill_pct\": %d, \"compress\": %s, \"dedup\": %s, \"block_cnt\": %u",
+	    conf.input, fmt_name[conf.format], tr.cnt,
+	    tr.cnt ? tr.recs[tr.cnt - 1].ts_ns / 1e9 : 0, conf.speed,
+	    conf.thread_cnt, conf.fill_pct, conf.compress ? "true" : "false",
+	    conf.dedup ? "true" : "false", block_cnt);
+	report_print(&rep, fp, config);
+
+	if (fp != stdout)
+		fclose(fp);
+	report_fini(&rep);
+	free(threads);
+	wl_trace_free(&tr);
+	logstor_close(sc);
+	logstor_fini();
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "logstor.h"
+#include "logsreport.h"
+
+static const char *rep_name[REP_CNT] = {
+	[REP_READ] = "read",
+	[REP_WRITE] = "write",
+	[REP_TRIM] = "trim",
+	[REP_FLUSH] = "flush",
+};
+
+static const char *io_name[LOGSTOR_IO_CNT] = {
+	[LOGSTOR_IO_DATA] = "data",
+	[LOGSTOR_IO_FBUF] = "fbuf",
+	[LOGSTOR_IO_SEG_SUM] = "seg_sum",
+	[LOGSTOR_IO_SUPERBLOCK] = "superblock",
+};
+
+uint64_t
+report_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+report_add(struct report_thread *rt, int op, uint64_t bytes, uint64_t ns)
+{
+
+	logstor_hist_add(&rt->hist[op], ns);
+	rt->bytes[op] += bytes;
+}
+
+static void
+hist_merge(struct logstor_hist *dst, const struct logstor_hist *src)
+{
+
+	for (int i = 0; i < LOGSTOR_HIST_CNT; ++i)
+		dst->bucket[i] += src->bucket[i];
+	dst->count += src->count;
+	dst->sum_ns += src->sum_ns;
+	if (src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+}
+
+// subtract the earlier histogram @old from @h, the max is kept as is
+static void
+hist_sub(struct logstor_hist *h, const struct logstor_hist *old)
+{
+
+	for (int i = 0; i < LOGSTOR_HIST_CNT; ++i)
+		h->bucket[i] -= old->bucket[i];
+	h->count -= old->count;
+	h->sum_ns -= old->sum_ns;
+	if (h->count == 0)
+		h->max_ns = 0;
+}
+
+static struct logstor_stats *
+stats_alloc(void)
+{
+	struct logstor_stats *st = calloc(1, sizeof(*st));
+
+	if (st == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	st->version = LOGSTOR_STATS_VERSION;
+	st->size = sizeof(*st);
+	return st;
+}
+
+void
+report_start(struct report *rep, struct g_logstor_softc *sc)
+{
+
+	memset(rep, 0, sizeof(*rep));
+	rep->st_start = stats_alloc();
+	rep->st_stop = stats_alloc();
+	// a client of a server in another process has no statistics
+	if (sc != NULL)
+		logstor_get_stats(sc, rep->st_start);
+	rep->start_ns = report_time_ns();
+}
+
+void
+report_stop(struct report *rep, struct g_logstor_softc *sc)
+{
+
+	rep->elapsed_ns = report_time_ns() - rep->start_ns;
+	if (sc != NULL)
+		logstor_get_stats(sc, rep->st_stop);
+}
+
+void
+report_merge(struct report *rep, const struct report_thread *rt)
+{
+
+	for (int op = 0; op < REP_CNT; ++op) {
+		hist_merge(&rep->sum.hist[op], &rt->hist[op]);
+		rep->sum.bytes[op] += rt->bytes[op];
+	}
+}
+
+static void
+hist_print(FILE *fp, const char *name, const struct logstor_hist *h, bool last)
+{
+
+	fprintf(fp, "    \"%s\": {\"count\": %lu, \"p50\": %lu, \"p90\": %lu, "
+	    "\"p99\": %lu, \"p99.9\": %lu, \"max\": %lu}%s\n",
+	    name, h->count, logstor_hist_percentile(h, 50), logstor_hist_percentile(h, 90),
+	    logstor_hist_percentile(h, 99), logstor_hist_percentile(h, 99.9), h->max_ns,
+	    last ? "" : ",");
+}
+
+/*
+Description:
+    Print the metrics of the run as a JSON object
+    @config is the members of the "config" object
+    The write amplification is the sectors written to the device for
+    each sector written by the user.
+*/
+void
+report_print(struct report *rep, FILE *fp, const char *config)
+{
+	struct logstor_stats *st = rep->st_stop, *old = rep->st_start;
+	struct report_thread *sum = &rep->sum;
+	uint64_t dev_write = 0, op_total = 0;
+	uint64_t fbuf_hit, fbuf_miss, pf, pf_hit, mig, tier_read;
+	uint64_t wb_hit, wb_absorb, wb_destage;
+	uint64_t rc_hit, rc_miss, ra_block, ra_io;
+	double sec = rep->elapsed_ns / 1e9;
+
+	for (int i = 0; i < LOGSTOR_IO_CNT; ++i) {
+		st->dev_read[i] -= old->dev_read[i];
+		st->dev_write[i] -= old->dev_write[i];
+		dev_write += st->dev_write[i];
+	}
+	fbuf_hit = st->fbuf_hit - old->fbuf_hit;
+	fbuf_miss = st->fbuf_miss - old->fbuf_miss;
+	pf = st->fbuf_prefetch - old->fbuf_prefetch;
+	pf_hit = st->fbuf_prefetch_hit - old->fbuf_prefetch_hit;
+	mig = st->tier_migrate - old->tier_migrate;
+	tier_read = st->tier_read - old->tier_read;
+	wb_hit = st->wbuf_hit - old->wbuf_hit;
+	wb_absorb = st->wbuf_absorb - old->wbuf_absorb;
+	wb_destage = st->wbuf_destage - old->wbuf_destage;
+	rc_hit = st->rcache_hit - old->rcache_hit;
+	rc_miss = st->rcache_miss - old->rcache_miss;
+	ra_block = st->rcache_ra_block - old->rcache_ra_block;
+	ra_io = st->rcache_ra_io - old->rcache_ra_io;
+	hist_sub(&st->lat[LOGSTOR_OP_FBUF_MISS], &old->lat[LOGSTOR_OP_FBUF_MISS]);
+	for (int op = 0; op < REP_CNT; ++op)
+		op_total += sum->hist[op].count;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"config\": {%s},\n", config);
+	fprintf(fp, "  \"seconds\": %.3f,\n", sec);
+	fprintf(fp, "  \"ops\": %lu,\n", op_total);
+	fprintf(fp, "  \"iops\": %.1f,\n", op_total / sec);
+	fprintf(fp, "  \"read_mb_per_s\": %.2f,\n",
+	    sum->bytes[REP_READ] / (1024.0 * 1024) / sec);
+	fprintf(fp, "  \"write_mb_per_s\": %.2f,\n",
+	    sum->bytes[REP_WRITE] / (1024.0 * 1024) / sec);
+	fprintf(fp, "  \"write_amplification\": %.4f,\n", sum->bytes[REP_WRITE] == 0 ? 0 :
+	    (double)dev_write * SECTOR_SIZE / sum->bytes[REP_WRITE]);
+	fprintf(fp, "  \"fbuf_hit_rate\": %.4f,\n", fbuf_hit + fbuf_miss == 0 ? 0 :
+	    (double)fbuf_hit / (fbuf_hit + fbuf_miss));
+	fprintf(fp, "  \"fbuf_prefetch\": {\"leaves\": %lu, \"hits\": %lu},\n", pf, pf_hit);
+	fprintf(fp, "  \"tier\": {\"migrated\": %lu, \"capacity_reads\": %lu},\n",
+	    mig, tier_read);
+	fprintf(fp, "  \"wbuf\": {\"read_hits\": %lu, \"absorbed\": %lu, \"destaged\": %lu},\n",
+	    wb_hit, wb_absorb, wb_destage);
+	fprintf(fp, "  \"rcache\": {\"hit_rate\": %.4f, \"readahead_blocks\": %lu, "
+	    "\"readahead_requests\": %lu},\n", rc_hit + rc_miss == 0 ? 0 :
+	    (double)rc_hit / (rc_hit + rc_miss), ra_block, ra_io);
+	for (int i = 0; i < 2; ++i) {
+		uint64_t *io = i == 0 ? st->dev_read : st->dev_write;
+
+		fprintf(fp, "  \"device_%s\": {", i == 0 ? "read" : "write");
+		for (int kind = 0; kind < LOGSTOR_IO_CNT; ++kind)
+			fprintf(fp, "\"%s\": %lu%s", io_name[kind], io[kind],
+			    kind == LOGSTOR_IO_CNT - 1 ? "},\n" : ", ");
+	}
+	fprintf(fp, "  \"latency_ns\": {\n");
+	for (int op = 0; op < REP_CNT; ++op)
+		hist_print(fp, rep_name[op], &sum->hist[op], false);
+	hist_print(fp, "fbuf_miss", &st->lat[LOGSTOR_OP_FBUF_MISS], true);
+	fprintf(fp, "  }\n");
+	fprintf(fp, "}\n");
+}
+
+void
+report_fini(struct report *rep)
+{
+
+	free(rep->st_start);
+	free(rep->st_stop);
+}
@@ -0,0 +1,41 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  The metrics of a run of the benchmark tools
+
+  Each thread measures its operations in its own struct report_thread.
+  report_start() and report_stop() take the logstor statistics around
+  the run and report_print() prints the throughput, write amplification,
+  fbuf hit rate, device I/O and latency percentiles as JSON.
+*/
+enum {
+	REP_READ,
+	REP_WRITE,
+	REP_TRIM,
+	REP_FLUSH,
+	REP_CNT,
+};
+
+struct report_thread {
+	struct logstor_hist hist[REP_CNT];
+	uint64_t bytes[REP_CNT];
+};
+
+struct report {
+	struct report_thread sum;
+	struct logstor_stats *st_start;
+	struct logstor_stats *st_stop;
+	uint64_t start_ns;
+	uint64_t elapsed_ns;
+};
+
+uint64_t report_time_ns(void);
+void report_add(struct report_thread *rt, int op, uint64_t bytes, uint64_t ns);
+void report_start(struct report *rep, struct g_logstor_softc *sc);
+void report_stop(struct report *rep, struct g_logstor_softc *sc);
+void report_merge(struct report *rep, const struct report_thread *rt);
+void report_print(struct report *rep, FILE *fp, const char *config);
+void report_fini(struct report *rep);
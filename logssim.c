@@ -0,0 +1,618 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  Offline simulator of the segment allocation and cleaning policies
+
+  Only the forward map, the reverse map and the valid count of each
+  segment are modeled, there is no data and no metadata I/O, so a write
+  costs a few memory accesses and a volume of terabytes can be simulated
+  in minutes. The geometry is that of logstor_init_disk().
+
+  The write stream is either synthetic, with the address distributions of
+  logsbench, or a block trace in one of the formats of logsreplay. The
+  working set is written once before the measurement.
+
+  The policies are
+    rr        logstor: the segments are allocated round robin and the
+              valid sectors are skipped in place, nothing is copied
+    greedy    log structured with cleaning: the sealed segment with the
+              fewest valid sectors is cleaned
+    cb        the segment with the best (1 - u) * age / (1 + u) among a
+              random sample of the sealed segments is cleaned
+    hotcold   greedy, with the blocks copied by the cleaner written to
+              their own segment so they are not mixed with the new writes
+  The result is printed as JSON.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "logstor.h"
+#include "logsreport.h"
+#include "logsworkload.h"
+
+// the geometry of logstor.c
+#define	SECTORS_PER_SEG	1024
+#define	SEG_SUM_CNT	2	// number of segment summary sectors
+#define	BLOCKS_PER_SEG	(SECTORS_PER_SEG - SEG_SUM_CNT)
+#define	SB_CNT		8	// number of superblock sectors
+#define	FD_COUNT	4
+
+#define	NONE		0xFFFFFFFFu	// no sector for a block or no block for a sector
+#define	CB_SAMPLE	64		// segments sampled by the cost-benefit policy
+#define	UTIL_BUCKETS	10
+
+enum {
+	HEAD_USER,	// the head for the user writes
+	HEAD_GC,	// the head for the blocks copied by the cleaner
+	HEAD_CNT,
+};
+
+enum {
+	SEG_FREE,
+	SEG_OPEN,	// a head is writing to it
+	SEG_SEALED,
+};
+
+struct sim_policy {
+	const char *name;
+	bool clean;	// clean segments instead of skipping the valid sectors
+	bool gc_head;	// write the copied blocks to their own head
+	uint32_t (*victim)(void);
+};
+
+struct sim_head {
+	uint32_t seg;
+	uint32_t off;	// next sector in the segment
+};
+
+struct sim_conf {
+	const struct sim_policy *policy;
+	uint64_t size;		// size of the disk in bytes
+	int user_pct;		// user blocks in percent of logstor's, 0 for logstor's
+	int workload;
+	double zipf_theta;
+	int hot_pct;
+	int hot_access_pct;
+	int trim_pct;
+	int fill_pct;
+	uint64_t write_cnt;	// 0 means twice the working set
+	int reserve;		// free segments kept for the cleaner
+	unsigned seed;
+	const char *input;	// the trace to replay, NULL for synthetic
+	int format;
+	const char *output;
+};
+
+static uint32_t victim_greedy(void);
+static uint32_t victim_cb(void);
+
+static const struct sim_policy policies[] = {
+	{ "rr", false, false, NULL },
+	{ "greedy", true, false, victim_greedy },
+	{ "cb", true, false, victim_cb },
+	{ "hotcold", true, true, victim_greedy },
+};
+#define	POLICY_CNT	(sizeof(policies) / sizeof(policies[0]))
+
+static struct sim_conf conf = {
+	.policy = &policies[0],
+	.size = 4ULL << 30,
+	.workload = WL_UNIFORM,
+	.zipf_theta = 0.99,
+	.hot_pct = 20,
+	.hot_access_pct = 80,
+	.fill_pct = 100,
+	.reserve = 4,
+	.format = FMT_AUTO,
+};
+
+static uint32_t seg_cnt;
+static uint32_t block_cnt;
+static uint32_t *fwd;		// forward map, block to sector
+static uint32_t *rev;		// reverse map, sector to block
+static uint16_t *seg_valid;	// valid sectors of each segment
+static uint8_t *seg_state;
+static uint64_t *seg_sealed;	// the time a segment is sealed, in writes
+static uint32_t *free_segs;	// stack of the free segments
+static uint32_t free_cnt;
+static struct sim_head head[HEAD_CNT];
+static bool cleaning;
+static uint64_t rng;
+
+// the sealed segments on lists by their valid count for the greedy policy
+static uint32_t *seg_next, *seg_prev;
+static uint32_t *bucket;	// first segment with each valid count
+
+static struct {
+	uint64_t user_write;
+	uint64_t gc_write;
+	uint64_t trim;
+	uint64_t seg_alloc;	// each writes a segment summary
+	uint64_t skip;		// valid sectors skipped by rr
+	uint64_t victim;
+	uint64_t victim_valid;	// valid sectors in the victims
+	uint64_t alloc_valid;	// valid sectors in the segments allocated by rr
+} st;
+
+static void
+bucket_insert(uint32_t seg)
+{
+	uint32_t *first = &bucket[seg_valid[seg]];
+
+	seg_prev[seg] = NONE;
+	seg_next[seg] = *first;
+	if (*first != NONE)
+		seg_prev[*first] = seg;
+	*first = seg;
+}
+
+static void
+bucket_remove(uint32_t seg)
+{
+
+	if (seg_prev[seg] != NONE)
+		seg_next[seg_prev[seg]] = seg_next[seg];
+	else
+		bucket[seg_valid[seg]] = seg_next[seg];
+	if (seg_next[seg] != NONE)
+		seg_prev[seg_next[seg]] = seg_prev[seg];
+}
+
+static uint32_t
+victim_greedy(void)
+{
+
+	for (int valid = 0; valid <= BLOCKS_PER_SEG; ++valid)
+		if (bucket[valid] != NONE)
+			return bucket[valid];
+	return NONE;
+}
+
+/*
+Description:
+    Sample CB_SAMPLE sealed segments and return the one with the best
+    benefit to cost ratio of Rosenblum and Ousterhout's LFS
+    The sample keeps the cost of a choice constant on large volumes.
+*/
+static uint32_t
+victim_cb(void)
+{
+	uint32_t best = NONE;
+	double best_score = -1;
+	uint64_t now = st.user_write + st.gc_write;
+
+	for (int i = 0, tries = 0; i < CB_SAMPLE && tries < CB_SAMPLE * 16; ++tries) {
+		uint32_t seg = rng_next(&rng) % seg_cnt;
+		double u, score;
+
+		if (seg_state[seg] != SEG_SEALED)
+			continue;
+		++i;
+		u = (double)seg_valid[seg] / BLOCKS_PER_SEG;
+		score = (1 - u) * (now - seg_sealed[seg] + 1) / (1 + u);
+		if (score > best_score) {
+			best_score = score;
+			best = seg;
+		}
+	}
+	return best != NONE ? best : victim_greedy();
+}
+
+static inline void
+sec_invalidate(uint32_t sa)
+{
+	uint32_t seg = sa / SECTORS_PER_SEG;
+
+	rev[sa] = NONE;
+	if (seg_state[seg] == SEG_SEALED && conf.policy->victim == victim_greedy) {
+		bucket_remove(seg);
+		--seg_valid[seg];
+		bucket_insert(seg);
+	} else
+		--seg_valid[seg];
+}
+
+static void
+seg_seal(uint32_t seg)
+{
+
+	seg_state[seg] = SEG_SEALED;
+	seg_sealed[seg] = st.user_write + st.gc_write;
+	if (conf.policy->victim == victim_greedy)
+		bucket_insert(seg);
+}
+
+static void sim_write(uint32_t ba, int which);
+
+// copy the valid blocks out of the victim and free it
+static void
+seg_clean(void)
+{
+	uint32_t seg = conf.policy->victim();
+	uint32_t sa = seg * SECTORS_PER_SEG;
+
+	if (seg == NONE || seg_valid[seg] == BLOCKS_PER_SEG) {
+		fprintf(stderr, "%s: no space to clean, use fewer user blocks\n",
+		    conf.policy->name);
+		exit(1);
+	}
+	++st.victim;
+	st.victim_valid += seg_valid[seg];
+	if (conf.policy->victim == victim_greedy)
+		bucket_remove(seg);
+	seg_state[seg] = SEG_OPEN;	// so the copies do not go to it
+	// the superblock sectors are not blocks and stay
+	for (uint32_t i = 0; i < BLOCKS_PER_SEG; ++i)
+		if (rev[sa + i] < block_cnt) {
+			++st.gc_write;
+			sim_write(rev[sa + i], conf.policy->gc_head ? HEAD_GC : HEAD_USER);
+		}
+	seg_state[seg] = SEG_FREE;
+	free_segs[free_cnt++] = seg;
+}
+
+// move head @which to the next segment
+static void
+seg_alloc(int which)
+{
+	struct sim_head *h = &head[which];
+
+	++st.seg_alloc;
+	if (!conf.policy->clean) {
+		h->seg = (h->seg + 1) % seg_cnt;
+		h->off = h->seg == 0 ? SB_CNT : 0;
+		st.alloc_valid += seg_valid[h->seg];
+		return;
+	}
+	seg_seal(h->seg);
+	if (free_cnt == 0) {
+		fprintf(stderr, "%s: out of free segments, increase the reserve\n",
+		    conf.policy->name);
+		exit(1);
+	}
+	h->seg = free_segs[--free_cnt];
+	h->off = 0;
+	seg_state[h->seg] = SEG_OPEN;
+	if (cleaning)
+		return;
+	cleaning = true;
+	while (free_cnt < conf.reserve)
+		seg_clean();
+	cleaning = false;
+}
+
+static void
+sim_write(uint32_t ba, int which)
+{
+	struct sim_head *h = &head[which];
+	uint32_t sa;
+
+	if (fwd[ba] != NONE)
+		sec_invalidate(fwd[ba]);
+	for (;;) {
+		if (h->off == BLOCKS_PER_SEG)
+			seg_alloc(which);
+		sa = h->seg * SECTORS_PER_SEG + h->off++;
+		if (rev[sa] == NONE)
+			break;
+		++st.skip;
+	}
+	rev[sa] = ba;
+	fwd[ba] = sa;
+	++seg_valid[h->seg];
+}
+
+static void
+sim_trim(uint32_t ba)
+{
+
+	if (fwd[ba] != NONE) {
+		sec_invalidate(fwd[ba]);
+		fwd[ba] = NONE;
+	}
+}
+
+static uint64_t
+time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+sim_alloc(size_t size, int fill)
+{
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(p, fill, size);
+	return p;
+}
+
+static void
+sim_init(void)
+{
+	uint64_t sector_cnt = conf.size / SECTOR_SIZE;
+
+	seg_cnt = sector_cnt / SECTORS_PER_SEG;
+	// the blocks of logstor_init_disk(), the rest is for the metadata files
+	block_cnt = (uint64_t)seg_cnt * BLOCKS_PER_SEG - SB_CNT -
+	    (sector_cnt / (SECTOR_SIZE / 4)) * FD_COUNT * 4;
+	if (conf.user_pct != 0)
+		block_cnt = (uint64_t)block_cnt * conf.user_pct / 100;
+	if (seg_cnt <= conf.reserve + HEAD_CNT || block_cnt == 0) {
+		fprintf(stderr, "the disk is too small\n");
+		exit(1);
+	}
+	fwd = sim_alloc((size_t)block_cnt * sizeof(*fwd), 0xFF);
+	rev = sim_alloc((size_t)seg_cnt * SECTORS_PER_SEG * sizeof(*rev), 0xFF);
+	seg_valid = sim_alloc(seg_cnt * sizeof(*seg_valid), 0);
+	seg_state = sim_alloc(seg_cnt * sizeof(*seg_state), SEG_FREE);
+	seg_sealed = sim_alloc(seg_cnt * sizeof(*seg_sealed), 0);
+	free_segs = sim_alloc(seg_cnt * sizeof(*free_segs), 0);
+	seg_next = sim_alloc(seg_cnt * sizeof(*seg_next), 0xFF);
+	seg_prev = sim_alloc(seg_cnt * sizeof(*seg_prev), 0xFF);
+	bucket = sim_alloc((BLOCKS_PER_SEG + 1) * sizeof(*bucket), 0xFF);
+
+	// the superblock sectors are never free, they map to block_cnt
+	for (int i = 0; i < SB_CNT; ++i)
+		rev[i] = block_cnt;
+	seg_valid[0] = SB_CNT;
+	head[HEAD_USER] = (struct sim_head){ .seg = 0, .off = SB_CNT };
+	seg_state[0] = SEG_OPEN;
+	if (conf.policy->gc_head) {
+		head[HEAD_GC] = (struct sim_head){ .seg = 1, .off = 0 };
+		seg_state[1] = SEG_OPEN;
+	}
+	for (uint32_t seg = seg_cnt - 1; seg > 1; --seg)
+		free_segs[free_cnt++] = seg;
+	if (!conf.policy->gc_head)
+		free_segs[free_cnt++] = 1;
+}
+
+static void
+usage(const char *prog)
+{
+
+	fprintf(stderr,
+	    "usage: %s [options]\n"
+	    "  -p policy     rr, greedy, cb or hotcold (%s)\n"
+	    "  -S GiB        size of the disk (%lu)\n"
+	    "  -u percent    user blocks in percent of those of logstor (100)\n"
+	    "  -w workload   uniform, zipf, hotcold or seq (%s)\n"
+	    "  -z theta      skew of zipf, not 1 (%.2f)\n"
+	    "  -H hot:access percent of the blocks that are hot and percent\n"
+	    "                of the accesses to them for hotcold (%d:%d)\n"
+	    "  -t percent    trims in the operations (%d)\n"
+	    "  -f percent    the working set in percent of the user blocks (%d)\n"
+	    "  -n count      writes to simulate, 0 is twice the working set\n"
+	    "  -r count      free segments kept for the cleaner (%d)\n"
+	    "  -s seed       random seed (%u)\n"
+	    "  -i file       replay the writes and trims of the trace instead\n"
+	    "  -F format     format of the trace, csv, blkparse, logstor or auto\n"
+	    "  -o file       write the result to the file instead of stdout\n",
+	    prog, conf.policy->name, conf.size >> 30, wl_name[conf.workload],
+	    conf.zipf_theta, conf.hot_pct, conf.hot_access_pct, conf.trim_pct,
+	    conf.fill_pct, conf.reserve, conf.seed);
+	exit(1);
+}
+
+static void
+parse_args(int argc, char *argv[])
+{
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "p:S:u:w:z:H:t:f:n:r:s:i:F:o:h")) != -1) {
+		switch (ch) {
+		case 'p':
+			for (i = 0; i < POLICY_CNT; ++i)
+				if (strcmp(optarg, policies[i].name) == 0)
+					break;
+			if (i == POLICY_CNT)
+				usage(argv[0]);
+			conf.policy = &policies[i];
+			break;
+		case 'S':
+			conf.size = strtoull(optarg, NULL, 0) << 30;
+			break;
+		case 'u':
+			conf.user_pct = atoi(optarg);
+			break;
+		case 'w':
+			for (i = 0; i < WL_CNT; ++i)
+				if (strcmp(optarg, wl_name[i]) == 0)
+					break;
+			if (i == WL_CNT)
+				usage(argv[0]);
+			conf.workload = i;
+			break;
+		case 'z':
+			conf.zipf_theta = atof(optarg);
+			break;
+		case 'H':
+			if (sscanf(optarg, "%d:%d", &conf.hot_pct, &conf.hot_access_pct) != 2)
+				usage(argv[0]);
+			break;
+		case 't':
+			conf.trim_pct = atoi(optarg);
+			break;
+		case 'f':
+			conf.fill_pct = atoi(optarg);
+			break;
+		case 'n':
+			conf.write_cnt = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			conf.reserve = atoi(optarg);
+			break;
+		case 's':
+			conf.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			conf.input = optarg;
+			break;
+		case 'F':
+			for (i = 0; i < FMT_CNT; ++i)
+				if (strcmp(optarg, fmt_name[i]) == 0)
+					break;
+			if (i == FMT_CNT)
+				usage(argv[0]);
+			conf.format = i;
+			break;
+		case 'o':
+			conf.output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (conf.zipf_theta <= 0 || conf.zipf_theta == 1 ||
+	    conf.hot_pct < 0 || conf.hot_pct > 100 ||
+	    conf.hot_access_pct < 0 || conf.hot_access_pct > 100 ||
+	    conf.trim_pct < 0 || conf.trim_pct >= 100 ||
+	    conf.fill_pct <= 0 || conf.fill_pct > 100 ||
+	    conf.user_pct < 0 || conf.user_pct > 100 ||
+	    conf.reserve < 1 || conf.size == 0)
+		usage(argv[0]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct wl_gen gen;
+	struct wl_trace tr = {0};
+	uint64_t util[UTIL_BUCKETS] = {0};
+	uint64_t start, elapsed;
+	uint64_t op_cnt = 0;
+	uint32_t seq_next = 0;
+	FILE *fp = stdout;
+
+	parse_args(argc, argv);
+	if (conf.output != NULL && (fp = fopen(conf.output, "w")) == NULL) {
+		perror(conf.output);
+		exit(1);
+	}
+	if (conf.input != NULL) {
+		tr.path = conf.input;
+		tr.format = conf.format;
+		tr.action = "Q";
+		wl_trace_load(&tr);
+		conf.format = tr.format;
+	}
+	sim_init();
+	rng = (conf.seed + 1) * 0x9E3779B97F4A7C15ULL;
+	gen = (struct wl_gen){
+		.workload = conf.workload,
+		.n = (uint64_t)block_cnt * conf.fill_pct / 100,
+		.zipf_theta = conf.zipf_theta,
+		.hot_pct = conf.hot_pct,
+		.hot_access_pct = conf.hot_access_pct,
+	};
+	if (gen.n == 0)
+		gen.n = 1;
+	wl_gen_init(&gen);
+	if (conf.write_cnt == 0)
+		conf.write_cnt = (uint64_t)gen.n * 2;
+
+	// write the working set, it is not measured
+	for (uint32_t ba = 0; ba < gen.n; ++ba)
+		sim_write(ba, HEAD_USER);
+	memset(&st, 0, sizeof(st));
+
+	start = time_ns();
+	if (conf.input != NULL) {
+		for (uint64_t i = 0; i < tr.cnt; ++i) {
+			struct wl_rec *rec = &tr.recs[i];
+
+			if (rec->op != REP_WRITE && rec->op != REP_TRIM)
+				continue;
+			++op_cnt;
+			for (uint32_t j = 0; j < rec->cnt; ++j) {
+				uint32_t ba = (rec->ba + j) % block_cnt;
+
+				if (rec->op == REP_WRITE) {
+					++st.user_write;
+					sim_write(ba, HEAD_USER);
+				} else {
+					++st.trim;
+					sim_trim(ba);
+				}
+			}
+		}
+	} else {
+		for (; st.user_write < conf.write_cnt; ++op_cnt) {
+			uint32_t ba = wl_gen_next(&gen, &rng, &seq_next);
+
+			if (conf.trim_pct != 0 && rng_next(&rng) % 100 < conf.trim_pct) {
+				++st.trim;
+				sim_trim(ba);
+			} else {
+				++st.user_write;
+				sim_write(ba, HEAD_USER);
+			}
+		}
+	}
+	elapsed = time_ns() - start;
+
+	for (uint32_t seg = 0; seg < seg_cnt; ++seg)
+		if (!conf.policy->clean || seg_state[seg] != SEG_FREE)
+			++util[seg_valid[seg] >= BLOCKS_PER_SEG ? UTIL_BUCKETS - 1 :
+			    seg_valid[seg] * UTIL_BUCKETS / BLOCKS_PER_SEG];
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"config\": {\"policy\": \"%s\", \"size_gib\": %lu, "
+	    "\"seg_cnt\": %u, \"block_cnt\": %u, ", conf.policy->name,
+	    conf.size >> 30, seg_cnt, block_cnt);
+	if (conf.input != NULL)
+		fprintf(fp, "\"trace\": \"%s\", \"format\": \"%s\", ",
+		    conf.input, fmt_name[conf.format]);
+	else {
+		fprintf(fp, "\"workload\": \"%s\", ", wl_name[conf.workload]);
+		if (conf.workload == WL_ZIPF)
+			fprintf(fp, "\"zipf_theta\": %.3f, ", conf.zipf_theta);
+		if (conf.workload == WL_HOTCOLD)
+			fprintf(fp, "\"hot_pct\": %d, \"hot_access_pct\": %d, ",
+			    conf.hot_pct, conf.hot_access_pct);
+		fprintf(fp, "\"trim_pct\": %d, \"seed\": %u, ", conf.trim_pct, conf.seed);
+	}
+	fprintf(fp, "\"fill_pct\": %d, \"reserve\": %d},\n", conf.fill_pct, conf.reserve);
+	fprintf(fp, "  \"seconds\": %.3f,\n", elapsed / 1e9);
+	fprintf(fp, "  \"ops_per_s\": %.0f,\n", op_cnt / (elapsed / 1e9));
+	fprintf(fp, "  \"user_writes\": %lu,\n", st.user_write);
+	fprintf(fp, "  \"trims\": %lu,\n", st.trim);
+	fprintf(fp, "  \"gc_writes\": %lu,\n", st.gc_write);
+	fprintf(fp, "  \"seg_allocs\": %lu,\n", st.seg_alloc);
+	// the segment summary of every segment allocated is written
+	fprintf(fp, "  \"write_amplification\": %.4f,\n", st.user_write == 0 ? 0 :
+	    (double)(st.user_write + st.gc_write + st.seg_alloc * SEG_SUM_CNT) / st.user_write);
+	fprintf(fp, "  \"skipped_per_write\": %.4f,\n", st.user_write == 0 ? 0 :
+	    (double)st.skip / st.user_write);
+	if (conf.policy->clean)
+		fprintf(fp, "  \"victim_utilization\": %.4f,\n", st.victim == 0 ? 0 :
+		    (double)st.victim_valid / st.victim / BLOCKS_PER_SEG);
+	else
+		fprintf(fp, "  \"alloc_utilization\": %.4f,\n", st.seg_alloc == 0 ? 0 :
+		    (double)st.alloc_valid / st.seg_alloc / BLOCKS_PER_SEG);
+	fprintf(fp, "  \"segment_utilization\": [");
+	for (int i = 0; i < UTIL_BUCKETS; ++i)
+		fprintf(fp, "%lu%s", util[i], i == UTIL_BUCKETS - 1 ? "]\n" : ", ");
+	fprintf(fp, "}\n");
+
+	if (fp != stdout)
+		fclose(fp);
+	wl_trace_free(&tr);
+	return 0;
+}
@@ -26,6 +26,8 @@ e-mail: wy-chung@outlook.com
 	#define	RAND_SEED	0
 #endif
 #define TIME_SCALE 100000000
+#define WBUF_BLOCKS	4096	// size of the write buffer in blocks
+#define RCACHE_BLOCKS	8192	// size of the read cache in blocks
 #define MUTIPLIER_TO_MAXBLOCK 10
 double ratio_to_maxblock = 1.4; // the ratio to max_block;
 
@@ -38,7 +40,14 @@ static void arrays_free(void);
 static void test(struct g_logstor_softc *sc, int n, unsigned max_block);
 static void test_write(struct g_logstor_softc *sc, unsigned max_block, bool update);
 static void test_read (struct g_logstor_softc *sc, unsigned max_block);
+#if defined(MY_DEBUG)
+static void test_crash(struct g_logstor_softc *sc, int n, unsigned max_block);
+static void test_dedup(struct g_logstor_softc *sc, int n, unsigned max_block);
+static void dedup_restore(struct g_logstor_softc *sc, int n, unsigned max_block);
+static void test_async(struct g_logstor_softc *sc, int n, unsigned max_block);
+#endif
 static void arrays_check(void);
+static void stats_print(struct g_logstor_softc *sc);
 
 static arrays_alloc_f *arrays_alloc_once = arrays_alloc;
 static uint32_t *i2ba;	// ba for iteration i
@@ -56,7 +65,11 @@ main_logstest(int argc, char *argv[])
 	unsigned block_cnt;
 
 	srandom(RAND_SEED);
-	block_cnt = logstor_init_disk();
+	// the optional argument is the segment size in KiB
+	if (argc > 1)
+		block_cnt = logstor_init_disk_geom(strtoul(argv[1], NULL, 0) * 1024);
+	else
+		block_cnt = logstor_init_disk();
 
 	//main_loop_count = MUTIPLIER_TO_MAXBLOCK/ratio_to_maxblock + 0.999;
 	//loop_count = block_cnt * ratio_to_maxblock;
@@ -69,12 +82,35 @@ main_logstest(int argc, char *argv[])
 gdb_cond0 = i;
 		printf("#### test %d ####\n", i);
 		sc = logstor_open();
+		// rounds 2 and 3 of every 4 store the data compressed
+		logstor_set_compress(sc, i % 4 >= 2);
+		// the last 4 rounds buffer the writes
+		logstor_set_wbuf(sc, i >= 4 ? WBUF_BLOCKS : 0);
+		// and the odd rounds cache the reads
+		logstor_set_rcache(sc, i % 2 == 1 ? RCACHE_BLOCKS : 0);
 		arrays_alloc_once(block_cnt);
 #if defined(WYC)
 		arrays_alloc();
 		arrays_nop();
+#endif
+#if defined(MY_DEBUG)
+		if (i > 0)
+			dedup_restore(sc, i, block_cnt);
 #endif
 		test(sc, i, block_cnt);
+#if defined(MY_DEBUG)
+		// the next logstor_open() will roll forward from the checkpoint
+		if (i % 2 == 1) {
+			printf("writing and crash %d...\n", i);
+			test_write(sc, block_cnt, true); arrays_check();
+		}
+		test_dedup(sc, i, block_cnt);
+		test_async(sc, i, block_cnt);
+		if (i % 2 == 1) {
+			test_crash(sc, i, block_cnt);
+			continue;
+		}
+#endif
 		logstor_close(sc);
 	}
 	arrays_free();
@@ -103,21 +139,290 @@ test(struct g_logstor_softc *sc, int i, unsigned max_block)
 	unsigned fbuf_hit =  logstor_get_fbuf_hit(sc);
 	unsigned fbuf_miss = logstor_get_fbuf_miss(sc);
 	printf("metadata hit rate %f\n", (double)fbuf_hit / (fbuf_hit + fbuf_miss));
+	stats_print(sc);
 #if defined(MY_DEBUG)
 	logstor_hash_check(sc);
 	logstor_queue_check(sc);
 #endif
 }
 
+static void
+stats_print(struct g_logstor_softc *sc)
+{
+	static struct logstor_stats st = {
+		.version = LOGSTOR_STATS_VERSION,
+		.size = sizeof(st),
+	};
+
+	MY_ASSERT(logstor_get_stats(sc, &st) == 0);
+	printf("device read data %lu fbuf %lu seg_sum %lu superblock %lu\n",
+	    st.dev_read[LOGSTOR_IO_DATA], st.dev_read[LOGSTOR_IO_FBUF],
+	    st.dev_read[LOGSTOR_IO_SEG_SUM], st.dev_read[LOGSTOR_IO_SUPERBLOCK]);
+	printf("device write data %lu fbuf %lu seg_sum %lu superblock %lu\n",
+	    st.dev_write[LOGSTOR_IO_DATA], st.dev_write[LOGSTOR_IO_FBUF],
+	    st.dev_write[LOGSTOR_IO_SEG_SUM], st.dev_write[LOGSTOR_IO_SUPERBLOCK]);
+	printf("latency p99 ns read %lu write %lu fbuf miss %lu\n",
+	    logstor_hist_percentile(&st.lat[LOGSTOR_OP_READ], 99),
+	    logstor_hist_percentile(&st.lat[LOGSTOR_OP_WRITE], 99),
+	    logstor_hist_percentile(&st.lat[LOGSTOR_OP_FBUF_MISS], 99));
+}
+
+#define DEDUP_PATTERN_CNT	64
+#define PACK_CRASH_BLOCKS	4096
+// test_dedup() overwrites the blocks from here to the end after test() is
+// done, dedup_restore() gives them back at the start of the next round
+#define DEDUP_START(max_block)	((unsigned)((max_block) * 0.96))
+
+static void dedup_pattern(uint32_t *buf, unsigned seed, unsigned k);
+
+#if defined(MY_DEBUG)
+/*
+Description:
+    Rewrite some blocks of test_dedup() compressed, then uncompressed and
+    then with their contents again. The packed sector of the first write
+    is still open when the second is written, roll forward must map each
+    block to its last write. The next round checks the contents.
+*/
+static void
+test_crash_pack(struct g_logstor_softc *sc, int n, unsigned max_block)
+{
+	uint32_t buf[SECTOR_SIZE/4];
+	unsigned start = DEDUP_START(max_block);
+
+	// the write buffer would absorb the overwrites
+	logstor_set_wbuf(sc, 0);
+	logstor_set_compress(sc, true);
+	// checkpoint now so the writes below are replayed by roll forward
+	logstor_flush(sc);
+	for (uint32_t ba = start; ba < start + PACK_CRASH_BLOCKS && ba < max_block; ++ba) {
+		// an all zero block would be deleted and force a checkpoint
+		if ((ba + n) % DEDUP_PATTERN_CNT == 0)
+			continue;
+		dedup_pattern(buf, 2 * n + 1, 1);	// compresses well
+		logstor_write(sc, ba, buf, 0);
+		dedup_pattern(buf, 2 * n + 1, 2);	// doesn't compress
+		logstor_write(sc, ba, buf, 0);
+		dedup_pattern(buf, 2 * n, (ba + n) % DEDUP_PATTERN_CNT);
+		logstor_write(sc, ba, buf, 0);
+	}
+}
+
+static void
+test_crash(struct g_logstor_softc *sc, int i, unsigned max_block)
+{
+
+	test_crash_pack(sc, i, max_block);
+	logstor_flush(sc);
+	logstor_crash(sc);
+}
+#endif
+
+// fill @buf with pattern number @k of the set @seed
+// the odd patterns compress well and the even ones don't
+// pattern 0 is all zero
+static void
+dedup_pattern(uint32_t *buf, unsigned seed, unsigned k)
+{
+	uint32_t x = seed * 0x9E3779B9 + k * 0x85EBCA6B;
+
+	if (k == 0) {
+		bzero(buf, SECTOR_SIZE);
+		return;
+	}
+	for (int i = 0; i < SECTOR_SIZE/4; ++i)
+		buf[i] = (k & 1) && i % 64 != 0 ? k : x + i * 0x01000193;
+}
+
+static int
+sa_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+Description:
+    Verify the blocks written by test_dedup() of the previous round, so the
+    references are checked to survive the close or crash, then write them
+    back with the contents test_write() left there, or delete them if
+    test_write() never wrote them
+*/
+static void
+dedup_restore(struct g_logstor_softc *sc, int n, unsigned max_block)
+{
+	uint32_t buf[SECTOR_SIZE/4], exp[SECTOR_SIZE/4];
+	uint32_t ba, i;
+
+	printf("dedup restore %d...\n", n);
+	for (ba = DEDUP_START(max_block); ba < max_block; ++ba) {
+		dedup_pattern(exp, 2 * (n - 1), (ba + n - 1) % DEDUP_PATTERN_CNT);
+		logstor_read(sc, ba, buf);
+		MY_ASSERT(memcmp(buf, exp, SECTOR_SIZE) == 0);
+		if (ba_write_count[ba] == 0) {
+			logstor_delete(sc, (off_t)ba * SECTOR_SIZE, NULL, SECTOR_SIZE);
+			continue;
+		}
+		// the words test_read() checks
+		i = ba2i[ba];
+		buf[ba % 4] = i;
+		buf[4] = ba % 4;
+		buf[5] = i;
+		buf[6] = ba;
+		buf[SECTOR_SIZE/4-4+(ba%4)] = i;
+		ba2sa[ba] = logstor_write(sc, ba, buf, 0);
+	}
+}
+
+/*
+Description:
+    Overwrite the last blocks with a small set of contents, once with
+    deduplication off and once with it on, and report the dedup ratio,
+    logical blocks per stored sector or fragment, and the throughput of
+    both.
+*/
+static void
+test_dedup(struct g_logstor_softc *sc, int n, unsigned max_block)
+{
+	uint32_t buf[SECTOR_SIZE/4], exp[SECTOR_SIZE/4];
+	unsigned start = DEDUP_START(max_block);
+	unsigned cnt = max_block - start;
+	struct timespec t0, t1, t2;
+	unsigned hit, zero;
+	uint32_t ba, sa;
+	uint32_t *sas = malloc(cnt * sizeof(*sas));
+
+	MY_ASSERT(sas != NULL);
+	printf("dedup %d...\n", n);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (ba = start; ba < max_block; ++ba) {
+		dedup_pattern(buf, 2 * n + 1, (ba + n) % DEDUP_PATTERN_CNT);
+		logstor_write(sc, ba, buf, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	hit = logstor_get_dedup_block_count(sc);
+	zero = logstor_get_zero_block_count(sc);
+	logstor_set_dedup(sc, true);
+	for (ba = start; ba < max_block; ++ba) {
+		dedup_pattern(buf, 2 * n, (ba + n) % DEDUP_PATTERN_CNT);
+		logstor_write(sc, ba, buf, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	logstor_set_dedup(sc, false);
+	hit = logstor_get_dedup_block_count(sc) - hit;
+	zero = logstor_get_zero_block_count(sc) - zero;
+	// the sectors that store the blocks, the special addresses are not
+	// stored and the write buffer is empty once dedup is turned off
+	unsigned stored = 0;
+	for (ba = start; ba < max_block; ++ba) {
+		dedup_pattern(exp, 2 * n, (ba + n) % DEDUP_PATTERN_CNT);
+		sa = logstor_read(sc, ba, buf);
+		MY_ASSERT(memcmp(buf, exp, SECTOR_SIZE) == 0);
+		if (sa > LOGSTOR_SA_WBUF)
+			sas[stored++] = sa;
+	}
+	qsort(sas, stored, sizeof(*sas), sa_cmp);
+	unsigned physical = stored != 0;
+	for (unsigned i = 1; i < stored; ++i)
+		physical += sas[i] != sas[i - 1];
+	free(sas);
+	double off = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	double on = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	double mb = (double)cnt * SECTOR_SIZE / (1024 * 1024);
+	// logical blocks for each physical sector, the all zero blocks take none
+	printf("dedup blocks %u/%u ratio %f zero blocks %u\n", hit, cnt,
+	    (double)cnt / (physical != 0 ? physical : 1), zero);
+	printf("write MB/s dedup off %.1f on %.1f\n\n", mb / off, mb / on);
+}
+
+#define ASYNC_THREADS	4
+#define ASYNC_DEPTH	16	// requests in flight
+#define ASYNC_BLOCKS	8	// blocks in a request
+
+/*
+Description:
+    Do one pass of @op over the blocks of test_dedup() with asynchronous
+    requests that complete to @cq. The blocks written and read are those
+    written last by test_dedup(). The writes of the odd rounds are FUA so
+    the flushes shared by a batch are exercised.
+*/
+static void
+async_pass(struct g_logstor_softc *sc, struct logstor_cq *cq, int op, int n,
+    unsigned start, unsigned max_block)
+{
+	static uint32_t bufs[ASYNC_DEPTH][ASYNC_BLOCKS][SECTOR_SIZE/4];
+	struct logstor_req reqs[ASYNC_DEPTH], *req;
+	uint32_t exp[SECTOR_SIZE/4];
+	uint32_t ba = start;
+	int i = 0, error;
+
+	for (int j = 0; j < ASYNC_DEPTH; ++j)
+		reqs[j] = (struct logstor_req){ .op = op, .cq = cq, .data = bufs[j],
+		    .flags = op == LOGSTOR_REQ_WRITE && n % 2 == 1 ? LOGSTOR_FUA : 0 };
+	while ((req = i < ASYNC_DEPTH ? &reqs[i++] : logstor_reap(cq, true)) != NULL) {
+		uint32_t (*buf)[SECTOR_SIZE/4] = req->data;
+
+		MY_ASSERT(req->error == 0);
+		if (op == LOGSTOR_REQ_READ)
+			for (uint32_t j = 0; j < req->cnt; ++j) {
+				dedup_pattern(exp, 2 * n, (req->ba + j + n) % DEDUP_PATTERN_CNT);
+				MY_ASSERT(memcmp(buf[j], exp, SECTOR_SIZE) == 0);
+			}
+		if (ba == max_block)
+			continue;
+		req->ba = ba;
+		req->cnt = max_block - ba < ASYNC_BLOCKS ? max_block - ba : ASYNC_BLOCKS;
+		ba += req->cnt;
+		if (op == LOGSTOR_REQ_WRITE)
+			for (uint32_t j = 0; j < req->cnt; ++j)
+				dedup_pattern(buf[j], 2 * n, (req->ba + j + n) % DEDUP_PATTERN_CNT);
+		error = logstor_submit(sc, req);
+		MY_ASSERT(error == 0);
+	}
+}
+
+static void
+async_flush_done(struct logstor_req *req)
+{
+
+	*(bool *)req->priv = true;
+}
+
+/*
+Description:
+    Rewrite the blocks of test_dedup() with the same contents and read them
+    back with asynchronous requests, then flush with a callback
+*/
+static void
+test_async(struct g_logstor_softc *sc, int n, unsigned max_block)
+{
+	struct logstor_cq *cq;
+	struct logstor_req flush;
+	bool flushed = false;
+	unsigned start = DEDUP_START(max_block);
+	int error;
+
+	printf("async %d...\n", n);
+	logstor_set_async(sc, ASYNC_THREADS);
+	cq = logstor_cq_create();
+	async_pass(sc, cq, LOGSTOR_REQ_WRITE, n, start, max_block);
+	async_pass(sc, cq, LOGSTOR_REQ_READ, n, start, max_block);
+	logstor_cq_destroy(cq);
+	flush = (struct logstor_req){ .op = LOGSTOR_REQ_FLUSH,
+	    .done = async_flush_done, .priv = &flushed };
+	error = logstor_submit(sc, &flush);
+	MY_ASSERT(error == 0);
+	// the pending requests are completed before the workers stop
+	logstor_set_async(sc, 0);
+	MY_ASSERT(flushed && flush.error == 0);
+}
+
 static void
 test_write(struct g_logstor_softc *sc, unsigned max_block, bool update)
 {
 	uint32_t buf[SECTOR_SIZE/4];
 	uint32_t ba, sa;
 
-#if defined(MY_DEBUG)
-	max_block *= 0.96;
-#endif
 	// writing data to logstor
 	int overwrite_count = 0;
 	for (unsigned i = 0 ; i < loop_count ; ++i)
@@ -134,7 +439,7 @@ test_write(struct g_logstor_softc *sc, unsigned max_block, bool update)
 		buf[5] = i;
 		buf[6] = ba;
 		buf[SECTOR_SIZE/4-4+(ba%4)] = i;
-		sa = logstor_write(sc, ba, buf);
+		sa = logstor_write(sc, ba, buf, 0);
 		if (update) {
 			if (++ba_write_count[ba] == 0)		// wrap around
 				ba_write_count[ba] = UCHAR_MAX;	// set to maximum value
@@ -155,6 +460,7 @@ test_write(struct g_logstor_softc *sc, unsigned max_block, bool update)
 	printf("write data %u other %u write amplification %f \n",
 	    data_write_count, other_write_count,
 	    (double)(data_write_count + other_write_count) / data_write_count);
+	printf("compressed blocks %u\n", logstor_get_comp_block_count(sc));
 	printf("\n");
 }
 
@@ -164,6 +470,7 @@ test_read(struct g_logstor_softc *sc, unsigned max_block)
 	uint32_t ba, sa;
 	uint32_t i_exp, i_get;
 	uint32_t buf[SECTOR_SIZE/4]; // [4]: %, [5]:i, [6]:ba
+	unsigned moved = 0;
 
 	// reading data from logstor
 	int read_count = 0;
@@ -175,7 +482,16 @@ test_read(struct g_logstor_softc *sc, unsigned max_block)
 			if (ba_write_count[ba] > i_max)
 				i_max = ba_write_count[ba];
 			sa = logstor_read(sc, ba, buf);
-			MY_ASSERT(sa == ba2sa[ba]);
+			// a zoned volume moves the blocks when it cleans the zones
+			// and so does a tiered one when it migrates them.
+			// a buffered block is written to the log later.
+			// the new address is followed once the contents are checked
+			if (sa != ba2sa[ba]) {
+				MY_ASSERT(logstor_is_zoned(sc) || logstor_is_tiered(sc) ||
+				    ba2sa[ba] == LOGSTOR_SA_WBUF);
+				MY_ASSERT(sa != 0/*SECTOR_NULL*/);
+				++moved;
+			}
 			++read_count;
 			i_exp = ba2i[ba];
 			i_get = buf[5];
@@ -186,14 +502,18 @@ test_read(struct g_logstor_softc *sc, unsigned max_block)
 			} else {
 				MY_ASSERT(buf[ba%4] == i_get);
 				MY_ASSERT(buf[SECTOR_SIZE/4-4+(ba%4)] == i_get);
+				// the block moved is this block and not another one
+				MY_ASSERT(buf[4] == ba % 4 && buf[6] == ba);
 			}
+			ba2sa[ba] = sa;
 		}
 		else {
 			sa = logstor_read(sc, ba, buf);
 			MY_ASSERT(sa == 0/*SECTOR_NULL*/);
 		}
 	}
-	printf("percent of block read %f max overwrite times %u\n\n", (double)read_count/max_block, i_max);
+	printf("percent of block read %f max overwrite times %u moved %u\n\n",
+	    (double)read_count/max_block, i_max, moved);
 }
 
 static void
@@ -13,26 +13,67 @@ e-mail: wy-chung@outlook.com
 #include <errno.h>
 //#include <assert.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/queue.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #if __linux
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "logstor.h"
+#include "crc32c.h"
+#include "lz.h"
 
 #define roundup2(x, y)	(((x)+((y)-1))&~((y)-1))
 #define rounddown2(x, y) ((x)&~((y)-1))
 
-#define	SEG_SIZE	0x400000		// 4M
-#define	SECTORS_PER_SEG	(SEG_SIZE/SECTOR_SIZE)	// 1024
-#define BLOCKS_PER_SEG	(SECTORS_PER_SEG - 1)
-#define SEG_SUM_OFFSET	(SECTORS_PER_SEG - 1)	// segment summary offset
+/*
+  Geometry
+
+  The segment size is chosen when the disk is initialized and recorded in
+  the superblock, so the segments can match the erase block or the RAID
+  stripe of the downstream disk. It is a power of 2 from 1 << SEG_SHIFT_MIN
+  to 1 << SEG_SHIFT_MAX sectors. The segment summary at the end of a
+  segment takes as many sectors as the reverse map and the checksums of
+  the rest of the segment need.
+
+  SECTOR_SIZE is the block size of the API and the fan-out of the forward
+  map (IDX_BITS) follows from it, so they are fixed at compile time like
+  SB_CNT. They are recorded in the superblock too and a disk initialized
+  by a build with other values is refused.
+
+  The values derived from the segment size are set once by geom_set() and
+  are used through the macros below as shifts and masks.
+*/
+#define SEG_SHIFT_DEFAULT	10	// 4M
+#define SEG_SHIFT_MIN		6	// 256K
+#define SEG_SHIFT_MAX		14	// 64M
+#define SECTORS_PER_SEG_MAX	(1u << SEG_SHIFT_MAX)
+
+static struct {
+	uint32_t seg_shift;	// sectors per segment shift
+	uint32_t seg_sum_cnt;	// number of segment summary sectors
+	bool zoned;		// see "Zoned mode"
+	bool tiered;		// see "Two tiers"
+	uint32_t seg_first;	// the first segment of the log
+	uint32_t seg_end;	// the segment after the last one of the log
+} geom;
+
+#define SEC_PER_SEG_SHIFT	(geom.seg_shift)	// sectors per segment shift
+#define	SECTORS_PER_SEG	(1u << SEC_PER_SEG_SHIFT)
+#define	SEG_SIZE	((size_t)SECTOR_SIZE << SEC_PER_SEG_SHIFT)
+#define SEG_SUM_CNT	(geom.seg_sum_cnt)	// number of segment summary sectors
+#define BLOCKS_PER_SEG	(SECTORS_PER_SEG - SEG_SUM_CNT)
+#define SEG_SUM_OFFSET	(SECTORS_PER_SEG - SEG_SUM_CNT)	// segment summary offset
 #define SB_CNT	8	// number of superblock sectors
-#define SEC_PER_SEG_SHIFT 10	// sectors per segment shift
 
 /*
   The max file size is 1K*1K*4K=4G, each entry is 4 bytes
@@ -41,6 +82,12 @@ e-mail: wy-chung@outlook.com
 #define BLOCK_MAX	0x40000000	// 1G
 // the address [BLOCK_MAX..META_STAR) are invalid block/metadata address
 #define BLOCK_INVALID	-1
+#define BLOCK_PACKED	BLOCK_MAX	// reverse map of a packed sector
+#define BLOCK_WARM	(BLOCK_MAX + 1)	// reverse map of a warm state sector
+// flag in the reverse map of a block moved by cleaning while only the
+// snapshot maps it, roll forward doesn't replay it, see zone_clean_seg()
+#define BLOCK_SNAP	0x80000000u
+#define IS_BLOCK_SNAP(x)	((x) >= BLOCK_SNAP && (x) < BLOCK_SNAP + BLOCK_MAX)
 
 enum {
 	SECTOR_NULL,	// the metadata are all NULL
@@ -50,6 +97,8 @@ enum {
 };
 _Static_assert(SB_CNT >= SECTOR_ENUM_CNT,
 	"super block counts must be bigger than the number of SECTOR enum");
+_Static_assert(LOGSTOR_SA_WBUF == SECTOR_CACHE,
+	"a block in the write buffer is in the cache");
 
 #if defined(MY_DEBUG)
 void my_break(void)
@@ -76,6 +125,14 @@ void my_panic(const char * file, int line, const char *func)
 #define	IS_FBUF_ADDR(x)	((x) >= FBUF_ADDR_START)
 
 #define FBUF_CLEAN_THRESHOLD	32
+// watermarks for the dirty leaves, in percent of fbuf_count
+// the dirty leaves are written back incrementally when it exceeds the high watermark
+#define FBUF_DIRTY_HIGH	75
+#define FBUF_DIRTY_LOW	50
+#define FBUF_WB_BATCH	2	// max number of dirty leaves written back per operation
+// a checkpoint is made after 1/CKPT_SEG_RATIO of the segments are allocated
+#define CKPT_SEG_RATIO	8
+#define ZONE_OP_PCT	10	// zoned mode, the log space not used for blocks in percent
 #define FBUF_MIN	1564
 #define FBUF_MAX	(FBUF_MIN * 2)
 // the last bucket is reserved for queuing fbufs that will not be searched
@@ -125,6 +182,32 @@ struct _superblock {
 	uint8_t fd_snap;	// the file descriptor for snapshot mapping
 	uint8_t fd_cur;		// the file descriptor for current mapping
 	uint8_t fd_snap_new;	// the file descriptor for new snapshot mapping
+	/*
+	   The checkpoint
+
+	   The forward map pointed by %fh is consistent up to the log position
+	   (%seg_allocp, %ss_allocp). The segments written after that position
+	   are replayed on open, see logstor_roll_forward().
+	*/
+	uint32_t seg_gen;	// generation of the segment %seg_allocp
+	uint16_t ss_allocp;	// sector allocation pointer in segment %seg_allocp
+	uint32_t warm_sa;	// header of the warm state, SECTOR_NULL if none
+	// the geometry, see "Geometry"
+	uint16_t sector_size;	// SECTOR_SIZE
+	uint8_t idx_bits;	// IDX_BITS
+	uint8_t sb_cnt;		// SB_CNT
+	uint8_t seg_shift;	// sectors per segment shift
+	uint8_t zoned;		// the segments are the zones of a zoned disk
+	uint8_t dev_cnt;	// the segments are striped over this many devices
+	// zoned mode: the segments after the log head and before this one are free
+	uint32_t zone_free_sega;
+	// two tiers: the log is in the segments before %tier_seg_cnt on the
+	// fast tier, the others are the capacity tier, see "Two tiers"
+	uint32_t tier_seg_cnt;	// 0 if there is one tier
+	uint32_t tier_seg_allocp;	// the capacity tier allocates this segment
+	uint16_t tier_ss_allocp;	// and this sector in it
+	uint32_t tier_seg_fresh;	// the capacity tier never wrote this segment and the ones after it
+	uint32_t sb_csum;	// CRC32C of the fields above, must be the last field
 };
 
 _Static_assert(sizeof(struct _superblock) < SECTOR_SIZE,
@@ -164,6 +247,36 @@ struct _fbuf_comm { // the common part fot fbuf and fbuf_sentinel
 	uint8_t is_sentinel:1;
 	uint8_t accessed:1;	/* only used for fbufs on circular queue */
 	uint8_t modified:1;	/* the fbuf is dirty */
+	uint8_t prefetched:1;	/* read ahead and not accessed yet */
+};
+
+/*
+  Forward map prefetch
+
+  The reads are matched against PF_STREAM_CNT streams. A read that is
+  within PF_STRIDE_MAX blocks of the last read of a stream sets the
+  stride of the stream and the reads that follow with the same stride
+  make it confident after PF_CONFIRM of them. The leaves ahead of a
+  confident stream are then read into the fbuf cache so the stream does
+  not miss when it moves to the next leaf. Like the write back of the
+  dirty leaves, at most PF_BATCH leaves are read after each read so the
+  cost is spread over the reads of the stream. The window starts at one
+  leaf and doubles each time the stream moves to another leaf, up to
+  PF_WINDOW_MAX leaves. With a stride below a leaf it is the leaves that
+  follow, otherwise the leaves of the next strides.
+*/
+#define PF_STREAM_CNT	4
+#define PF_STRIDE_MAX	(64 * (SECTOR_SIZE/4))	// in blocks
+#define PF_CONFIRM	2
+#define PF_BATCH	2
+#define PF_WINDOW_MAX	16
+
+struct _pf_stream {
+	uint32_t last_ba;	// the last block read
+	int32_t stride;		// in blocks, 0 if not known
+	uint32_t hits;		// reads with the same stride in a row
+	uint32_t window;	// leaves to read ahead
+	int64_t pf_ba;		// the block of the last leaf read ahead
 };
 
 struct _fbuf_sentinel {
@@ -208,21 +321,252 @@ struct _fbuf { // file buffer
 };
 
 /*
-  The last sector in a segment is the segment summary. It stores the reverse mapping table
+  The last SEG_SUM_CNT sectors in a segment are the segment summary.
+  It stores the reverse mapping table and the checksum of each sector.
+  On the disk the reverse map of the BLOCKS_PER_SEG sectors is followed by
+  their checksums and struct _seg_sum_tail ends the last sector. The
+  in-memory struct _seg_sum is sized for the largest segment.
 */
 struct _seg_sum {
-	uint32_t ss_rm[SECTORS_PER_SEG - 1];	// reverse map
-	// reverse map SECTORS_PER_SEG - 1 is not used so we store something here
-	uint32_t ss_resv;	// reserve for future use
+	uint32_t ss_rm[SECTORS_PER_SEG_MAX];	// reverse map
+	uint32_t ss_csum[SECTORS_PER_SEG_MAX];	// CRC32C of the sectors
+	uint32_t ss_allocp;	// sector allocation pointer when written
+	uint32_t ss_gen;	// generation of this segment
+};
+
+struct _seg_sum_tail {
+	// %ss_allocp in the low SEC_PER_SEG_SHIFT bits and %ss_gen above them
+	uint32_t st_allocp_gen;
+	uint32_t st_resv[2];
+	uint32_t st_csum_self;	// CRC32C of the segment summary, must be the last field
+};
+#define SEG_GEN_MASK	((1u << (32 - SEC_PER_SEG_SHIFT)) - 1)
+// the size of the largest segment summary on the disk
+#define SEG_SUM_SIZE_MAX	(SECTORS_PER_SEG_MAX * 2 * sizeof(uint32_t))
+
+/*
+  The compressed blocks are packed into sectors. The reverse map of a packed
+  sector is BLOCK_PACKED and the block address of each fragment is in the
+  header of the packed sector.
+
+  The forward map of a fragment is the sector address with the fragment
+  index + 1 stored in the bits from SA_FRAG_SHIFT.
+*/
+#define PACK_FRAG_MAX	15	// max number of fragments in a packed sector
+#define SA_FRAG_SHIFT	27
+#define SA_MASK		((1u << SA_FRAG_SHIFT) - 1)
+#define SA_FRAG(sa, i)	((sa) | ((i) + 1) << SA_FRAG_SHIFT)
+#define SA_FRAG_IDX(sa)	(((sa) >> SA_FRAG_SHIFT) - 1)
+#define SA_IS_FRAG(sa)	(((sa) & ~SA_MASK) != 0)
+// bit 31 of a forward map entry is reserved, it is not part of the sector
+// address or the fragment index and is stripped when an entry is read
+#define SA_RSVD		(1u << 31)
+_Static_assert(PACK_FRAG_MAX < (SA_RSVD >> SA_FRAG_SHIFT),
+	"the fragment index must not reach the reserved bit");
+
+struct _pack_hdr {
+	uint16_t ph_cnt;	// number of fragments
+	uint16_t ph_resv;
+	struct {
+		uint32_t ba;	// block address of the fragment
+		uint16_t off;	// offset of the compressed data in the sector
+		uint16_t len;	// length of the compressed data
+	} ph_frag[PACK_FRAG_MAX];
+};
+
+union _pack_sec {
+	struct _pack_hdr hdr;
+	uint8_t data[SECTOR_SIZE];
+};
+// a block is packed only if at least 2 of them fit in a sector
+#define PACK_LEN_MAX	((SECTOR_SIZE - sizeof(struct _pack_hdr)) / 2)
+
+/*
+  Deduplication
+
+  The fingerprint index maps the CRC32C of a block to the sector address
+  (or fragment address) that stores it. It is set associative with LRU
+  replacement in each set so its memory is bounded. An entry may be out
+  of date so a hit is always verified by comparing the data.
+
+  A deduplicated block shares the sector with the block in its reverse
+  map. Each sharing block is recorded as a reference to the sector and
+  the sector is valid as long as any of its references is valid. The
+  references are rebuilt from the forward map when logstor is opened.
+*/
+#define DEDUP_IDX_BITS	16	// number of index sets in bits
+#define DEDUP_IDX_WAYS	4
+#define DEDUP_REF_BUCKET_CNT	(1 << 16)
+
+/*
+  Write buffer
+
+  With logstor_set_wbuf() the data blocks written are kept in memory and
+  written to the log later, so a block rewritten while it is buffered takes
+  one log sector instead of one for each write. The buffered blocks are
+  hashed by their block address and a read of a buffered block is served
+  from the buffer. The blocks are destaged, written to the log in the order
+  of their block addresses, WBUF_BATCH of the oldest at a time when the
+  buffer is full or the oldest one has been buffered for WBUF_AGE_NS, and
+  all of them by a flush, a snapshot, a change of the compression or the
+  deduplication and logstor_close(). The age is checked by the reads and
+  the writes since there is no thread of its own.
+
+  A buffered block is not durable until it is destaged and flushed, a write
+  with LOGSTOR_FUA goes to the log directly. A rollback discards the
+  buffered blocks since they are written after the snapshot.
+*/
+#define WBUF_BATCH	64
+#define WBUF_AGE_NS	1000000000ull	// 1 second
+
+struct _wbuf {
+	LIST_ENTRY(_wbuf) hash_link;
+	TAILQ_ENTRY(_wbuf) age_link;	// in the free list if the entry is not used
+	uint64_t time;	// when the block was buffered
+	uint32_t ba;
+	uint32_t data[SECTOR_SIZE/4];
+};
+LIST_HEAD(_wbuf_list, _wbuf);
+TAILQ_HEAD(_wbuf_queue, _wbuf);
+
+/*
+  Read cache
+
+  With logstor_set_rcache() the data blocks read are kept in a cache
+  hashed by their block address. A write or a delete of a block removes
+  it from the cache and a rollback empties the cache. A block whose
+  sector is moved by zone cleaning or tier migration stays cached with
+  its new sector address.
+
+  The cache is a segmented LRU so a scan doesn't flush it. A block enters
+  the probation segment and is moved to the protected segment when it is
+  hit there. The protected segment takes up to RC_PROTECTED_PCT of the
+  cache, its least recently used block goes back to probation when it
+  is full. A block is replaced from probation first.
+
+  The reads are matched against RC_STREAM_CNT sequential streams. Once a
+  stream has read RC_CONFIRM blocks in a row the blocks ahead of it are
+  read into the cache when it gets within RC_WINDOW / 2 blocks of the end
+  of the blocks read ahead, up to RC_WINDOW blocks ahead. The sectors of
+  the blocks read ahead that follow each other in a segment are read with
+  one request. The blocks read ahead enter probation too.
+*/
+#define RC_PROTECTED_PCT	80
+#define RC_STREAM_CNT	4
+#define RC_CONFIRM	2
+#define RC_WINDOW	32	// in blocks
+
+enum {
+	RC_PROBATION,
+	RC_PROTECTED,
+	RC_QUEUE_CNT,
+};
+
+struct _rcache {
+	LIST_ENTRY(_rcache) hash_link;
+	TAILQ_ENTRY(_rcache) lru_link;	// in the free list if the entry is not used
+	uint32_t ba;
+	uint32_t sa;	// where the block was read from
+	uint8_t queue;	// RC_XXX
+	uint32_t data[SECTOR_SIZE/4];
+};
+LIST_HEAD(_rcache_list, _rcache);
+TAILQ_HEAD(_rcache_queue, _rcache);
+
+struct _rc_stream {
+	uint32_t next_ba;	// the block the stream reads next
+	uint32_t ra_ba;		// the block after those read ahead
+	uint32_t hits;
+};
+
+/*
+  Asynchronous requests
+
+  logstor_submit() puts a request in the submission ring and returns, the
+  worker threads started by logstor_set_async() take the requests from
+  the ring and execute them with the blocking entry points. The ring is
+  a bounded lock-free queue: each slot has a sequence number that tells
+  whether it is free or full in the current lap around the ring, and the
+  submitters and the workers claim the slots by advancing %async_head and
+  %async_tail with compare and swap. A worker sleeps on %async_cv only
+  when the ring is empty, %async_sleepers tells the submitters whether
+  they have to wake one up.
+
+  A request is completed by calling its callback in the worker thread or
+  by putting it on its completion queue, where logstor_reap() finds it.
+  The requests are executed in any order, one that must follow another
+  is submitted after the other is completed.
+
+  A worker takes up to ASYNC_BATCH requests that are in the ring at once,
+  executes them in ring order and then completes them together. The FUA
+  writes and the flushes of a batch share one logstor_flush(), and the
+  reaper of a completion queue is woken once for the batch instead of
+  once for every request.
+*/
+#define ASYNC_RING_SIZE	1024	// must be a power of 2
+#define ASYNC_THREAD_MAX	16
+#define ASYNC_BATCH	16	// requests a worker takes from the ring at a time
+
+struct _async_slot {
+	uint64_t seq;
+	struct logstor_req *req;
+};
+
+struct logstor_cq {
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;	// a request is completed
+	struct logstor_req *head;	// the completed requests, the oldest first
+	struct logstor_req **tailp;
+	unsigned pending;	// requests submitted and not completed, atomic
+};
+
+/*
+  Warm restart
+
+  At close the metadata addresses of the leaves in the fbuf cache, the
+  recently accessed ones first, and the deduplication references are
+  written to the log with the reverse map BLOCK_WARM. The sectors are
+  listed in a header sector that is pointed to by the superblock.
+
+  At open the references are loaded from them instead of being rebuilt
+  by scanning all the segment summaries and the forward map, and the
+  leaves are read into the cache. The warm state is used once. Its
+  sectors stay valid until the next checkpoint so a crash before that
+  finds it again with the superblock that points to it.
+*/
+#define WARM_MAGIC	0x4D524157	// "WARM"
+#define WARM_SEC_MAX	1020		// max number of sectors listed in the header
+#define WARM_NO_REF	0xFFFFFFFF	// too many references, they are rebuilt
+
+struct _warm_hdr {
+	uint32_t wh_magic;
+	uint32_t wh_leaf_cnt;	// number of leaves
+	uint32_t wh_ref_cnt;	// number of references or WARM_NO_REF
+	uint32_t wh_sec_cnt;	// number of sectors in %wh_sa
+	// the leaves followed by the (sa, ba) of the references
+	uint32_t wh_sa[WARM_SEC_MAX];
+};
+_Static_assert(sizeof(struct _warm_hdr) == SECTOR_SIZE,
+	"The size of the warm state header must be SECTOR_SIZE");
+
+struct _dedup_ent {
+	uint32_t fp;	// fingerprint
+	uint32_t sa;	// sector address or fragment address, SECTOR_NULL if empty
 };
 
-_Static_assert(sizeof(struct _seg_sum) == SECTOR_SIZE,
-	"The size of segment summary must be equal to SECTOR_SIZE");
+struct _dedup_ref {
+	LIST_ENTRY(_dedup_ref) sec_link;	// the references to the same sector
+	LIST_ENTRY(_dedup_ref) ba_link;	// the references from the same block
+	uint32_t sa;	// sector address or fragment address
+	uint32_t ba;	// the block that shares it
+};
+LIST_HEAD(_dedup_ref_list, _dedup_ref);
 
 /*
 	logstor soft control
 */
 struct g_logstor_softc {
+	pthread_mutex_t sc_mtx;	// protects everything below, held by all the public entry points
 	bool (*is_sec_valid_fp)(struct g_logstor_softc *sc, uint32_t sa, uint32_t ba_rev);
 	uint32_t (*ba2sa_fp)(struct g_logstor_softc *sc, uint32_t ba);
 
@@ -233,23 +577,115 @@ struct g_logstor_softc {
 	uint32_t sb_sa; 	// superblock's sector address
 	uint8_t sb_modified:1;	// is the super block modified
 	uint8_t ss_modified:1;	// is segment summary modified
+	uint8_t unlogged:1;	// forward map changes not in the log (delete, dedup) since the last checkpoint
+	uint32_t ckpt_seg_cnt;	// number of segments allocated since the last checkpoint
+	// zoned mode, the segments from %zone_free_sega to %zone_clean_sega are
+	// cleaned but still used by the checkpoint
+	uint32_t zone_free_sega;
+	uint32_t zone_clean_sega;	// the next segment to clean
+	bool zone_reloc;	// _logstor_write() is moving a live sector
+	// two tiers, the segments after the log head and before %tier_mig_sega
+	// are migrated
+	uint32_t tier_mig_sega;
+	bool tier_mig;		// the live sectors are moved to the capacity tier
+	bool tier_full;		// no free sector in the capacity tier until the next checkpoint
+	bool tier_ss_modified;
+	struct _seg_sum tier_sum;	// segment summary of %superblock.tier_seg_allocp
+	// sectors superseded since the last checkpoint, the checkpoint may still use them
+	uint8_t *sec_pinned;
+	// checksums of all the sectors, loaded from the segment summaries on demand
+	uint32_t *sec_csum;
+	uint8_t *seg_csum_loaded;	// bitmap of the segments whose checksums are loaded
+	struct _seg_sum ss_buf;	// buffer for loading the checksums
+
+	// the packed sector being filled with the compressed blocks
+	bool compress;		// compress the data blocks
+	uint32_t pack_sa;	// sector address of the packed sector, SECTOR_NULL if none
+	uint32_t pack_off;	// offset of the free space in the packed sector
+	union _pack_sec pack;
+
+	// deduplication
+	bool dedup;		// deduplicate the data blocks
+	struct _dedup_ent (*dedup_idx)[DEDUP_IDX_WAYS];	// fingerprint index
+	// hash buckets of the references keyed by the sector and by the block
+	struct _dedup_ref_list *dedup_ref_sec;
+	struct _dedup_ref_list *dedup_ref_ba;
+
+	// write buffer
+	unsigned wbuf_max;	// number of blocks in the buffer, 0 if it is off
+	unsigned wbuf_cnt;	// number of blocks buffered
+	struct _wbuf *wbufs;	// an array of %wbuf_max entries
+	struct _wbuf **wbuf_sort;	// the entries to destage sorted by the block address
+	struct _wbuf_list *wbuf_hash;
+	uint32_t wbuf_hash_mask;
+	struct _wbuf_queue wbuf_age;	// the buffered blocks, the oldest first
+	struct _wbuf_queue wbuf_free;
+
+	// read cache
+	unsigned rc_max;	// number of blocks in the cache, 0 if it is off
+	unsigned rc_cnt[RC_QUEUE_CNT];	// number of blocks in each segment
+	struct _rcache *rcaches;	// an array of %rc_max entries
+	struct _rcache_list *rc_hash;
+	uint32_t rc_hash_mask;
+	struct _rcache_queue rc_queue[RC_QUEUE_CNT];	// the least recently used first
+	struct _rcache_queue rc_free;
+	struct _rc_stream rc_stream[RC_STREAM_CNT];
+	int rc_stream_next;	// the stream to replace
+	char *rc_ra_buf;	// RC_WINDOW sectors for the readahead
+
+	// asynchronous requests
+	struct _async_slot *async_ring;	// ASYNC_RING_SIZE slots
+	uint64_t async_head;	// the next slot to put a request in
+	uint64_t async_tail;	// the next slot to take a request from
+	unsigned async_pending;	// requests submitted and not completed
+	int async_sleepers;	// workers waiting for a request
+	bool async_stop;
+	int async_thread_cnt;	// 0 if the asynchronous requests are off
+	pthread_t async_tid[ASYNC_THREAD_MAX];
+	pthread_mutex_t async_mtx;
+	pthread_cond_t async_cv;	// a request is submitted or the workers stop
+	pthread_cond_t async_idle_cv;	// no request is pending
+
+	// warm restart
+	uint32_t warm_sec[WARM_SEC_MAX + 1];	// the sectors of the warm state
+	int warm_sec_cnt;	// they are valid until the next checkpoint
+	uint32_t *warm_leaf;	// the leaves to read at open
+	uint32_t warm_leaf_cnt;
 
 	int fbuf_count;
 	struct _fbuf *fbufs;	// an array of fbufs
 	struct _fbuf *fbuf_allocp; // point to the fbuf candidate for replacement
 	struct _fbuf_sentinel fbuf_queue[QUEUE_CNT];
 	int fbuf_queue_len[QUEUE_CNT];
+	bool fbuf_wb_active;	// the dirty leaves are being written back
+	bool prefetch;		// read ahead the leaves of sequential and strided reads
+	struct _pf_stream pf_stream[PF_STREAM_CNT];
+	int pf_stream_next;	// the stream to replace
 
 	// buffer hash queue
 	struct _fbuf_sentinel fbuf_bucket[FBUF_BUCKET_CNT];
 #if defined(MY_DEBUG)
 	int fbuf_bucket_len[FBUF_BUCKET_CNT];
 #endif
+	/*
+	  group commit
+	  %wr_gen is incremented for each write and delete. A flush makes all the
+	  writes up to %wr_gen durable. The flushes that arrive while a flush
+	  is in progress wait for it and are served together by the next one.
+	*/
+	uint64_t wr_gen;	// generation of the last write
+	uint64_t flush_gen;	// the writes up to this generation are durable
+	bool flush_busy;	// a flush is syncing the disk
+	pthread_cond_t flush_cv;
+
 	// statistics
 	unsigned data_write_count;	// data block write to disk
 	unsigned other_write_count;	// other write to disk, such as metadata write and segment cleaning
 	unsigned fbuf_hit;
 	unsigned fbuf_miss;
+	unsigned comp_block_count;	// data blocks stored compressed
+	unsigned dedup_block_count;	// data blocks deduplicated
+	unsigned zero_block_count;	// all zero data blocks eliminated
 
 	/*
 	  The macro RAM_DISK_SIZE is used for debug.
@@ -258,15 +694,159 @@ struct g_logstor_softc {
 	struct _superblock superblock;
 };
 
-static void my_read (struct g_logstor_softc *sc, void *buf, uint32_t sa);
-static void my_write(struct g_logstor_softc *sc, const void *buf, uint32_t sa);
+static void my_read (struct g_logstor_softc *sc, void *buf, uint32_t sa, int kind);
+static void my_read_run(struct g_logstor_softc *sc, void *buf, uint32_t sa, uint32_t cnt, int kind);
+static void my_write(struct g_logstor_softc *sc, const void *buf, uint32_t sa, int kind);
+static uint32_t zone_append(struct g_logstor_softc *sc, const void *buf, uint32_t zone, int kind);
+static void my_sync (struct g_logstor_softc *sc);
 
 uint32_t gdb_cond0 = -1;
 uint32_t gdb_cond1 = -1;
 
-static char *ram_disk;
+#define RAM_DEV_MAX	16
+static char *ram_dev[RAM_DEV_MAX];	// see "Striping"
+static int ram_dev_cnt;
+
+/*
+  Statistics and event trace
+  Each thread counts in its own struct so the counters are never shared
+  between CPUs. logstor_get_stats() sums them up. They live as long as
+  the process, so they are not reset by logstor_open() and the counts of
+  the threads that have exited are kept.
+
+  Each thread also records the events in its own ring of TRACE_RING_SIZE
+  entries. Only the owner writes to the ring so no lock is needed. The
+  head is published with a release store and logstor_trace_dump() copies
+  the ring without stopping the owner. When the ring is full the oldest
+  events are overwritten.
+*/
+#define TRACE_RING_SIZE	4096	// must be a power of 2
+
+struct _thread_stats {
+	LIST_ENTRY(_thread_stats) link;
+	struct logstor_stats st;
+	uint16_t tid;		// the thread number in the trace
+	uint8_t op_depth;	// nesting of the public operations
+	uint8_t trace_flags;	// LOGSTOR_TF_XXX of the current operation
+	uint64_t trace_head;	// number of events recorded
+	struct logstor_trace_ev trace[TRACE_RING_SIZE];
+};
+
+static LIST_HEAD(, _thread_stats) stats_list = LIST_HEAD_INITIALIZER(stats_list);
+static pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct _thread_stats *thread_stats;
+static uint16_t thread_cnt;
+static bool trace_on = true;
+
+static struct _thread_stats *
+thread_stats_get(void)
+{
+	struct _thread_stats *ts = thread_stats;
+
+	if (__predict_false(ts == NULL)) {
+		ts = calloc(1, sizeof(*ts));
+		MY_ASSERT(ts != NULL);
+		pthread_mutex_lock(&stats_mtx);
+		ts->tid = thread_cnt++;
+		LIST_INSERT_HEAD(&stats_list, ts, link);
+		pthread_mutex_unlock(&stats_mtx);
+		thread_stats = ts;
+	}
+	return ts;
+}
+
+static inline struct logstor_stats *
+stats_get(void)
+{
+
+	return &thread_stats_get()->st;
+}
+
+#define STATS_INC(field)	(++stats_get()->field)
+#define STATS_ADD(field, n)	(stats_get()->field += (n))
+
+static inline uint64_t
+stats_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+Description:
+    Record the event @ev of the current thread
+    @flags are LOGSTOR_TF_XXX, @start and @end are the time of the event
+*/
+static void
+trace(int ev, int flags, uint32_t ba, uint32_t sa, uint64_t start, uint64_t end)
+{
+	struct _thread_stats *ts;
+	struct logstor_trace_ev *e;
+	uint64_t head;
+
+	if (!__atomic_load_n(&trace_on, __ATOMIC_RELAXED))
+		return;
+	ts = thread_stats_get();
+	head = ts->trace_head;
+	e = &ts->trace[head & (TRACE_RING_SIZE - 1)];
+	e->ts_ns = start;
+	e->dur_ns = MIN(end - start, 0xFFFFFFFF);
+	e->ba = ba;
+	e->sa = sa;
+	e->ev = ev;
+	e->flags = flags;
+	e->tid = ts->tid;
+	__atomic_store_n(&ts->trace_head, head + 1, __ATOMIC_RELEASE);
+}
+
+// set the trace flags @flags of the current operation
+static inline void
+trace_flag(int flags)
+{
+
+	thread_stats_get()->trace_flags |= flags;
+}
+
+// count a fbuf miss of the current operation
+static inline void
+trace_miss(struct _thread_stats *ts)
+{
+
+	if ((ts->trace_flags & LOGSTOR_TF_MISS_MASK) != LOGSTOR_TF_MISS_MASK)
+		++ts->trace_flags;
+}
+
+// the start of a public operation
+static uint64_t
+op_start(void)
+{
+	struct _thread_stats *ts = thread_stats_get();
+
+	if (ts->op_depth++ == 0)
+		ts->trace_flags = 0;
+	return stats_time();
+}
+
+/*
+Description:
+    The end of public operation @op that started at @start
+    Its latency is added to the statistics and it is traced with the
+    flags of what happened during it.
+*/
+static void
+op_end(int op, uint32_t ba, uint32_t sa, uint64_t start)
+{
+	struct _thread_stats *ts = thread_stats_get();
+	uint64_t end = stats_time();
+
+	--ts->op_depth;
+	logstor_hist_add(&ts->st.lat[op], end - start);
+	trace(op, ts->trace_flags, ba, sa, start, end);
+}
 #if defined(MY_DEBUG)
-// given a page number and see a 4k page. point to the same address as ram_disk
+// given a page number and see a 4k page of device 0
 static union {
 	uint32_t u32[1024];
 	uint16_t u16[2048];
@@ -274,10 +854,325 @@ static union {
 } *ram4k;
 #endif
 
+/*
+  RAM disk
+
+  Each device of the RAM disk is an anonymous mapping with MAP_NORESERVE so the memory is
+  committed when a sector is first written, not up front. Its size is
+  RAM_DISK_SIZE or the environment variable LOGSTOR_RAM_SIZE in bytes
+  with an optional K, M or G suffix, rounded down to segments on each
+  device, see "Striping".
+  LOGSTOR_RAM_HUGEPAGE selects the pages:
+      thp      transparent huge pages through madvise(), the default
+      hugetlb  huge pages from the hugetlbfs pool, thp if the pool is short.
+               They are reserved up front, otherwise a fault on an empty
+               pool would kill the process with SIGBUS
+      off      base pages
+  With huge pages the huge page of a sector is committed as a whole.
+  logstor_init_disk() does not write the segment summaries so that it
+  does not commit the huge page at the end of each segment, the segments
+  not written yet are known from the superblock, see seg_sum_read().
+
+  The sectors are written with non-temporal stores. Most of them are not
+  read back soon so the copies would only evict the CPU cache.
+*/
+static size_t ram_disk_size;	// size of all the devices
+static size_t ram_dev_size;	// size of the mapping of each device
+
+/*
+  Striping
+
+  The RAM disk is made of LOGSTOR_RAM_DEVS devices, 1 by default, each of
+  them a mapping of its own. The segments are striped over the devices
+  round-robin, segment n is segment n / ram_dev_cnt of device
+  n % ram_dev_cnt. A segment is written sequentially so it is never split
+  and the consecutive segments of the log go to different devices. The
+  superblock records the number of devices, a volume can only be opened
+  with the same number since the segments would land elsewhere.
+  The log has one head, so the segments are not written to the devices
+  in parallel.
+*/
+static inline char *
+ram_sec(uint32_t sa)
+{
+	uint32_t sega;
+	off_t off;
+
+	// no division on each I/O of the default single device
+	if (ram_dev_cnt == 1)
+		return ram_dev[0] + (off_t)sa * SECTOR_SIZE;
+	sega = sa >> SEC_PER_SEG_SHIFT;
+	off = ((off_t)(sega / ram_dev_cnt) << SEC_PER_SEG_SHIFT) +
+	    (sa & (SECTORS_PER_SEG - 1));
+	return ram_dev[sega % ram_dev_cnt] + off * SECTOR_SIZE;
+}
+
+// see "Zone emulator"
+static struct {
+	uint32_t zone_shift;	// sectors per zone shift, 0 if the disk is not zoned
+	uint32_t zone_cnt;
+	uint32_t conv_cnt;	// number of conventional zones
+	uint32_t *wp;		// write pointer of each zone in sectors from its start
+} zone_emu;
+
+static void zone_emu_init(void);
+
+// the size in the environment variable @name, 0 if it is not set
+static size_t
+env_size_get(const char *name)
+{
+	const char *env = getenv(name);
+	char *end;
+	size_t size;
+
+	if (env == NULL)
+		return 0;
+	size = strtoull(env, &end, 0);
+	switch (*end) {
+	case 'G': case 'g':
+		size <<= 10;
+		/* FALLTHROUGH */
+	case 'M': case 'm':
+		size <<= 10;
+		/* FALLTHROUGH */
+	case 'K': case 'k':
+		size <<= 10;
+	}
+	return size;
+}
+
+static size_t
+ram_disk_size_get(void)
+{
+	const char *env = getenv("LOGSTOR_RAM_SIZE");
+	size_t size;
+
+	size = env != NULL ? env_size_get("LOGSTOR_RAM_SIZE") : RAM_DISK_SIZE;
+	// hugetlb maps whole huge pages of each device
+	size -= size % (MAX(SEG_SIZE, 1u << 21) * ram_dev_cnt);
+	if (size < 2 * SEG_SIZE) {
+		printf("%s: LOGSTOR_RAM_SIZE %s is too small\n", __func__, env);
+		MY_PANIC();
+	}
+	return size;
+}
+
+static char *
+ram_dev_map(size_t size, const char *huge)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	void *p = MAP_FAILED;
+
+#if defined(MAP_HUGETLB)
+	if (strcmp(huge, "hugetlb") == 0)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    (flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		MY_ASSERT(p != MAP_FAILED);
+#if defined(MADV_HUGEPAGE)
+		if (strcmp(huge, "off") != 0)
+			madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
+	return p;
+}
+
+static void
+ram_disk_alloc(void)
+{
+	const char *huge = getenv("LOGSTOR_RAM_HUGEPAGE");
+	const char *devs = getenv("LOGSTOR_RAM_DEVS");
+
+	ram_dev_cnt = devs != NULL ? atoi(devs) : 1;
+	if (ram_dev_cnt < 1 || ram_dev_cnt > RAM_DEV_MAX) {
+		printf("%s: LOGSTOR_RAM_DEVS %s is not from 1 to %d\n",
+		    __func__, devs, RAM_DEV_MAX);
+		MY_PANIC();
+	}
+	ram_disk_size = ram_disk_size_get();
+	ram_dev_size = ram_disk_size / ram_dev_cnt;
+	if (huge == NULL)
+		huge = "thp";
+	for (int i = 0; i < ram_dev_cnt; ++i)
+		ram_dev[i] = ram_dev_map(ram_dev_size, huge);
+	zone_emu_init();
+}
+
+static void
+ram_disk_free(void)
+{
+
+	for (int i = 0; i < ram_dev_cnt; ++i) {
+		munmap(ram_dev[i], ram_dev_size);
+		ram_dev[i] = NULL;
+	}
+	ram_dev_cnt = 0;
+	free(zone_emu.wp);
+	bzero(&zone_emu, sizeof(zone_emu));
+}
+
+// copy a sector to the RAM disk bypassing the CPU cache
+static inline void
+ram_disk_copy_nt(void *dst, const void *src)
+{
+#if defined(__SSE2__)
+	__m128i *d = dst;
+	const __m128i *s = src;
+	const __m128i *end = s + SECTOR_SIZE / sizeof(*s);
+
+	for (; s < end; s += 4, d += 4) {
+		_mm_stream_si128(d, _mm_loadu_si128(s));
+		_mm_stream_si128(d + 1, _mm_loadu_si128(s + 1));
+		_mm_stream_si128(d + 2, _mm_loadu_si128(s + 2));
+		_mm_stream_si128(d + 3, _mm_loadu_si128(s + 3));
+	}
+	// the streaming stores are weakly ordered
+	_mm_sfence();
+#else
+	memcpy(dst, src, SECTOR_SIZE);
+#endif
+}
+
 static inline off_t
 get_mediasize(void)
 {
-	return RAM_DISK_SIZE;
+	return ram_disk_size;
+}
+
+/*
+  Zone emulator
+
+  With the environment variable LOGSTOR_RAM_ZONE_SIZE the RAM disk emulates
+  a zoned device with zones of that size. The first LOGSTOR_RAM_ZONE_CONV
+  zones, 1% of them by default, are conventional zones that take writes
+  anywhere. The others are sequential zones that only take a write at their
+  write pointer, which the write advances. A write anywhere else is a panic.
+  A reset moves the write pointer back to the start of the zone and discards
+  its memory so it reads as zeros, a finish moves it to the end. Both are
+  no-ops on a conventional zone.
+*/
+static void
+zone_emu_init(void)
+{
+	const char *env = getenv("LOGSTOR_RAM_ZONE_CONV");
+	size_t zone_size = env_size_get("LOGSTOR_RAM_ZONE_SIZE");
+	uint32_t zone_sec = zone_size / SECTOR_SIZE;
+
+	if (zone_size == 0)
+		return;
+	if (zone_size % SECTOR_SIZE != 0 || !powerof2(zone_sec) ||
+	    zone_size > ram_disk_size) {
+		printf("%s: LOGSTOR_RAM_ZONE_SIZE %zu is not a power of 2 sectors\n",
+		    __func__, zone_size);
+		MY_PANIC();
+	}
+	zone_emu.zone_shift = ffs(zone_sec) - 1;
+	zone_emu.zone_cnt = ram_disk_size / zone_size;
+	zone_emu.conv_cnt = env != NULL ? strtoul(env, NULL, 0) :
+	    howmany(zone_emu.zone_cnt, 100);
+	MY_ASSERT(zone_emu.conv_cnt <= zone_emu.zone_cnt);
+	zone_emu.wp = calloc(zone_emu.zone_cnt, sizeof(*zone_emu.wp));
+	MY_ASSERT(zone_emu.wp != NULL);
+}
+
+// sectors per zone of the downstream disk, 0 if it is not zoned
+static inline uint32_t
+zone_sectors_get(void)
+{
+	return zone_emu.zone_shift != 0 ? 1u << zone_emu.zone_shift : 0;
+}
+
+static inline uint32_t
+zone_conv_cnt_get(void)
+{
+	return zone_emu.conv_cnt;
+}
+
+// the write pointer of zone @zone in sectors from its start, a conventional zone has none
+static inline uint32_t
+zone_wp_get(uint32_t zone)
+{
+	MY_ASSERT(zone < zone_emu.zone_cnt);
+	return zone < zone_emu.conv_cnt ? 0 : zone_emu.wp[zone];
+}
+
+// check that the write to @sa is at the write pointer of its zone and advance it
+static inline void
+zone_wp_advance(uint32_t sa)
+{
+	uint32_t zone = sa >> zone_emu.zone_shift;
+	uint32_t off = sa & ((1u << zone_emu.zone_shift) - 1);
+
+	if (zone_emu.zone_shift == 0 || zone < zone_emu.conv_cnt)
+		return;
+	if (off != zone_emu.wp[zone]) {
+		printf("%s: write to sector %u of zone %u, the write pointer is %u\n",
+		    __func__, off, zone, zone_emu.wp[zone]);
+		MY_PANIC();
+	}
+	++zone_emu.wp[zone];
+}
+
+static void
+zone_reset(uint32_t zone)
+{
+	// the zone is a segment so it is within a device
+	char *p = ram_sec(zone << zone_emu.zone_shift);
+	size_t size = (size_t)SECTOR_SIZE << zone_emu.zone_shift;
+
+	MY_ASSERT(zone < zone_emu.zone_cnt);
+	if (zone < zone_emu.conv_cnt)
+		return;
+	zone_emu.wp[zone] = 0;
+	// hugetlb pages larger than the zone can't be discarded
+	if (madvise(p, size, MADV_DONTNEED) != 0)
+		memset(p, 0, size);
+}
+
+static void
+zone_finish(uint32_t zone)
+{
+
+	MY_ASSERT(zone < zone_emu.zone_cnt);
+	if (zone >= zone_emu.conv_cnt)
+		zone_emu.wp[zone] = 1u << zone_emu.zone_shift;
+}
+
+/*
+Description:
+    Set the geometry for segments of 1 << @seg_shift sectors
+*/
+static void
+geom_set(uint32_t seg_shift)
+{
+	uint32_t n = 1u << seg_shift;
+
+	MY_ASSERT(seg_shift >= SEG_SHIFT_MIN && seg_shift <= SEG_SHIFT_MAX);
+	geom.seg_shift = seg_shift;
+	// the fewest sectors that hold the reverse map and the checksums of
+	// the other sectors and the tail
+	geom.seg_sum_cnt = howmany(n * 2 * sizeof(uint32_t) + sizeof(struct _seg_sum_tail),
+	    SECTOR_SIZE + 2 * sizeof(uint32_t));
+	MY_ASSERT(SEG_SUM_CNT * SECTOR_SIZE <= SEG_SUM_SIZE_MAX);
+}
+
+/*
+Description:
+    Set the layout of a volume of @seg_cnt segments
+    In zoned mode the superblocks and the segment summaries are stored in
+    the segments before the log. With two tiers the log ends at the first
+    of the @tier_seg_cnt fast segments.
+*/
+static void
+geom_layout_set(bool zoned, uint32_t seg_cnt, uint32_t tier_seg_cnt)
+{
+
+	geom.zoned = zoned;
+	geom.seg_first = zoned ? howmany(SB_CNT + seg_cnt * SEG_SUM_CNT, SECTORS_PER_SEG) : 0;
+	geom.tiered = tier_seg_cnt != 0;
+	geom.seg_end = geom.tiered ? tier_seg_cnt : seg_cnt;
 }
 
 /*
@@ -290,23 +1185,125 @@ sega2sa(uint32_t sega)
 	return sega << SEC_PER_SEG_SHIFT;
 }
 
+// the sector address of the segment summary of segment @sega
+static inline uint32_t
+seg_sum_sa(uint32_t sega)
+{
+	if (geom.zoned)
+		return SB_CNT + sega * SEG_SUM_CNT;
+	return sega2sa(sega) + SEG_SUM_OFFSET;
+}
+
+// the segment after @sega in the log
+static inline uint32_t
+seg_next(struct g_logstor_softc *sc, uint32_t sega)
+{
+	if (++sega == geom.seg_end)
+		sega = geom.seg_first;
+	return sega;
+}
+
+// the number of segments from @from to @to in the log order
+static inline uint32_t
+seg_dist(struct g_logstor_softc *sc, uint32_t from, uint32_t to)
+{
+	uint32_t n = geom.seg_end - geom.seg_first;
+
+	return (to + n - from) % n;
+}
+
+// the first sector of the log in segment @sega, the superblocks come first in segment 0
+static inline uint32_t
+seg_log_start(uint32_t sega)
+{
+	return sega == 0 ? SB_CNT : 0;
+}
+
+/*
+  A sector superseded after the last checkpoint is pinned until the next
+  checkpoint, since the forward map in the checkpoint may still point to it
+*/
+static inline void
+sec_pin(struct g_logstor_softc *sc, uint32_t sa)
+{
+	if (sa >= SB_CNT)
+		sc->sec_pinned[sa / NBBY] |= 1 << (sa % NBBY);
+}
+
+static inline bool
+is_sec_pinned(struct g_logstor_softc *sc, uint32_t sa)
+{
+	return (sc->sec_pinned[sa / NBBY] & (1 << (sa % NBBY))) != 0;
+}
+
 /*******************************
  *        logstor              *
  *******************************/
 static uint32_t _logstor_read(struct g_logstor_softc *sc, uint32_t ba, void *data);
+static void sa_read(struct g_logstor_softc *sc, uint32_t sa, void *data);
 static uint32_t _logstor_write(struct g_logstor_softc *sc, uint32_t ba, void *data);
 
 static void seg_alloc(struct g_logstor_softc *sc);
 static void seg_sum_write(struct g_logstor_softc *sc);
+static void seg_sum_cur_read(struct g_logstor_softc *sc);
+static uint32_t pack_write(struct g_logstor_softc *sc, uint32_t ba, void *data);
+static void pack_flush(struct g_logstor_softc *sc);
+static void pack_read(struct g_logstor_softc *sc, uint32_t sa, void *data);
+static bool is_pack_valid(struct g_logstor_softc *sc, uint32_t sa);
+static unsigned pack_replay(struct g_logstor_softc *sc, uint32_t sa, union _pack_sec *pack);
+static bool is_zero_block(const void *data);
+static uint32_t zero_write(struct g_logstor_softc *sc, uint32_t ba);
+static uint32_t dedup_write(struct g_logstor_softc *sc, uint32_t ba, void *data);
+static bool dedup_ref_valid(struct g_logstor_softc *sc, uint32_t sa);
+static void dedup_ref_rebuild(struct g_logstor_softc *sc);
+static void dedup_mod_fini(struct g_logstor_softc *sc);
+static struct _wbuf *wbuf_find(struct g_logstor_softc *sc, uint32_t ba);
+static void wbuf_write(struct g_logstor_softc *sc, uint32_t ba, const void *data);
+static void wbuf_drop(struct g_logstor_softc *sc, uint32_t ba);
+static void wbuf_destage(struct g_logstor_softc *sc, unsigned cnt);
+static void wbuf_age_check(struct g_logstor_softc *sc);
+static void wbuf_mod_fini(struct g_logstor_softc *sc);
+static struct _rcache *rcache_find(struct g_logstor_softc *sc, uint32_t ba);
+static void rcache_hit(struct g_logstor_softc *sc, struct _rcache *rc);
+static void rcache_insert(struct g_logstor_softc *sc, uint32_t ba, uint32_t sa, const void *data);
+static void rcache_drop(struct g_logstor_softc *sc, uint32_t ba);
+static void rcache_clear(struct g_logstor_softc *sc);
+static void rcache_readahead(struct g_logstor_softc *sc, uint32_t ba);
+static void rcache_mod_fini(struct g_logstor_softc *sc);
+static void async_mod_fini(struct g_logstor_softc *sc);
+static bool async_ring_put(struct g_logstor_softc *sc, struct logstor_req *req);
+static void async_done(struct g_logstor_softc *sc, unsigned cnt);
+static void *async_thread(void *arg);
+static void warm_save(struct g_logstor_softc *sc);
+static bool warm_load(struct g_logstor_softc *sc);
+static void warm_prefetch(struct g_logstor_softc *sc);
+static void fbuf_prefetch(struct g_logstor_softc *sc, uint32_t ba);
+static struct _fbuf *fbuf_find(struct g_logstor_softc *sc, union fbuf_addr ma);
+static bool is_warm_valid(struct g_logstor_softc *sc, uint32_t sa);
+static bool seg_sum_read(struct g_logstor_softc *sc, uint32_t sega, struct _seg_sum *seg_sum);
+static void seg_csum_load(struct g_logstor_softc *sc, uint32_t sega, struct _seg_sum *seg_sum);
+static void seg_sum_save(struct g_logstor_softc *sc, uint32_t sega, struct _seg_sum *seg_sum);
+static void sec_csum_check(struct g_logstor_softc *sc, const void *buf, uint32_t sa);
 
 static int  superblock_read(struct g_logstor_softc *sc);
 static void superblock_write(struct g_logstor_softc *sc);
 
+static void logstor_roll_forward(struct g_logstor_softc *sc);
+static void md_checkpoint_check(struct g_logstor_softc *sc);
+static uint32_t zone_free_min(int fbuf_count);
+static void zone_clean(struct g_logstor_softc *sc, uint32_t free_min);
+static uint32_t tier_mig_cnt(struct g_logstor_softc *sc);
+static void tier_open(struct g_logstor_softc *sc);
+static void tier_sum_write(struct g_logstor_softc *sc);
+static void tier_migrate(struct g_logstor_softc *sc);
+static uint32_t tier_write(struct g_logstor_softc *sc, uint32_t ba, void *data);
+
 static struct _fbuf *file_access_4byte(struct g_logstor_softc *sc, uint8_t fd, uint32_t foff, uint32_t *eoff);
 static uint32_t file_read_4byte(struct g_logstor_softc *sc, uint8_t fh, uint32_t ba);
-static void file_write_4byte(struct g_logstor_softc *sc, uint8_t fh, uint32_t ba, uint32_t sa);
+static uint32_t file_write_4byte(struct g_logstor_softc *sc, uint8_t fh, uint32_t ba, uint32_t sa);
 
-static void fbuf_mod_init(struct g_logstor_softc *sc);
+static void md_flush(struct g_logstor_softc *sc);
+static void fbuf_mod_init(struct g_logstor_softc *sc, int fbuf_count);
 static void fbuf_mod_fini(struct g_logstor_softc *sc);
 static void fbuf_queue_init(struct g_logstor_softc *sc, int which);
 static void fbuf_queue_insert_head(struct g_logstor_softc *sc, int which, struct _fbuf *fbuf);
@@ -323,6 +1320,8 @@ static struct _fbuf *fbuf_access(struct g_logstor_softc *sc, union fbuf_addr ma)
 static void fbuf_cache_flush(struct g_logstor_softc *sc);
 static void fbuf_cache_flush_and_invalidate_fd(struct g_logstor_softc *sc, int fd1, int fd2);
 static void fbuf_clean_queue_check(struct g_logstor_softc *sc);
+static void fbuf_dirty(struct g_logstor_softc *sc, struct _fbuf *fbuf);
+static void fbuf_writeback(struct g_logstor_softc *sc);
 
 static union fbuf_addr ma2pma(union fbuf_addr ma, unsigned *pindex_out);
 static uint32_t ma2sa(struct g_logstor_softc *sc, union fbuf_addr ma);
@@ -338,10 +1337,11 @@ static struct g_logstor_softc softc;
 
 /*
 Description:
-    Write the initialized supeblock to the downstream disk
+    Write the initialized supeblock to the downstream disk with the
+    default segment size, or the zone size on a zoned disk
 
 Output:
-    ram_disk: the address of the RAM disk
+    ram_dev: the devices of the RAM disk
 
 Return:
     The max number of blocks for this disk
@@ -349,18 +1349,55 @@ Return:
 uint32_t
 logstor_init_disk(void)
 {
-	uint32_t seg_cnt;
+
+	size_t zone_size = env_size_get("LOGSTOR_RAM_ZONE_SIZE");
+
+	if (zone_size != 0)
+		return logstor_init_disk_geom(zone_size);
+	return logstor_init_disk_geom((uint32_t)SECTOR_SIZE << SEG_SHIFT_DEFAULT);
+}
+
+/*
+Description:
+    Write the initialized supeblock to the downstream disk with segments
+    of @seg_size bytes, see "Geometry". With the environment variable
+    LOGSTOR_RAM_FAST_SIZE the first that many bytes of the disk are the
+    fast tier, see "Two tiers"
+
+Output:
+    ram_dev: the devices of the RAM disk
+
+Return:
+    The max number of blocks for this disk
+*/
+uint32_t
+logstor_init_disk_geom(uint32_t seg_size)
+{
+	uint32_t seg_cnt, tier_seg_cnt;
 	uint32_t sector_cnt;
 	off_t media_size;
 	struct _superblock *sb;
-	struct _seg_sum *seg_sum;
 	char buf[SECTOR_SIZE] __attribute__((aligned));
-
-	ram_disk = malloc(RAM_DISK_SIZE);
-	MY_ASSERT(ram_disk != NULL);
+	int seg_shift;
+
+	seg_shift = ffs(seg_size / SECTOR_SIZE) - 1;
+	if (seg_size % SECTOR_SIZE != 0 || !powerof2(seg_size) ||
+	    seg_shift < SEG_SHIFT_MIN || seg_shift > SEG_SHIFT_MAX) {
+		printf("%s: segment size %u must be a power of 2 from %u to %u\n",
+		    __func__, seg_size, SECTOR_SIZE << SEG_SHIFT_MIN,
+		    SECTOR_SIZE << SEG_SHIFT_MAX);
+		MY_PANIC();
+	}
+	geom_set(seg_shift);
+	ram_disk_alloc();
  #if defined(MY_DEBUG)
-	ram4k = (void *)ram_disk;
+	ram4k = (void *)ram_dev[0];
  #endif
+	if (zone_sectors_get() != 0 && zone_sectors_get() != SECTORS_PER_SEG) {
+		printf("%s: segment size %u must be the zone size %u\n",
+		    __func__, seg_size, zone_sectors_get() * SECTOR_SIZE);
+		MY_PANIC();
+	}
 
 	media_size = get_mediasize();
 	sector_cnt = media_size / SECTOR_SIZE;
@@ -378,17 +1415,59 @@ logstor_init_disk(void)
 		    (SECTOR_SIZE - sizeof(struct _superblock)) * (long long)SEG_SIZE);
 		MY_PANIC();
 	}
+	tier_seg_cnt = env_size_get("LOGSTOR_RAM_FAST_SIZE") / SEG_SIZE;
+	geom_layout_set(zone_sectors_get() != 0, seg_cnt, tier_seg_cnt);
 	uint32_t block_cnt =
 	    seg_cnt * BLOCKS_PER_SEG - SB_CNT -
 	    (sector_cnt / (SECTOR_SIZE / 4)) * FD_COUNT * 4;
-	MY_ASSERT(block_cnt < 0x40000000); // 1G
-	sb->seg_cnt = seg_cnt;
-	sb->block_cnt = block_cnt;
+	if (geom.tiered) {
+		// the metadata stays on the fast tier with room to write it back
+		uint32_t md_seg = howmany((sector_cnt / (SECTOR_SIZE / 4)) * FD_COUNT * 4,
+		    BLOCKS_PER_SEG);
+
+		if (geom.zoned || tier_seg_cnt < 2 * md_seg + 8 ||
+		    tier_seg_cnt + 2 > seg_cnt) {
+			printf("%s: the fast tier must be %u to %u segments, not zoned\n",
+			    __func__, 2 * md_seg + 8, seg_cnt - 2);
+			MY_PANIC();
+		}
+	}
+	if (geom.zoned) {
+		uint32_t reserve = geom.seg_first + 2 * zone_free_min(FBUF_MAX);
+
+		if (geom.seg_first > zone_conv_cnt_get() || reserve >= seg_cnt) {
+			printf("%s: %u conventional zones and more than %u zones are needed\n",
+			    __func__, geom.seg_first, reserve);
+			MY_PANIC();
+		}
+		// the free segments for cleaning and the overprovisioning
+		block_cnt = (uint64_t)(seg_cnt - reserve) * BLOCKS_PER_SEG *
+		    (100 - ZONE_OP_PCT) / 100 -
+		    (sector_cnt / (SECTOR_SIZE / 4)) * FD_COUNT * 4;
+	}
+	MY_ASSERT(block_cnt < 0x40000000); // 1G
+	MY_ASSERT(sector_cnt <= SA_MASK);
+	sb->seg_cnt = seg_cnt;
+	sb->block_cnt = block_cnt;
 #if defined(MY_DEBUG)
 	printf("%s: sector_cnt %u block_cnt %u\n",
 	    __func__, sector_cnt, block_cnt);
 #endif
-	sb->seg_allocp = 0;	// start allocate from here
+	sb->seg_allocp = geom.seg_first;	// start allocate from here
+	sb->ss_allocp = seg_log_start(geom.seg_first);	// the first SB_CNT sectors are superblock
+	sb->seg_gen = 0;
+	sb->warm_sa = SECTOR_NULL;
+	sb->sector_size = SECTOR_SIZE;
+	sb->idx_bits = IDX_BITS;
+	sb->sb_cnt = SB_CNT;
+	sb->seg_shift = seg_shift;
+	sb->zoned = geom.zoned;
+	sb->dev_cnt = ram_dev_cnt;
+	sb->zone_free_sega = seg_cnt - 1;	// all but the last segment of the log
+	sb->tier_seg_cnt = tier_seg_cnt;
+	sb->tier_seg_allocp = tier_seg_cnt;	// the first segment of the capacity tier
+	sb->tier_ss_allocp = 0;
+	sb->tier_seg_fresh = tier_seg_cnt;
 
 	sb->fd_cur = 0;			// current file is file 0
 	sb->fd_snap = sb->fd_cur + 1;	// snapshot file always follows current
@@ -401,31 +1480,25 @@ logstor_init_disk(void)
 	}
 
 	// write out the first super block
+	sb->sb_csum = crc32c(0, sb, offsetof(struct _superblock, sb_csum));
 	memset(buf + sizeof(*sb), 0, sizeof(buf) - sizeof(*sb));
-	memcpy(ram_disk, sb, SECTOR_SIZE);
+	memcpy(ram_sec(0), sb, SECTOR_SIZE);
 
 	// clear the rest of the supeblocks
 	bzero(buf, SECTOR_SIZE);
 	for (int i = 1; i < SB_CNT; i++) {
-		memcpy(ram_disk + i * SECTOR_SIZE, buf, SECTOR_SIZE);
-	}
-	// initialize the segment summary block
-	seg_sum = (struct _seg_sum *)buf;
-	for (int i = 0; i < BLOCKS_PER_SEG; ++i)
-		seg_sum->ss_rm[i] = BLOCK_INVALID;
-
-	// write out the segment summary blocks
-	for (int i = 0; i < seg_cnt; ++i) {
-		uint32_t sa = sega2sa(i) + SEG_SUM_OFFSET;
-		my_write(NULL, seg_sum, sa);
+		memcpy(ram_sec(i), buf, SECTOR_SIZE);
 	}
+	// the RAM disk is zero filled by mmap() and the segment summary of a
+	// segment not written yet is read as an empty one, so the segment
+	// summaries are not written and their memory is not committed
 	return block_cnt;
 }
 
 void
 logstor_fini(void)
 {
-	free(ram_disk);
+	ram_disk_free();
 }
 
 struct g_logstor_softc *
@@ -436,25 +1509,59 @@ logstor_open(void)
 	bzero(sc, sizeof(*sc));
 	int error __unused;
 
+	pthread_mutex_init(&sc->sc_mtx, NULL);
+	pthread_cond_init(&sc->flush_cv, NULL);
+	pthread_mutex_init(&sc->async_mtx, NULL);
+	pthread_cond_init(&sc->async_cv, NULL);
+	pthread_cond_init(&sc->async_idle_cv, NULL);
+	sc->prefetch = true;
+
 	error = superblock_read(sc);
 	MY_ASSERT(error == 0);
-	if (sc->superblock.seg_allocp == 0)
-		sc->ss_allocp = SB_CNT;
-
-	fbuf_mod_init(sc);
-
-	// read the segment summary block
-	sc->seg_allocp_sa = sega2sa(sc->superblock.seg_allocp);
-	uint32_t sa = sc->seg_allocp_sa + SEG_SUM_OFFSET;
-	my_read(sc, &sc->seg_sum, sa);
-	sc->ss_modified = false;
+	if (geom.zoned && zone_sectors_get() != SECTORS_PER_SEG) {
+		printf("%s: the volume needs a disk with zones of %zu bytes\n",
+		    __func__, SEG_SIZE);
+		MY_PANIC();
+	}
+	if (sc->superblock.dev_cnt != ram_dev_cnt) {
+		printf("%s: the volume is striped over %u devices, not %d\n",
+		    __func__, sc->superblock.dev_cnt, ram_dev_cnt);
+		MY_PANIC();
+	}
+	sc->zone_free_sega = sc->zone_clean_sega = sc->superblock.zone_free_sega;
+
+	fbuf_mod_init(sc, FBUF_MIN);
+	sc->sec_pinned = calloc(howmany(sc->superblock.seg_cnt * SECTORS_PER_SEG, NBBY), 1);
+	MY_ASSERT(sc->sec_pinned != NULL);
+
+	sc->sec_csum = malloc(sc->superblock.seg_cnt * SECTORS_PER_SEG * sizeof(uint32_t));
+	MY_ASSERT(sc->sec_csum != NULL);
+	sc->seg_csum_loaded = calloc(howmany(sc->superblock.seg_cnt, NBBY), 1);
+	MY_ASSERT(sc->seg_csum_loaded != NULL);
+
+	sc->dedup_idx = calloc(1 << DEDUP_IDX_BITS, sizeof(*sc->dedup_idx));
+	MY_ASSERT(sc->dedup_idx != NULL);
+	sc->dedup_ref_sec = calloc(DEDUP_REF_BUCKET_CNT, sizeof(*sc->dedup_ref_sec));
+	MY_ASSERT(sc->dedup_ref_sec != NULL);
+	sc->dedup_ref_ba = calloc(DEDUP_REF_BUCKET_CNT, sizeof(*sc->dedup_ref_ba));
+	MY_ASSERT(sc->dedup_ref_ba != NULL);
+	TAILQ_INIT(&sc->wbuf_age);	// the write buffer is off
+	TAILQ_INIT(&sc->wbuf_free);
+	rcache_mod_fini(sc);	// and so is the read cache
 
 	sc->data_write_count = sc->other_write_count = 0;
+	sc->pack_sa = SECTOR_NULL;
 	sc->is_sec_valid_fp = is_sec_valid_normal;
 	sc->ba2sa_fp = ba2sa_normal;
+	if (!warm_load(sc))
+		dedup_ref_rebuild(sc);
+	logstor_roll_forward(sc);
+	if (geom.tiered)
+		tier_open(sc);
 #if defined(MY_DEBUG)
 	logstor_check(sc);
 #endif
+	warm_prefetch(sc);
 	return sc;
 }
 
@@ -462,29 +1569,188 @@ void
 logstor_close(struct g_logstor_softc *sc)
 {
 
+	async_mod_fini(sc);
+	wbuf_destage(sc, sc->wbuf_cnt);
+	wbuf_mod_fini(sc);
+	rcache_mod_fini(sc);
 	seg_sum_write(sc);
+	warm_save(sc);
 	fbuf_mod_fini(sc);
 	superblock_write(sc);
+	my_sync(sc);
+	dedup_mod_fini(sc);
+	free(sc->sec_pinned);
+	free(sc->sec_csum);
+	free(sc->seg_csum_loaded);
+	pthread_cond_destroy(&sc->async_idle_cv);
+	pthread_cond_destroy(&sc->async_cv);
+	pthread_mutex_destroy(&sc->async_mtx);
+	pthread_cond_destroy(&sc->flush_cv);
+	pthread_mutex_destroy(&sc->sc_mtx);
+}
+
+#if defined(MY_DEBUG)
+/*
+  Simulate a system crash. Whatever is not on the disk yet is lost.
+*/
+void
+logstor_crash(struct g_logstor_softc *sc)
+{
+
+	// the workers finish the requests submitted before the crash
+	async_mod_fini(sc);
+	free(sc->fbufs);
+	dedup_mod_fini(sc);
+	// the buffered blocks are lost
+	wbuf_mod_fini(sc);
+	rcache_mod_fini(sc);
+	free(sc->sec_pinned);
+	free(sc->sec_csum);
+	free(sc->seg_csum_loaded);
+	pthread_cond_destroy(&sc->async_idle_cv);
+	pthread_cond_destroy(&sc->async_cv);
+	pthread_mutex_destroy(&sc->async_mtx);
+	pthread_cond_destroy(&sc->flush_cv);
+	pthread_mutex_destroy(&sc->sc_mtx);
 }
+#endif
 
 uint32_t
 logstor_read(struct g_logstor_softc *sc, uint32_t ba, void *data)
 {
+	uint64_t start = op_start();
+
+	struct _wbuf *wbuf;
+	struct _rcache *rc;
+	uint32_t sa;
 
+	pthread_mutex_lock(&sc->sc_mtx);
+	md_checkpoint_check(sc);
 	fbuf_clean_queue_check(sc);
-	uint32_t sa = _logstor_read(sc, ba, data);
+	wbuf_age_check(sc);
+	if ((wbuf = wbuf_find(sc, ba)) != NULL) {
+		memcpy(data, wbuf->data, SECTOR_SIZE);
+		sa = LOGSTOR_SA_WBUF;
+		STATS_INC(wbuf_hit);
+	} else if ((rc = rcache_find(sc, ba)) != NULL) {
+		memcpy(data, rc->data, SECTOR_SIZE);
+		sa = rc->sa;
+		rcache_hit(sc, rc);
+		STATS_INC(rcache_hit);
+	} else {
+		sa = _logstor_read(sc, ba, data);
+		if (sc->rc_max != 0) {
+			// an unmapped block is not worth caching, like in readahead
+			if (sa != SECTOR_NULL)
+				rcache_insert(sc, ba, sa, data);
+			STATS_INC(rcache_miss);
+		}
+		if (sc->prefetch)
+			fbuf_prefetch(sc, ba);
+	}
+	if (sc->rc_max != 0)
+		rcache_readahead(sc, ba);
+	pthread_mutex_unlock(&sc->sc_mtx);
+	op_end(LOGSTOR_OP_READ, ba, sa, start);
 	return sa;
 }
 
+// write the data block @data of @ba to the log
+static uint32_t
+block_write(struct g_logstor_softc *sc, uint32_t ba, void *data)
+{
+
+	if (is_zero_block(data))
+		return zero_write(sc, ba);
+	else if (sc->dedup)
+		return dedup_write(sc, ba, data);
+	else
+		return _logstor_write(sc, ba, data);
+}
+
+/*
+Description:
+    Write a block. With LOGSTOR_FUA in @flags the block is durable
+    when this function returns.
+
+Return:
+    the sector address where the block is written, LOGSTOR_SA_WBUF if it
+    is in the write buffer
+*/
 uint32_t
-logstor_write(struct g_logstor_softc *sc, uint32_t ba, void *data)
+logstor_write(struct g_logstor_softc *sc, uint32_t ba, void *data, int flags)
 {
+	uint64_t start = op_start();
 
+	pthread_mutex_lock(&sc->sc_mtx);
+	md_checkpoint_check(sc);
 	fbuf_clean_queue_check(sc);
-	uint32_t sa = _logstor_write(sc, ba, data);
+	wbuf_age_check(sc);
+	rcache_drop(sc, ba);
+	uint32_t sa;
+	if (sc->wbuf_max != 0 && (flags & LOGSTOR_FUA) == 0) {
+		wbuf_write(sc, ba, data);
+		sa = LOGSTOR_SA_WBUF;
+	} else {
+		// the buffered block is older
+		wbuf_drop(sc, ba);
+		sa = block_write(sc, ba, data);
+	}
+	++sc->wr_gen;
+	pthread_mutex_unlock(&sc->sc_mtx);
+	if (flags & LOGSTOR_FUA)
+		logstor_flush(sc);
+	op_end(LOGSTOR_OP_WRITE, ba, sa, start);
 	return sa;
 }
 
+/*
+Description:
+    Make all the writes and deletes done so far durable, the write buffer
+    is destaged first
+
+    With the roll forward only the segment summary has to be written.
+    The metadata are written only if there are deletes or deduplicated
+    writes since the last checkpoint since they are not recorded in the log.
+
+    Concurrent flushes are coalesced. The first one becomes the leader,
+    it writes the segment summary and syncs the disk without holding the
+    lock. The flushes arriving in the meantime wait for it and the next
+    leader serves all of them with one sync.
+*/
+int
+logstor_flush(struct g_logstor_softc *sc)
+{
+	uint64_t start = op_start();
+	uint64_t gen;
+
+	pthread_mutex_lock(&sc->sc_mtx);
+	gen = sc->wr_gen;
+	while (sc->flush_gen < gen) {
+		if (sc->flush_busy) {
+			pthread_cond_wait(&sc->flush_cv, &sc->sc_mtx);
+			continue;
+		}
+		// become the leader and serve all the writes so far
+		sc->flush_busy = true;
+		gen = sc->wr_gen;
+		wbuf_destage(sc, sc->wbuf_cnt);
+		if (sc->unlogged)
+			md_flush(sc);
+		else
+			seg_sum_write(sc);
+		pthread_mutex_unlock(&sc->sc_mtx);
+		my_sync(sc);
+		pthread_mutex_lock(&sc->sc_mtx);
+		sc->flush_gen = gen;
+		sc->flush_busy = false;
+		pthread_cond_broadcast(&sc->flush_cv);
+	}
+	pthread_mutex_unlock(&sc->sc_mtx);
+	op_end(LOGSTOR_OP_FLUSH, 0, 0, start);
+	return (0);
+}
+
 // To enable TRIM, the following statement must be added
 // in "case BIO_GETATTR" of g_gate_start() of g_gate.c
 //	if (g_handleattr_int(pbp, "GEOM::candelete", 1))
@@ -493,6 +1759,7 @@ logstor_write(struct g_logstor_softc *sc, uint32_t ba, void *data)
 //	tunefs -t enabled /dev/ggate0
 int logstor_delete(struct g_logstor_softc *sc, off_t offset, void *data __unused, off_t length)
 {
+	uint64_t start = op_start();
 	uint32_t ba;	// block address
 	int size;	// number of remaining sectors to process
 	int i;
@@ -503,10 +1770,18 @@ int logstor_delete(struct g_logstor_softc *sc, off_t offset, void *data __unused
 	size = length / SECTOR_SIZE;
 	MY_ASSERT(ba < sc->superblock.block_cnt);
 
+	pthread_mutex_lock(&sc->sc_mtx);
+	md_checkpoint_check(sc);
 	for (i = 0; i < size; ++i) {
 		fbuf_clean_queue_check(sc);
+		wbuf_drop(sc, ba + i);
+		rcache_drop(sc, ba + i);
 		file_write_4byte(sc, sc->superblock.fd_cur, ba + i, SECTOR_DEL);
 	}
+	sc->unlogged = true;
+	++sc->wr_gen;
+	pthread_mutex_unlock(&sc->sc_mtx);
+	op_end(LOGSTOR_OP_DELETE, ba, size, start);
 
 	return (0);
 }
@@ -514,8 +1789,15 @@ int logstor_delete(struct g_logstor_softc *sc, off_t offset, void *data __unused
 void
 logstor_snapshot(struct g_logstor_softc *sc)
 {
-
-	// lock metadata
+	uint64_t start = op_start();
+
+	pthread_mutex_lock(&sc->sc_mtx);
+	wbuf_destage(sc, sc->wbuf_cnt);
+	// the segments are not cleaned during the snapshot, leave room for a
+	// new snapshot file besides the checkpoint
+	if (geom.zoned)
+		zone_clean(sc, zone_free_min(sc->fbuf_count) +
+		    howmany(2 * howmany(sc->superblock.block_cnt, SECTOR_SIZE / 4), BLOCKS_PER_SEG));
 	// move fd_cur to fd_prev
 	sc->superblock.fd_prev = sc->superblock.fd_cur;
 	// create new files fd_cur and fd_snap_new
@@ -527,7 +1809,6 @@ logstor_snapshot(struct g_logstor_softc *sc)
 
 	sc->is_sec_valid_fp = is_sec_valid_during_commit;
 	sc->ba2sa_fp = ba2sa_during_snapshot;
-	// unlock metadata
 
 	uint32_t block_max = sc->superblock.block_cnt;
 	for (int ba = 0; ba < block_max; ++ba) {
@@ -544,7 +1825,6 @@ logstor_snapshot(struct g_logstor_softc *sc)
 			file_write_4byte(sc, sc->superblock.fd_snap_new, ba, sa);
 	}
 
-	// lock metadata
 	int fd_prev = sc->superblock.fd_prev;
 	int fd_snap = sc->superblock.fd_snap;
 	fbuf_cache_flush_and_invalidate_fd(sc, fd_prev, fd_snap);
@@ -563,16 +1843,23 @@ logstor_snapshot(struct g_logstor_softc *sc)
 
 	sc->is_sec_valid_fp = is_sec_valid_normal;
 	sc->ba2sa_fp = ba2sa_normal;
-	//unlock metadata
+	pthread_mutex_unlock(&sc->sc_mtx);
+	op_end(LOGSTOR_OP_SNAPSHOT, 0, 0, start);
 }
 
 void
 logstor_rollback(struct g_logstor_softc *sc)
 {
 
+	pthread_mutex_lock(&sc->sc_mtx);
+	// the buffered blocks are written after the snapshot
+	while (sc->wbuf_cnt != 0)
+		wbuf_drop(sc, TAILQ_FIRST(&sc->wbuf_age)->ba);
+	rcache_clear(sc);
 	fbuf_cache_flush_and_invalidate_fd(sc, sc->superblock.fd_cur, FD_INVALID);
 	sc->superblock.fh[sc->superblock.fd_cur].root = SECTOR_NULL;
 	superblock_write(sc);
+	pthread_mutex_unlock(&sc->sc_mtx);
 }
 #else
 void
@@ -595,12 +1882,26 @@ _logstor_read(struct g_logstor_softc *sc, unsigned ba, void *data)
 	ba2sa_normal();
 	ba2sa_during_snapshot();
 #endif
+	sa_read(sc, sa, data);
+	return sa;
+}
+
+/*
+Description:
+    Read the block stored at sector address or fragment address @sa
+*/
+static void
+sa_read(struct g_logstor_softc *sc, uint32_t sa, void *data)
+{
+
 	if (sa == SECTOR_NULL)
 		bzero(data, SECTOR_SIZE);
+	else if (SA_IS_FRAG(sa))
+		pack_read(sc, sa, data);
 	else {
-		my_read(sc, data, sa);
+		my_read(sc, data, sa, LOGSTOR_IO_DATA);
+		sec_csum_check(sc, data, sa);
 	}
-	return sa;
 }
 
 // The common part of is_sec_valid
@@ -647,33 +1948,44 @@ is_sec_valid_during_commit(struct g_logstor_softc *sc, uint32_t sa, uint32_t ba_
 }
 
 // Is a sector with a reverse ba valid?
+// A sector shared by deduplicated blocks is also valid if any of them is valid
 static bool
 is_sec_valid(struct g_logstor_softc *sc, uint32_t sa, uint32_t ba_rev)
 {
+	bool valid;
 #if defined(MY_DEBUG)
 	union fbuf_addr ma_rev __unused;
 	ma_rev.uint32 = ba_rev;
 #endif
 	if (ba_rev < BLOCK_MAX) {
-		return sc->is_sec_valid_fp(sc, sa, ba_rev);
+		valid = sc->is_sec_valid_fp(sc, sa, ba_rev);
 #if defined(WYC)
 		is_sec_valid_normal();
 		is_sec_valid_during_commit();
 #endif
 	} else if (IS_FBUF_ADDR(ba_rev)) {
 		uint32_t sa_rev = ma2sa(sc, (union fbuf_addr)ba_rev);
-		return (sa == sa_rev);
+		valid = (sa == sa_rev);
+	} else if (ba_rev == BLOCK_PACKED) {
+		valid = is_pack_valid(sc, sa);
+	} else if (ba_rev == BLOCK_WARM) {
+		valid = is_warm_valid(sc, sa);
+	} else if (IS_BLOCK_SNAP(ba_rev)) {
+		valid = sc->is_sec_valid_fp(sc, sa, ba_rev - BLOCK_SNAP);
 	} else if (ba_rev == BLOCK_INVALID) {
-		return false;
+		valid = false;
 	} else {
 		MY_PANIC();
-		return false;
+		valid = false;
 	}
+	return valid || dedup_ref_valid(sc, sa);
 }
 
 /*
 Description:
   write data/metadata block to disk
+  With @ba BLOCK_PACKED and @data NULL a sector is reserved for the packed
+  sector, it is written by pack_flush()
 
 Return:
   the sector address where the data is written
@@ -692,12 +2004,24 @@ _logstor_write(struct g_logstor_softc *sc, uint32_t ba, void *data)
 	ma.uint32 = ba;
 #endif
 
-	MY_ASSERT(ba < sc->superblock.block_cnt || is_fbuf_addr);
+	MY_ASSERT(ba < sc->superblock.block_cnt || is_fbuf_addr || ba == BLOCK_PACKED ||
+	    ba == BLOCK_WARM || (IS_BLOCK_SNAP(ba) && sc->zone_reloc));
+	if (sc->compress && ba < BLOCK_MAX && !sc->zone_reloc) {
+		// the compression stage
+		uint32_t sa = pack_write(sc, ba, data);
+		if (sa != SECTOR_NULL)
+			return sa;
+	}
 	if (is_called) {
 		printf("%s: recursive call is not allowed\n", __func__);
 		exit(1);
 	}
 	is_called = true;
+	// roll forward replays the sectors in address order, so a data sector
+	// can't follow the packed sector reserved while fragments are still
+	// added to it. And the write pointer of a zone can't pass it.
+	if (data != NULL && (ba < BLOCK_MAX || geom.zoned))
+		pack_flush(sc);
 
 	// record the starting segment
 	// if the search for free sector rolls over to the starting segment
@@ -713,17 +2037,44 @@ again:
 #endif
 		if (is_sec_valid(sc, sa, ba_rev))
 			continue;
+		// the sector is still used by the checkpoint
+		if (is_sec_pinned(sc, sa)) {
+			// the block has been moved after the checkpoint
+			// remove it from the reverse map so roll forward won't replay it
+			if ((ba_rev < BLOCK_MAX && sc->ba2sa_fp(sc, ba_rev) != SECTOR_NULL) ||
+			    ba_rev == BLOCK_PACKED) {
+				seg_sum->ss_rm[i] = BLOCK_INVALID;
+				sc->ss_modified = true;
+			}
+			continue;
+		}
 
-		my_write(sc, data, sa);
-
+		// a cleaned zone has no valid sector
+		MY_ASSERT(!geom.zoned || i == sc->ss_allocp);
 		seg_sum->ss_rm[i] = ba;		// record reverse mapping
 		sc->ss_modified = true;
-
 		sc->ss_allocp = i + 1;	// advnace the alloc pointer
+		if (data == NULL) {
+			// the packed sector must be written before its segment summary
+			// so the segment is not changed here
+			++sc->data_write_count;
+			is_called = false;
+			return sa;
+		}
+		if (geom.zoned && sc->superblock.seg_allocp >= zone_conv_cnt_get()) {
+			uint32_t sa_zone __unused = zone_append(sc, data,
+			    sc->superblock.seg_allocp,
+			    is_fbuf_addr ? LOGSTOR_IO_FBUF : LOGSTOR_IO_DATA);
+			MY_ASSERT(sa_zone == sa);
+		} else
+			my_write(sc, data, sa, is_fbuf_addr ? LOGSTOR_IO_FBUF : LOGSTOR_IO_DATA);
+		seg_sum->ss_csum[i] = sc->sec_csum[sa] = crc32c(0, data, SECTOR_SIZE);
+
 		if (sc->ss_allocp == SEG_SUM_OFFSET) {
 			seg_alloc(sc);
 		}
-		if (is_fbuf_addr) {
+		if (is_fbuf_addr || ba == BLOCK_WARM || sc->zone_reloc) {
+			// the sector moved by cleaning is mapped by sec_remap()
 			++sc->other_write_count;
 		} else {
 			++sc->data_write_count;
@@ -796,6 +2147,22 @@ logstor_get_block_cnt(struct g_logstor_softc *sc)
 	return sc->superblock.block_cnt;
 }
 
+// is the volume on a zoned disk, see "Zoned mode"
+int
+logstor_is_zoned(struct g_logstor_softc *sc)
+{
+
+	return sc->superblock.zoned;
+}
+
+// does the volume span two tiers, see "Two tiers"
+int
+logstor_is_tiered(struct g_logstor_softc *sc)
+{
+
+	return sc->superblock.tier_seg_cnt != 0;
+}
+
 unsigned
 logstor_get_data_write_count(struct g_logstor_softc *sc)
 {
@@ -821,143 +2188,2476 @@ unsigned
 logstor_get_fbuf_miss(struct g_logstor_softc *sc)
 {
 
-	return sc->fbuf_miss;
+	return sc->fbuf_miss;
+}
+
+unsigned
+logstor_get_comp_block_count(struct g_logstor_softc *sc)
+{
+
+	return sc->comp_block_count;
+}
+
+unsigned
+logstor_get_dedup_block_count(struct g_logstor_softc *sc)
+{
+
+	return sc->dedup_block_count;
+}
+
+unsigned
+logstor_get_zero_block_count(struct g_logstor_softc *sc)
+{
+
+	return sc->zero_block_count;
+}
+
+/*
+Description:
+    Get the statistics of all the threads
+    The caller must set %version and %size of @stats. The counters are
+    read without stopping the other threads so an operation in progress
+    may be partly counted.
+
+Return:
+    0 or EINVAL if the version or the size is not supported
+*/
+int
+logstor_get_stats(struct g_logstor_softc *sc __unused, struct logstor_stats *stats)
+{
+	struct _thread_stats *ts;
+	uint64_t *sum, *cnt;
+	int i, j;
+
+	if (stats->version != LOGSTOR_STATS_VERSION || stats->size != sizeof(*stats))
+		return EINVAL;
+	bzero((char *)stats + offsetof(struct logstor_stats, fbuf_hit),
+	    sizeof(*stats) - offsetof(struct logstor_stats, fbuf_hit));
+	pthread_mutex_lock(&stats_mtx);
+	LIST_FOREACH(ts, &stats_list, link) {
+		// the counters before %lat are all uint64_t
+		sum = &stats->fbuf_hit;
+		cnt = &ts->st.fbuf_hit;
+		for (i = 0; &sum[i] < (uint64_t *)stats->lat; ++i)
+			sum[i] += cnt[i];
+		for (i = 0; i < LOGSTOR_OP_CNT; ++i) {
+			struct logstor_hist *h = &stats->lat[i];
+			const struct logstor_hist *th = &ts->st.lat[i];
+
+			h->count += th->count;
+			h->sum_ns += th->sum_ns;
+			if (th->max_ns > h->max_ns)
+				h->max_ns = th->max_ns;
+			for (j = 0; j < LOGSTOR_HIST_CNT; ++j)
+				h->bucket[j] += th->bucket[j];
+		}
+	}
+	pthread_mutex_unlock(&stats_mtx);
+	return 0;
+}
+
+/*
+Description:
+    Turn the event trace on or off. It is on by default.
+*/
+void
+logstor_trace_set(int on)
+{
+
+	__atomic_store_n(&trace_on, on, __ATOMIC_RELAXED);
+}
+
+/*
+Description:
+    Write the events in the trace rings of all the threads to file @path
+    The file has a struct logstor_trace_hdr followed by the events. The
+    events of each thread are in time order. logstrace decodes it.
+
+Return:
+    0 or the errno
+*/
+int
+logstor_trace_dump(const char *path)
+{
+	struct logstor_trace_hdr hdr;
+	struct logstor_trace_ev *evs;
+	struct _thread_stats *ts;
+	uint64_t cnt = 0;
+	FILE *fp;
+	int error = 0;
+
+	pthread_mutex_lock(&stats_mtx);
+	evs = malloc((size_t)thread_cnt * TRACE_RING_SIZE * sizeof(*evs));
+	if (evs == NULL) {
+		pthread_mutex_unlock(&stats_mtx);
+		return ENOMEM;
+	}
+	LIST_FOREACH(ts, &stats_list, link) {
+		uint64_t head, tail, head2, n;
+
+		head = __atomic_load_n(&ts->trace_head, __ATOMIC_ACQUIRE);
+		tail = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		for (uint64_t i = tail; i < head; ++i)
+			evs[cnt + i - tail] = ts->trace[i & (TRACE_RING_SIZE - 1)];
+		// the events the owner has overwritten while copying are dropped
+		// the one being written now is at head2 and overwrites head2 - TRACE_RING_SIZE
+		head2 = __atomic_load_n(&ts->trace_head, __ATOMIC_ACQUIRE);
+		n = head - tail;
+		if (head2 + 1 > tail + TRACE_RING_SIZE) {
+			uint64_t drop = MIN(head2 + 1 - TRACE_RING_SIZE - tail, n);
+
+			memmove(&evs[cnt], &evs[cnt + drop], (n - drop) * sizeof(*evs));
+			n -= drop;
+		}
+		cnt += n;
+	}
+	pthread_mutex_unlock(&stats_mtx);
+
+	hdr.magic = LOGSTOR_TRACE_MAGIC;
+	hdr.version = LOGSTOR_TRACE_VERSION;
+	hdr.ev_size = sizeof(*evs);
+	hdr.ev_cnt = cnt;
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		error = errno;
+		goto exit;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(evs, sizeof(*evs), cnt, fp) != cnt)
+		error = errno ? errno : EIO;
+	if (fclose(fp) != 0 && error == 0)
+		error = errno;
+exit:
+	free(evs);
+	return error;
+}
+
+static inline int
+hist_idx(uint64_t v)
+{
+	int msb;
+
+	if (v < (1 << LOGSTOR_HIST_SUB_BITS))
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	return ((msb - LOGSTOR_HIST_SUB_BITS + 1) << LOGSTOR_HIST_SUB_BITS) +
+	    ((v >> (msb - LOGSTOR_HIST_SUB_BITS)) & ((1 << LOGSTOR_HIST_SUB_BITS) - 1));
+}
+
+// the lowest value of bucket @idx
+static uint64_t
+hist_value(int idx)
+{
+	int msb;
+
+	if (idx < (1 << LOGSTOR_HIST_SUB_BITS))
+		return idx;
+	msb = (idx >> LOGSTOR_HIST_SUB_BITS) + LOGSTOR_HIST_SUB_BITS - 1;
+	return (uint64_t)((1 << LOGSTOR_HIST_SUB_BITS) +
+	    (idx & ((1 << LOGSTOR_HIST_SUB_BITS) - 1))) << (msb - LOGSTOR_HIST_SUB_BITS);
+}
+
+void
+logstor_hist_add(struct logstor_hist *hist, uint64_t ns)
+{
+
+	++hist->count;
+	hist->sum_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+	++hist->bucket[hist_idx(ns)];
+}
+
+/*
+Description:
+    Get the latency at percentile @pct of @hist
+    The value is the lower bound of its bucket, within 1/16 of the real one.
+*/
+uint64_t
+logstor_hist_percentile(const struct logstor_hist *hist, double pct)
+{
+	uint64_t rank = hist->count * pct / 100;
+	uint64_t sum = 0;
+
+	if (hist->count == 0)
+		return 0;
+	for (int i = 0; i < LOGSTOR_HIST_CNT; ++i) {
+		sum += hist->bucket[i];
+		if (sum > rank)
+			return hist_value(i);
+	}
+	return hist->max_ns;
+}
+
+/*
+Description:
+    Enable or disable the deduplication of the data blocks written after this
+*/
+void
+logstor_set_dedup(struct g_logstor_softc *sc, int on)
+{
+
+	pthread_mutex_lock(&sc->sc_mtx);
+	wbuf_destage(sc, sc->wbuf_cnt);
+	// zoned mode and two tiers can't move a sector shared by the
+	// deduplicated blocks
+	sc->dedup = on && !geom.zoned && !geom.tiered;
+	pthread_mutex_unlock(&sc->sc_mtx);
+}
+
+/*
+Description:
+    Enable or disable the prefetch of the forward map for the reads after this
+*/
+void
+logstor_set_prefetch(struct g_logstor_softc *sc, int on)
+{
+
+	pthread_mutex_lock(&sc->sc_mtx);
+	sc->prefetch = on;
+	bzero(sc->pf_stream, sizeof(sc->pf_stream));
+	pthread_mutex_unlock(&sc->sc_mtx);
+}
+
+/*
+Description:
+    Enable or disable the compression of the data blocks written after this
+*/
+void
+logstor_set_compress(struct g_logstor_softc *sc, int on)
+{
+
+	pthread_mutex_lock(&sc->sc_mtx);
+	wbuf_destage(sc, sc->wbuf_cnt);
+	sc->compress = on;
+	pthread_mutex_unlock(&sc->sc_mtx);
+}
+
+/*
+Description:
+    Compress the data block @data and add it to the packed sector
+
+Return:
+    the sector address of the fragment or SECTOR_NULL if the block
+    doesn't compress well enough
+*/
+static uint32_t
+pack_write(struct g_logstor_softc *sc, uint32_t ba, void *data)
+{
+	struct _pack_hdr *hdr = &sc->pack.hdr;
+	uint8_t cbuf[PACK_LEN_MAX];
+	uint32_t sa;
+	int len, i;
+
+	len = lz_compress(data, SECTOR_SIZE, cbuf, sizeof(cbuf));
+	if (len == 0)
+		return SECTOR_NULL;
+
+	if (sc->pack_sa != SECTOR_NULL &&
+	    (hdr->ph_cnt == PACK_FRAG_MAX || sc->pack_off + len > SECTOR_SIZE))
+		pack_flush(sc);
+	if (sc->pack_sa == SECTOR_NULL) {
+		sc->pack_sa = _logstor_write(sc, BLOCK_PACKED, NULL);
+		bzero(&sc->pack, sizeof(sc->pack));
+		sc->pack_off = sizeof(struct _pack_hdr);
+	}
+	i = hdr->ph_cnt++;
+	hdr->ph_frag[i].ba = ba;
+	hdr->ph_frag[i].off = sc->pack_off;
+	hdr->ph_frag[i].len = len;
+	memcpy(sc->pack.data + sc->pack_off, cbuf, len);
+	sc->pack_off += len;
+	++sc->comp_block_count;
+	STATS_INC(comp_block);
+
+	sa = SA_FRAG(sc->pack_sa, i);
+	file_write_4byte(sc, sc->superblock.fd_cur, ba, sa);
+	return sa;
+}
+
+/*
+Description:
+    Write out the packed sector. It is in the current segment and must
+    be written before the segment summary.
+*/
+static void
+pack_flush(struct g_logstor_softc *sc)
+{
+	uint32_t sa = sc->pack_sa;
+
+	if (sa == SECTOR_NULL)
+		return;
+	MY_ASSERT((sa >> SEC_PER_SEG_SHIFT) == sc->superblock.seg_allocp);
+	my_write(sc, &sc->pack, sa, LOGSTOR_IO_DATA);
+	sc->seg_sum.ss_csum[sa & (SECTORS_PER_SEG - 1)] = sc->sec_csum[sa] =
+	    crc32c(0, &sc->pack, SECTOR_SIZE);
+	sc->ss_modified = true;
+	sc->pack_sa = SECTOR_NULL;
+}
+
+/*
+Description:
+    Read and decompress the fragment @sa of a packed sector
+*/
+static void
+pack_read(struct g_logstor_softc *sc, uint32_t sa, void *data)
+{
+	union _pack_sec buf, *pack;
+	uint32_t pack_sa = sa & SA_MASK;
+	unsigned i = SA_FRAG_IDX(sa);
+	int len __unused;
+
+	if (pack_sa == sc->pack_sa)
+		pack = &sc->pack;
+	else {
+		my_read(sc, &buf, pack_sa, LOGSTOR_IO_DATA);
+		sec_csum_check(sc, &buf, pack_sa);
+		pack = &buf;
+	}
+	MY_ASSERT(i < pack->hdr.ph_cnt);
+	len = lz_decompress(pack->data + pack->hdr.ph_frag[i].off,
+	    pack->hdr.ph_frag[i].len, data, SECTOR_SIZE);
+	MY_ASSERT(len == SECTOR_SIZE);
+}
+
+/*
+Description:
+    A packed sector is valid if any of its fragments is valid
+*/
+static bool
+is_pack_valid(struct g_logstor_softc *sc, uint32_t sa)
+{
+	union _pack_sec buf, *pack;
+
+	if (sa == sc->pack_sa)
+		pack = &sc->pack;
+	else {
+		my_read(sc, &buf, sa, LOGSTOR_IO_DATA);
+		sec_csum_check(sc, &buf, sa);
+		pack = &buf;
+	}
+	for (int i = 0; i < pack->hdr.ph_cnt; ++i) {
+		uint32_t ba = pack->hdr.ph_frag[i].ba;
+
+		// the fragments dropped when the sector was moved are BLOCK_INVALID
+		if (ba == BLOCK_INVALID)
+			continue;
+		if (IS_BLOCK_SNAP(ba))
+			ba -= BLOCK_SNAP;
+		if (sc->is_sec_valid_fp(sc, SA_FRAG(sa, i), ba))
+			return true;
+	}
+	return false;
+}
+
+/*
+Description:
+    Is the block @data all zero?
+*/
+static bool
+is_zero_block(const void *data)
+{
+#if defined(__SSE2__)
+	const __m128i *p = data;
+	const __m128i *end = p + SECTOR_SIZE / sizeof(*p);
+
+	for (; p < end; p += 4) {
+		__m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+		    _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+			return false;
+	}
+	return true;
+#else
+	const uint64_t *p = data;
+
+	for (int i = 0; i < SECTOR_SIZE / sizeof(*p); i += 4)
+		if ((p[i] | p[i + 1] | p[i + 2] | p[i + 3]) != 0)
+			return false;
+	return true;
+#endif
+}
+
+/*
+Description:
+    Write an all zero block
+    A block that is not mapped already reads as zero, so the block is
+    deleted from the current file instead of being written. Like the
+    other deletes the change is not recorded in the log, so the next flush
+    writes the metadata. Rewriting a block that already reads as zero
+    doesn't change the mapping and doesn't cost a checkpoint.
+
+Return:
+    SECTOR_NULL
+*/
+static uint32_t
+zero_write(struct g_logstor_softc *sc, uint32_t ba)
+{
+
+	MY_ASSERT(ba < sc->superblock.block_cnt);
+	if (sc->ba2sa_fp(sc, ba) != SECTOR_NULL) {
+		file_write_4byte(sc, sc->superblock.fd_cur, ba, SECTOR_DEL);
+		sc->unlogged = true;
+	}
+	++sc->zero_block_count;
+	STATS_INC(zero_block);
+	return SECTOR_NULL;
+}
+
+/*
+Description:
+    Is the block stored at @sa the same as @data?
+    @sa comes from the fingerprint index and may be out of date, so the
+    sector might store anything now.
+*/
+static bool
+dedup_is_same(struct g_logstor_softc *sc, uint32_t sa, const void *data)
+{
+	union _pack_sec pack;
+	uint8_t buf[SECTOR_SIZE];
+	uint32_t pack_sa = sa & SA_MASK;
+	unsigned i;
+
+	if (!SA_IS_FRAG(sa)) {
+		// the reserved packed sector is not written yet
+		if (sa == sc->pack_sa)
+			return false;
+		my_read(sc, buf, sa, LOGSTOR_IO_DATA);
+		return memcmp(buf, data, SECTOR_SIZE) == 0;
+	}
+	if (pack_sa == sc->pack_sa)
+		pack = sc->pack;
+	else
+		my_read(sc, &pack, pack_sa, LOGSTOR_IO_DATA);
+	i = SA_FRAG_IDX(sa);
+	if (i >= pack.hdr.ph_cnt || pack.hdr.ph_cnt > PACK_FRAG_MAX ||
+	    pack.hdr.ph_frag[i].off + pack.hdr.ph_frag[i].len > SECTOR_SIZE)
+		return false;
+	if (lz_decompress(pack.data + pack.hdr.ph_frag[i].off,
+	    pack.hdr.ph_frag[i].len, buf, SECTOR_SIZE) != SECTOR_SIZE)
+		return false;
+	return memcmp(buf, data, SECTOR_SIZE) == 0;
+}
+
+static struct _dedup_ref *
+dedup_ref_find(struct g_logstor_softc *sc, uint32_t sa, uint32_t ba)
+{
+	struct _dedup_ref *ref;
+
+	LIST_FOREACH(ref, &sc->dedup_ref_ba[ba % DEDUP_REF_BUCKET_CNT], ba_link)
+		if (ref->sa == sa && ref->ba == ba)
+			return ref;
+	return NULL;
+}
+
+static void
+dedup_ref_add(struct g_logstor_softc *sc, uint32_t sa, uint32_t ba)
+{
+	struct _dedup_ref *ref;
+
+	if (dedup_ref_find(sc, sa, ba) != NULL)
+		return;
+	ref = malloc(sizeof(*ref));
+	MY_ASSERT(ref != NULL);
+	ref->sa = sa;
+	ref->ba = ba;
+	LIST_INSERT_HEAD(&sc->dedup_ref_sec[(sa & SA_MASK) % DEDUP_REF_BUCKET_CNT], ref, sec_link);
+	LIST_INSERT_HEAD(&sc->dedup_ref_ba[ba % DEDUP_REF_BUCKET_CNT], ref, ba_link);
+}
+
+/*
+Description:
+    Is any reference to the sector @sa valid?
+    The references found to be invalid are removed. A reference can't
+    become valid again since only a new deduplicated write adds it back.
+*/
+static bool
+dedup_ref_valid(struct g_logstor_softc *sc, uint32_t sa)
+{
+	struct _dedup_ref *ref, *next;
+
+	sa &= SA_MASK;
+	for (ref = LIST_FIRST(&sc->dedup_ref_sec[sa % DEDUP_REF_BUCKET_CNT]); ref != NULL; ref = next) {
+		next = LIST_NEXT(ref, sec_link);
+		if ((ref->sa & SA_MASK) != sa)
+			continue;
+		if (sc->is_sec_valid_fp(sc, ref->sa, ref->ba))
+			return true;
+		LIST_REMOVE(ref, sec_link);
+		LIST_REMOVE(ref, ba_link);
+		free(ref);
+	}
+	return false;
+}
+
+/*
+Description:
+    The deduplication stage of the write path
+    If the block is in the fingerprint index only the forward map is
+    updated, otherwise the block is written and added to the index.
+
+Return:
+    the sector address or fragment address of the block
+*/
+static uint32_t
+dedup_write(struct g_logstor_softc *sc, uint32_t ba, void *data)
+{
+	struct _dedup_ent *set;
+	uint32_t fp, sa;
+	int i;
+
+	MY_ASSERT(ba < sc->superblock.block_cnt);
+	fp = crc32c(0, data, SECTOR_SIZE);
+	set = sc->dedup_idx[fp & ((1 << DEDUP_IDX_BITS) - 1)];
+	for (i = 0; i < DEDUP_IDX_WAYS; ++i) {
+		if (set[i].sa != SECTOR_NULL && set[i].fp == fp &&
+		    dedup_is_same(sc, set[i].sa, data))
+			break;
+	}
+	if (i < DEDUP_IDX_WAYS) {
+		sa = set[i].sa;
+		// a block rewritten with the contents it has keeps its mapping
+		if (file_write_4byte(sc, sc->superblock.fd_cur, ba, sa) != sa) {
+			dedup_ref_add(sc, sa, ba);
+			sc->unlogged = true;
+		}
+		++sc->dedup_block_count;
+		STATS_INC(dedup_block);
+	} else {
+		sa = _logstor_write(sc, ba, data);
+		i = DEDUP_IDX_WAYS - 1;	// replace the least recently used
+	}
+	// move to the most recently used position
+	memmove(&set[1], &set[0], i * sizeof(set[0]));
+	set[0].fp = fp;
+	set[0].sa = sa;
+	return sa;
+}
+
+/*
+Description:
+    Rebuild the references of the deduplicated blocks
+    A mapping in the forward map that is not the reverse map of its
+    sector is a reference.
+*/
+static void
+dedup_ref_rebuild(struct g_logstor_softc *sc)
+{
+	uint32_t *rm;		// reverse map of all the sectors
+	union _pack_sec pack;
+	uint32_t pack_sa = SECTOR_NULL;
+	uint8_t fd[] = {
+	    sc->superblock.fd_cur,
+	    sc->superblock.fd_snap,
+	};
+
+	rm = malloc(sc->superblock.seg_cnt * SECTORS_PER_SEG * sizeof(*rm));
+	MY_ASSERT(rm != NULL);
+	for (uint32_t sega = 0; sega < sc->superblock.seg_cnt; ++sega) {
+		if (!seg_sum_read(sc, sega, &sc->ss_buf)) {
+			printf("%s: segment summary %u checksum error\n", __func__, sega);
+			MY_PANIC();
+		}
+		memcpy(&rm[sega2sa(sega)], sc->ss_buf.ss_rm, BLOCKS_PER_SEG * sizeof(uint32_t));
+		// the checksums are loaded too since the summary is here
+		seg_csum_load(sc, sega, &sc->ss_buf);
+	}
+
+	for (int i = 0; i < NUM_OF_ELEMS(fd); ++i) {
+		if (sc->superblock.fh[fd[i]].root == SECTOR_DEL)
+			continue;
+		for (uint32_t ba = 0; ba < sc->superblock.block_cnt; ++ba) {
+			uint32_t sa = file_read_4byte(sc, fd[i], ba);
+			uint32_t ba_rev;
+
+			if (sa == SECTOR_NULL || sa == SECTOR_DEL)
+				continue;
+			ba_rev = rm[sa & SA_MASK];
+			if (SA_IS_FRAG(sa)) {
+				if (ba_rev == BLOCK_PACKED) {
+					if (pack_sa != (sa & SA_MASK)) {
+						pack_sa = sa & SA_MASK;
+						my_read(sc, &pack, pack_sa, LOGSTOR_IO_DATA);
+					}
+					ba_rev = SA_FRAG_IDX(sa) < pack.hdr.ph_cnt ?
+					    pack.hdr.ph_frag[SA_FRAG_IDX(sa)].ba : BLOCK_INVALID;
+				} else
+					ba_rev = BLOCK_INVALID;
+			}
+			if (ba_rev != ba)
+				dedup_ref_add(sc, sa, ba);
+		}
+	}
+	free(rm);
+}
+
+static void
+dedup_mod_fini(struct g_logstor_softc *sc)
+{
+
+	for (int i = 0; i < DEDUP_REF_BUCKET_CNT; ++i) {
+		struct _dedup_ref *ref;
+
+		while ((ref = LIST_FIRST(&sc->dedup_ref_sec[i])) != NULL) {
+			LIST_REMOVE(ref, sec_link);
+			free(ref);
+		}
+	}
+	free(sc->dedup_ref_ba);
+	free(sc->dedup_ref_sec);
+	free(sc->dedup_idx);
+}
+
+/*
+Description:
+    Set the size of the write buffer to @block_cnt blocks, 0 turns it off
+    The blocks buffered are destaged first.
+*/
+void
+logstor_set_wbuf(struct g_logstor_softc *sc, unsigned block_cnt)
+{
+	uint32_t bucket_cnt;
+
+	pthread_mutex_lock(&sc->sc_mtx);
+	wbuf_destage(sc, sc->wbuf_cnt);
+	wbuf_mod_fini(sc);
+	if (block_cnt != 0) {
+		// a load factor of at most 1
+		for (bucket_cnt = 1; bucket_cnt < block_cnt; bucket_cnt <<= 1)
+			;
+		sc->wbufs = calloc(block_cnt, sizeof(*sc->wbufs));
+		MY_ASSERT(sc->wbufs != NULL);
+		sc->wbuf_sort = malloc(block_cnt * sizeof(*sc->wbuf_sort));
+		MY_ASSERT(sc->wbuf_sort != NULL);
+		sc->wbuf_hash = calloc(bucket_cnt, sizeof(*sc->wbuf_hash));
+		MY_ASSERT(sc->wbuf_hash != NULL);
+		sc->wbuf_hash_mask = bucket_cnt - 1;
+		for (unsigned i = 0; i < block_cnt; ++i)
+			TAILQ_INSERT_TAIL(&sc->wbuf_free, &sc->wbufs[i], age_link);
+		sc->wbuf_max = block_cnt;
+	}
+	pthread_mutex_unlock(&sc->sc_mtx);
+}
+
+static inline struct _wbuf_list *
+wbuf_bucket(struct g_logstor_softc *sc, uint32_t ba)
+{
+	return &sc->wbuf_hash[(ba * 0x9E3779B1u >> 7) & sc->wbuf_hash_mask];
+}
+
+// the buffered block @ba, NULL if it is not buffered
+static struct _wbuf *
+wbuf_find(struct g_logstor_softc *sc, uint32_t ba)
+{
+	struct _wbuf *wbuf;
+
+	if (sc->wbuf_cnt == 0)
+		return NULL;
+	LIST_FOREACH(wbuf, wbuf_bucket(sc, ba), hash_link)
+		if (wbuf->ba == ba)
+			return wbuf;
+	return NULL;
+}
+
+static void
+wbuf_remove(struct g_logstor_softc *sc, struct _wbuf *wbuf)
+{
+
+	LIST_REMOVE(wbuf, hash_link);
+	TAILQ_REMOVE(&sc->wbuf_age, wbuf, age_link);
+	TAILQ_INSERT_HEAD(&sc->wbuf_free, wbuf, age_link);
+	--sc->wbuf_cnt;
+}
+
+// buffer the block @data of @ba, the oldest blocks are destaged if the buffer is full
+static void
+wbuf_write(struct g_logstor_softc *sc, uint32_t ba, const void *data)
+{
+	struct _wbuf *wbuf = wbuf_find(sc, ba);
+
+	if (wbuf != NULL) {
+		// the overwrite is absorbed
+		memcpy(wbuf->data, data, SECTOR_SIZE);
+		STATS_INC(wbuf_absorb);
+		return;
+	}
+	if (sc->wbuf_cnt == sc->wbuf_max)
+		wbuf_destage(sc, WBUF_BATCH);
+	wbuf = TAILQ_FIRST(&sc->wbuf_free);
+	TAILQ_REMOVE(&sc->wbuf_free, wbuf, age_link);
+	wbuf->ba = ba;
+	wbuf->time = stats_time();
+	memcpy(wbuf->data, data, SECTOR_SIZE);
+	LIST_INSERT_HEAD(wbuf_bucket(sc, ba), wbuf, hash_link);
+	TAILQ_INSERT_TAIL(&sc->wbuf_age, wbuf, age_link);
+	++sc->wbuf_cnt;
+}
+
+// discard the buffered block @ba if any
+static void
+wbuf_drop(struct g_logstor_softc *sc, uint32_t ba)
+{
+	struct _wbuf *wbuf = wbuf_find(sc, ba);
+
+	if (wbuf != NULL)
+		wbuf_remove(sc, wbuf);
+}
+
+static int
+wbuf_cmp(const void *a, const void *b)
+{
+	uint32_t ba_a = (*(struct _wbuf * const *)a)->ba;
+	uint32_t ba_b = (*(struct _wbuf * const *)b)->ba;
+
+	return ba_a < ba_b ? -1 : ba_a > ba_b;
+}
+
+/*
+Description:
+    Write the @cnt oldest buffered blocks to the log in the order of their
+    block addresses
+*/
+static void
+wbuf_destage(struct g_logstor_softc *sc, unsigned cnt)
+{
+	struct _wbuf *wbuf;
+	unsigned i, n = 0;
+
+	if (cnt > sc->wbuf_cnt)
+		cnt = sc->wbuf_cnt;
+	TAILQ_FOREACH(wbuf, &sc->wbuf_age, age_link) {
+		if (n == cnt)
+			break;
+		sc->wbuf_sort[n++] = wbuf;
+	}
+	qsort(sc->wbuf_sort, n, sizeof(*sc->wbuf_sort), wbuf_cmp);
+	for (i = 0; i < n; ++i) {
+		wbuf = sc->wbuf_sort[i];
+		// a large destage may fill the segments a checkpoint or a cleaning frees
+		if (i != 0 && i % WBUF_BATCH == 0)
+			md_checkpoint_check(sc);
+		fbuf_clean_queue_check(sc);
+		block_write(sc, wbuf->ba, wbuf->data);
+		wbuf_remove(sc, wbuf);
+	}
+	STATS_ADD(wbuf_destage, n);
+}
+
+// destage a batch if the oldest buffered block is too old
+static void
+wbuf_age_check(struct g_logstor_softc *sc)
+{
+	struct _wbuf *wbuf = TAILQ_FIRST(&sc->wbuf_age);
+
+	if (wbuf != NULL && stats_time() - wbuf->time >= WBUF_AGE_NS)
+		wbuf_destage(sc, WBUF_BATCH);
+}
+
+// free the write buffer, the buffered blocks are discarded
+static void
+wbuf_mod_fini(struct g_logstor_softc *sc)
+{
+
+	free(sc->wbufs);
+	free(sc->wbuf_sort);
+	free(sc->wbuf_hash);
+	sc->wbufs = NULL;
+	sc->wbuf_sort = NULL;
+	sc->wbuf_hash = NULL;
+	sc->wbuf_max = sc->wbuf_cnt = 0;
+	TAILQ_INIT(&sc->wbuf_age);
+	TAILQ_INIT(&sc->wbuf_free);
+}
+
+/*
+Description:
+    Set the size of the read cache to @block_cnt blocks, 0 turns it off
+*/
+void
+logstor_set_rcache(struct g_logstor_softc *sc, unsigned block_cnt)
+{
+	uint32_t bucket_cnt;
+
+	pthread_mutex_lock(&sc->sc_mtx);
+	rcache_mod_fini(sc);
+	if (block_cnt != 0) {
+		for (bucket_cnt = 1; bucket_cnt < block_cnt; bucket_cnt <<= 1)
+			;
+		sc->rcaches = calloc(block_cnt, sizeof(*sc->rcaches));
+		MY_ASSERT(sc->rcaches != NULL);
+		sc->rc_hash = calloc(bucket_cnt, sizeof(*sc->rc_hash));
+		MY_ASSERT(sc->rc_hash != NULL);
+		sc->rc_ra_buf = malloc(RC_WINDOW * SECTOR_SIZE);
+		MY_ASSERT(sc->rc_ra_buf != NULL);
+		sc->rc_hash_mask = bucket_cnt - 1;
+		for (unsigned i = 0; i < block_cnt; ++i)
+			TAILQ_INSERT_TAIL(&sc->rc_free, &sc->rcaches[i], lru_link);
+		sc->rc_max = block_cnt;
+	}
+	pthread_mutex_unlock(&sc->sc_mtx);
+}
+
+static inline struct _rcache_list *
+rcache_bucket(struct g_logstor_softc *sc, uint32_t ba)
+{
+	return &sc->rc_hash[(ba * 0x9E3779B1u >> 7) & sc->rc_hash_mask];
+}
+
+// the cached block @ba, NULL if it is not cached
+static struct _rcache *
+rcache_find(struct g_logstor_softc *sc, uint32_t ba)
+{
+	struct _rcache *rc;
+
+	if (sc->rc_max == 0)
+		return NULL;
+	LIST_FOREACH(rc, rcache_bucket(sc, ba), hash_link)
+		if (rc->ba == ba)
+			return rc;
+	return NULL;
+}
+
+static void
+rcache_remove(struct g_logstor_softc *sc, struct _rcache *rc)
+{
+
+	LIST_REMOVE(rc, hash_link);
+	TAILQ_REMOVE(&sc->rc_queue[rc->queue], rc, lru_link);
+	--sc->rc_cnt[rc->queue];
+	TAILQ_INSERT_HEAD(&sc->rc_free, rc, lru_link);
+}
+
+static void
+rcache_queue_insert(struct g_logstor_softc *sc, struct _rcache *rc, int queue)
+{
+
+	rc->queue = queue;
+	TAILQ_INSERT_TAIL(&sc->rc_queue[queue], rc, lru_link);
+	++sc->rc_cnt[queue];
+}
+
+// the block @rc is hit, it is moved to the protected segment
+static void
+rcache_hit(struct g_logstor_softc *sc, struct _rcache *rc)
+{
+	struct _rcache *lru;
+
+	TAILQ_REMOVE(&sc->rc_queue[rc->queue], rc, lru_link);
+	--sc->rc_cnt[rc->queue];
+	rcache_queue_insert(sc, rc, RC_PROTECTED);
+	if (sc->rc_cnt[RC_PROTECTED] > (uint64_t)sc->rc_max * RC_PROTECTED_PCT / 100) {
+		lru = TAILQ_FIRST(&sc->rc_queue[RC_PROTECTED]);
+		TAILQ_REMOVE(&sc->rc_queue[RC_PROTECTED], lru, lru_link);
+		--sc->rc_cnt[RC_PROTECTED];
+		rcache_queue_insert(sc, lru, RC_PROBATION);
+	}
+}
+
+// cache the block @data of @ba read from @sa on probation
+static void
+rcache_insert(struct g_logstor_softc *sc, uint32_t ba, uint32_t sa, const void *data)
+{
+	struct _rcache *rc;
+
+	if ((rc = TAILQ_FIRST(&sc->rc_free)) == NULL) {
+		rc = TAILQ_FIRST(&sc->rc_queue[RC_PROBATION]);
+		if (rc == NULL)
+			rc = TAILQ_FIRST(&sc->rc_queue[RC_PROTECTED]);
+		rcache_remove(sc, rc);
+	}
+	TAILQ_REMOVE(&sc->rc_free, rc, lru_link);
+	rc->ba = ba;
+	rc->sa = sa;
+	memcpy(rc->data, data, SECTOR_SIZE);
+	LIST_INSERT_HEAD(rcache_bucket(sc, ba), rc, hash_link);
+	rcache_queue_insert(sc, rc, RC_PROBATION);
+}
+
+// remove the block @ba from the cache if it is cached
+static void
+rcache_drop(struct g_logstor_softc *sc, uint32_t ba)
+{
+	struct _rcache *rc = rcache_find(sc, ba);
+
+	if (rc != NULL)
+		rcache_remove(sc, rc);
+}
+
+static void
+rcache_clear(struct g_logstor_softc *sc)
+{
+	struct _rcache *rc;
+
+	for (int i = 0; i < RC_QUEUE_CNT; ++i)
+		while ((rc = TAILQ_FIRST(&sc->rc_queue[i])) != NULL)
+			rcache_remove(sc, rc);
+	bzero(sc->rc_stream, sizeof(sc->rc_stream));
+}
+
+/*
+Description:
+    Read the blocks from @ba to @ba_end that are not cached into the cache
+    The sectors that follow each other in a segment are read together.
+*/
+static void
+rcache_fill(struct g_logstor_softc *sc, uint32_t ba, uint32_t ba_end)
+{
+	uint32_t run_ba[RC_WINDOW];
+	uint32_t run_sa = SECTOR_NULL;
+	int run_cnt = 0;
+
+	MY_ASSERT(ba_end - ba <= RC_WINDOW);
+	for (;; ++ba) {
+		uint32_t sa = SECTOR_NULL;
+		bool skip = true;
+
+		if (ba < ba_end) {
+			fbuf_clean_queue_check(sc);
+			// a buffered block is read from the write buffer
+			skip = rcache_find(sc, ba) != NULL || wbuf_find(sc, ba) != NULL;
+			if (!skip)
+				sa = sc->ba2sa_fp(sc, ba);
+		}
+		// end the run
+		if (run_cnt != 0 && (skip || SA_IS_FRAG(sa) || sa == SECTOR_NULL ||
+		    sa != run_sa + run_cnt || (sa & (SECTORS_PER_SEG - 1)) == 0)) {
+			my_read_run(sc, sc->rc_ra_buf, run_sa, run_cnt, LOGSTOR_IO_DATA);
+			for (int i = 0; i < run_cnt; ++i) {
+				char *data = sc->rc_ra_buf + i * SECTOR_SIZE;
+
+				sec_csum_check(sc, data, run_sa + i);
+				rcache_insert(sc, run_ba[i], run_sa + i, data);
+			}
+			STATS_INC(rcache_ra_io);
+			STATS_ADD(rcache_ra_block, run_cnt);
+			run_cnt = 0;
+		}
+		if (ba >= ba_end)
+			break;
+		// an unmapped block is not worth caching
+		if (skip || sa == SECTOR_NULL)
+			continue;
+		if (SA_IS_FRAG(sa)) {
+			pack_read(sc, sa, sc->rc_ra_buf);
+			rcache_insert(sc, ba, sa, sc->rc_ra_buf);
+			STATS_INC(rcache_ra_block);
+			continue;
+		}
+		if (run_cnt == 0)
+			run_sa = sa;
+		run_ba[run_cnt++] = ba;
+	}
+}
+
+/*
+Description:
+    Match the read of block @ba to a sequential stream and read the blocks
+    ahead of it, see "Read cache"
+*/
+static void
+rcache_readahead(struct g_logstor_softc *sc, uint32_t ba)
+{
+	struct _rc_stream *s;
+	uint32_t from, to;
+	int i;
+
+	for (i = 0; i < RC_STREAM_CNT; ++i)
+		if (sc->rc_stream[i].next_ba == ba && sc->rc_stream[i].hits != 0)
+			break;
+	if (i < RC_STREAM_CNT) {
+		s = &sc->rc_stream[i];
+		++s->hits;
+	} else {
+		s = &sc->rc_stream[sc->rc_stream_next];
+		sc->rc_stream_next = (sc->rc_stream_next + 1) % RC_STREAM_CNT;
+		s->hits = 1;
+		s->ra_ba = ba + 1;
+	}
+	s->next_ba = ba + 1;
+	if (s->hits < RC_CONFIRM)
+		return;
+	// the stream has passed the blocks read ahead
+	if (s->ra_ba < s->next_ba)
+		s->ra_ba = s->next_ba;
+	if (s->ra_ba - s->next_ba >= RC_WINDOW / 2)
+		return;
+	from = s->ra_ba;
+	to = MIN((uint64_t)s->next_ba + RC_WINDOW, sc->superblock.block_cnt);
+	if (from >= to)
+		return;
+	rcache_fill(sc, from, to);
+	s->ra_ba = to;
+}
+
+// free the read cache
+static void
+rcache_mod_fini(struct g_logstor_softc *sc)
+{
+
+	free(sc->rcaches);
+	free(sc->rc_hash);
+	free(sc->rc_ra_buf);
+	sc->rcaches = NULL;
+	sc->rc_hash = NULL;
+	sc->rc_ra_buf = NULL;
+	sc->rc_max = 0;
+	for (int i = 0; i < RC_QUEUE_CNT; ++i) {
+		TAILQ_INIT(&sc->rc_queue[i]);
+		sc->rc_cnt[i] = 0;
+	}
+	TAILQ_INIT(&sc->rc_free);
+	bzero(sc->rc_stream, sizeof(sc->rc_stream));
+}
+
+/*
+Description:
+    Start @thread_cnt worker threads for the asynchronous requests, 0
+    turns them off. The pending requests are completed first.
+    It must not be called from a callback or at the same time as
+    logstor_submit().
+*/
+void
+logstor_set_async(struct g_logstor_softc *sc, int thread_cnt)
+{
+
+	MY_ASSERT(thread_cnt >= 0 && thread_cnt <= ASYNC_THREAD_MAX);
+	async_mod_fini(sc);
+	if (thread_cnt == 0)
+		return;
+	sc->async_ring = malloc(ASYNC_RING_SIZE * sizeof(*sc->async_ring));
+	MY_ASSERT(sc->async_ring != NULL);
+	for (uint64_t i = 0; i < ASYNC_RING_SIZE; ++i)
+		sc->async_ring[i].seq = i;
+	sc->async_head = 0;
+	sc->async_tail = 0;
+	sc->async_stop = false;
+	for (int i = 0; i < thread_cnt; ++i) {
+		int error __unused = pthread_create(&sc->async_tid[i], NULL, async_thread, sc);
+		MY_ASSERT(error == 0);
+	}
+	sc->async_thread_cnt = thread_cnt;
+}
+
+struct logstor_cq *
+logstor_cq_create(void)
+{
+	struct logstor_cq *cq = calloc(1, sizeof(*cq));
+
+	MY_ASSERT(cq != NULL);
+	pthread_mutex_init(&cq->mtx, NULL);
+	pthread_cond_init(&cq->cv, NULL);
+	cq->tailp = &cq->head;
+	return cq;
+}
+
+void
+logstor_cq_destroy(struct logstor_cq *cq)
+{
+
+	MY_ASSERT(__atomic_load_n(&cq->pending, __ATOMIC_SEQ_CST) == 0 && cq->head == NULL);
+	pthread_cond_destroy(&cq->cv);
+	pthread_mutex_destroy(&cq->mtx);
+	free(cq);
+}
+
+/*
+Description:
+    Put the request @req in the submission ring
+Return:
+    0, EINVAL if the request is bad, ENXIO if the asynchronous requests
+    are off or EAGAIN if the ring is full
+*/
+int
+logstor_submit(struct g_logstor_softc *sc, struct logstor_req *req)
+{
+	uint32_t block_cnt = sc->superblock.block_cnt;
+
+	if (sc->async_thread_cnt == 0)
+		return ENXIO;
+	if ((req->done == NULL) == (req->cq == NULL))
+		return EINVAL;
+	switch (req->op) {
+	case LOGSTOR_REQ_READ:
+	case LOGSTOR_REQ_WRITE:
+	case LOGSTOR_REQ_DELETE:
+		if (req->cnt == 0 || req->ba >= block_cnt || req->cnt > block_cnt - req->ba)
+			return EINVAL;
+		break;
+	case LOGSTOR_REQ_FLUSH:
+		break;
+	default:
+		return EINVAL;
+	}
+	if (!async_ring_put(sc, req))
+		return EAGAIN;
+	// pairs with the fence in async_thread() so either the worker sees
+	// the request or the submitter sees the worker sleeping
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sc->async_sleepers, __ATOMIC_RELAXED) != 0) {
+		pthread_mutex_lock(&sc->async_mtx);
+		pthread_cond_signal(&sc->async_cv);
+		pthread_mutex_unlock(&sc->async_mtx);
+	}
+	return 0;
+}
+
+/*
+Description:
+    Take a completed request from the completion queue @cq
+    If @wait is not 0 it waits for a request to complete.
+Return:
+    The oldest completed request or NULL if there is none. With @wait it
+    is NULL only if no request is pending on @cq.
+*/
+struct logstor_req *
+logstor_reap(struct logstor_cq *cq, int wait)
+{
+	struct logstor_req *req;
+
+	pthread_mutex_lock(&cq->mtx);
+	while (cq->head == NULL && wait &&
+	    __atomic_load_n(&cq->pending, __ATOMIC_SEQ_CST) != 0)
+		pthread_cond_wait(&cq->cv, &cq->mtx);
+	if ((req = cq->head) != NULL) {
+		cq->head = req->next;
+		if (cq->head == NULL)
+			cq->tailp = &cq->head;
+	}
+	pthread_mutex_unlock(&cq->mtx);
+	return req;
+}
+
+/*
+Description:
+    Put @req in the submission ring, false if the ring is full
+    The request is counted as pending after its slot is claimed and
+    before the slot is filled, so no worker can complete it before it is
+    counted and a full ring leaves the counts alone.
+*/
+static bool
+async_ring_put(struct g_logstor_softc *sc, struct logstor_req *req)
+{
+	struct _async_slot *slot;
+	uint64_t pos, seq;
+
+	pos = __atomic_load_n(&sc->async_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &sc->async_ring[pos & (ASYNC_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			// the slot is free in this lap
+			if (__atomic_compare_exchange_n(&sc->async_head, &pos, pos + 1,
+			    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t)(seq - pos) < 0)
+			return false;	// the slot is still full from the last lap
+		else
+			pos = __atomic_load_n(&sc->async_head, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&sc->async_pending, 1, __ATOMIC_SEQ_CST);
+	if (req->cq != NULL)
+		__atomic_add_fetch(&req->cq->pending, 1, __ATOMIC_SEQ_CST);
+	slot->req = req;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// take a request from the submission ring, NULL if it is empty
+static struct logstor_req *
+async_ring_take(struct g_logstor_softc *sc)
+{
+	struct _async_slot *slot;
+	struct logstor_req *req;
+	uint64_t pos, seq;
+
+	pos = __atomic_load_n(&sc->async_tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &sc->async_ring[pos & (ASYNC_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos + 1) {
+			// the slot is full in this lap
+			if (__atomic_compare_exchange_n(&sc->async_tail, &pos, pos + 1,
+			    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t)(seq - (pos + 1)) < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&sc->async_tail, __ATOMIC_RELAXED);
+	}
+	req = slot->req;
+	// free the slot for the next lap
+	__atomic_store_n(&slot->seq, pos + ASYNC_RING_SIZE, __ATOMIC_RELEASE);
+	return req;
+}
+
+static int
+async_exec(struct g_logstor_softc *sc, struct logstor_req *req)
+{
+	char *data = req->data;
+
+	switch (req->op) {
+	case LOGSTOR_REQ_READ:
+		for (uint32_t i = 0; i < req->cnt; ++i)
+			logstor_read(sc, req->ba + i, data + (size_t)i * SECTOR_SIZE);
+		return 0;
+	case LOGSTOR_REQ_WRITE:
+		// the flush for LOGSTOR_FUA is done by async_batch()
+		for (uint32_t i = 0; i < req->cnt; ++i)
+			logstor_write(sc, req->ba + i, data + (size_t)i * SECTOR_SIZE,
+			    req->flags & ~LOGSTOR_FUA);
+		return 0;
+	case LOGSTOR_REQ_DELETE:
+		return logstor_delete(sc, (off_t)req->ba * SECTOR_SIZE, NULL,
+		    (off_t)req->cnt * SECTOR_SIZE);
+	case LOGSTOR_REQ_FLUSH:
+		return 0;	// done by async_batch()
+	}
+	return EINVAL;
+}
+
+// is @req completed only after a flush?
+static inline bool
+async_need_flush(struct logstor_req *req)
+{
+
+	return req->op == LOGSTOR_REQ_FLUSH ||
+	    (req->op == LOGSTOR_REQ_WRITE && (req->flags & LOGSTOR_FUA) != 0);
+}
+
+// @cnt requests are no longer pending
+static void
+async_done(struct g_logstor_softc *sc, unsigned cnt)
+{
+
+	if (__atomic_sub_fetch(&sc->async_pending, cnt, __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_lock(&sc->async_mtx);
+		pthread_cond_broadcast(&sc->async_idle_cv);
+		pthread_mutex_unlock(&sc->async_mtx);
+	}
+}
+
+/*
+Description:
+    Complete the @cnt requests of @batch in order
+    The consecutive requests of a completion queue are put on it together
+    with one wakeup of the reaper. A request must not be touched once it
+    is completed, its submitter may reuse it.
+*/
+static void
+async_complete(struct g_logstor_softc *sc, struct logstor_req *batch[], int cnt)
+{
+	struct logstor_req *req;
+	struct logstor_cq *cq;
+	int i = 0, n;
+
+	while (i < cnt) {
+		req = batch[i];
+		if ((cq = req->cq) == NULL) {
+			req->done(req);
+			async_done(sc, 1);
+			++i;
+			continue;
+		}
+		pthread_mutex_lock(&cq->mtx);
+		for (n = 0; i < cnt && batch[i]->cq == cq; ++i, ++n) {
+			req = batch[i];
+			req->next = NULL;
+			*cq->tailp = req;
+			cq->tailp = &req->next;
+		}
+		// async_ring_put() only raises it and does so without the lock
+		__atomic_sub_fetch(&cq->pending, n, __ATOMIC_SEQ_CST);
+		pthread_cond_signal(&cq->cv);
+		pthread_mutex_unlock(&cq->mtx);
+		async_done(sc, n);
+	}
+}
+
+/*
+Description:
+    Execute the @cnt requests of @batch in order and complete them
+    The requests that need a flush share one after all of them are
+    executed.
+*/
+static void
+async_batch(struct g_logstor_softc *sc, struct logstor_req *batch[], int cnt)
+{
+	bool flush = false;
+	int error;
+
+	for (int i = 0; i < cnt; ++i) {
+		batch[i]->error = async_exec(sc, batch[i]);
+		flush |= async_need_flush(batch[i]);
+	}
+	if (flush) {
+		error = logstor_flush(sc);
+		for (int i = 0; i < cnt; ++i)
+			if (async_need_flush(batch[i]) && batch[i]->error == 0)
+				batch[i]->error = error;
+	}
+	async_complete(sc, batch, cnt);
+}
+
+static void *
+async_thread(void *arg)
+{
+	struct g_logstor_softc *sc = arg;
+	struct logstor_req *batch[ASYNC_BATCH];
+	struct logstor_req *req;
+	int cnt;
+
+	for (;;) {
+		if ((req = async_ring_take(sc)) == NULL) {
+			pthread_mutex_lock(&sc->async_mtx);
+			__atomic_add_fetch(&sc->async_sleepers, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			while ((req = async_ring_take(sc)) == NULL && !sc->async_stop)
+				pthread_cond_wait(&sc->async_cv, &sc->async_mtx);
+			__atomic_sub_fetch(&sc->async_sleepers, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&sc->async_mtx);
+			if (req == NULL)
+				break;
+		}
+		// and what else is in the ring
+		batch[0] = req;
+		cnt = 1;
+		while (cnt < ASYNC_BATCH && (req = async_ring_take(sc)) != NULL)
+			batch[cnt++] = req;
+		async_batch(sc, batch, cnt);
+	}
+	return NULL;
+}
+
+// complete the pending requests and stop the workers
+static void
+async_mod_fini(struct g_logstor_softc *sc)
+{
+
+	if (sc->async_thread_cnt == 0)
+		return;
+	pthread_mutex_lock(&sc->async_mtx);
+	while (__atomic_load_n(&sc->async_pending, __ATOMIC_SEQ_CST) != 0)
+		pthread_cond_wait(&sc->async_idle_cv, &sc->async_mtx);
+	sc->async_stop = true;
+	pthread_cond_broadcast(&sc->async_cv);
+	pthread_mutex_unlock(&sc->async_mtx);
+	for (int i = 0; i < sc->async_thread_cnt; ++i)
+		pthread_join(sc->async_tid[i], NULL);
+	free(sc->async_ring);
+	sc->async_ring = NULL;
+	sc->async_thread_cnt = 0;
+}
+
+/*
+Description:
+    Replay the fragments of the packed sector @sa to the forward map
+
+Return:
+    the number of fragments replayed
+*/
+static unsigned
+pack_replay(struct g_logstor_softc *sc, uint32_t sa, union _pack_sec *pack)
+{
+
+	unsigned cnt = 0;
+
+	for (int i = 0; i < pack->hdr.ph_cnt; ++i) {
+		if (pack->hdr.ph_frag[i].ba == BLOCK_INVALID ||
+		    IS_BLOCK_SNAP(pack->hdr.ph_frag[i].ba))
+			continue;
+		fbuf_clean_queue_check(sc);
+		file_write_4byte(sc, sc->superblock.fd_cur,
+		    pack->hdr.ph_frag[i].ba, SA_FRAG(sa, i));
+		++cnt;
+	}
+	return cnt;
+}
+
+/*
+  write out the segment summary
+  segment summary is at the end of a segment, in zoned mode it is in the
+  conventional zones
+*/
+static void
+seg_sum_write(struct g_logstor_softc *sc)
+{
+
+	pack_flush(sc);
+	if (!sc->ss_modified)
+		return;
+	// record the log position for roll forward
+	sc->seg_sum.ss_allocp = sc->ss_allocp;
+	seg_sum_save(sc, sc->superblock.seg_allocp, &sc->seg_sum);
+	sc->ss_modified = false;
+	sc->other_write_count += SEG_SUM_CNT; // the write for the segment summary
+}
+
+/*
+Description:
+    Write the segment summary @seg_sum of segment @sega with its checksum
+*/
+static void
+seg_sum_save(struct g_logstor_softc *sc, uint32_t sega, struct _seg_sum *seg_sum)
+{
+	uint32_t sa = seg_sum_sa(sega);
+	size_t size = SEG_SUM_CNT * SECTOR_SIZE;
+	char buf[SEG_SUM_SIZE_MAX] __attribute__((aligned));
+	struct _seg_sum_tail *tail = (struct _seg_sum_tail *)(buf + size) - 1;
+
+	memcpy(buf, seg_sum->ss_rm, BLOCKS_PER_SEG * sizeof(uint32_t));
+	memcpy(buf + BLOCKS_PER_SEG * sizeof(uint32_t), seg_sum->ss_csum,
+	    BLOCKS_PER_SEG * sizeof(uint32_t));
+	memset(buf + BLOCKS_PER_SEG * 2 * sizeof(uint32_t), 0,
+	    size - BLOCKS_PER_SEG * 2 * sizeof(uint32_t));
+	tail->st_allocp_gen = seg_sum->ss_allocp |
+	    (seg_sum->ss_gen & SEG_GEN_MASK) << SEC_PER_SEG_SHIFT;
+	tail->st_csum_self = crc32c(0, buf, size - sizeof(tail->st_csum_self));
+	for (int i = 0; i < SEG_SUM_CNT; ++i)
+		my_write(sc, buf + i * SECTOR_SIZE, sa + i, LOGSTOR_IO_SEG_SUM);
+}
+
+/*
+Description:
+    Is segment @sega never written according to the superblock @sb
+
+    The log allocates the segments in order from geom.seg_first and
+    %seg_gen counts the allocations, so until it wraps around the segments
+    from the allocated one on are never written. The capacity tier records
+    how far it has written in %tier_seg_fresh. The segments before the log
+    of a zoned volume hold no sectors.
+    On a crash the superblock is older than the log, so fewer segments are
+    taken as never written but never more.
+*/
+static bool
+seg_is_fresh(const struct _superblock *sb, uint32_t sega)
+{
+
+	if (sega < geom.seg_first)
+		return true;
+	if (sega < geom.seg_end)
+		return sb->seg_gen < geom.seg_end - geom.seg_first &&
+		    sega >= geom.seg_first + sb->seg_gen;
+	return sega >= sb->tier_seg_fresh;
+}
+
+/*
+Description:
+    Read the segment summary of segment @sega into @seg_sum
+
+    The segment summaries are not written by logstor_init_disk(). The
+    summary of a segment that was never written is all zero, it is
+    returned as an empty one with all the reverse maps BLOCK_INVALID.
+    An all zero summary of any other segment is a checksum error
+
+Return:
+    true if the checksum of the segment summary is correct
+*/
+static bool
+seg_sum_read(struct g_logstor_softc *sc, uint32_t sega, struct _seg_sum *seg_sum)
+{
+	uint32_t sa = seg_sum_sa(sega);
+	size_t size = SEG_SUM_CNT * SECTOR_SIZE;
+	char buf[SEG_SUM_SIZE_MAX] __attribute__((aligned));
+	struct _seg_sum_tail *tail = (struct _seg_sum_tail *)(buf + size) - 1;
+
+	for (int i = 0; i < SEG_SUM_CNT; ++i)
+		my_read(sc, buf + i * SECTOR_SIZE, sa + i, LOGSTOR_IO_SEG_SUM);
+	if (tail->st_csum_self == crc32c(0, buf, size - sizeof(tail->st_csum_self))) {
+		memcpy(seg_sum->ss_rm, buf, BLOCKS_PER_SEG * sizeof(uint32_t));
+		memcpy(seg_sum->ss_csum, buf + BLOCKS_PER_SEG * sizeof(uint32_t),
+		    BLOCKS_PER_SEG * sizeof(uint32_t));
+		seg_sum->ss_allocp = tail->st_allocp_gen & (SECTORS_PER_SEG - 1);
+		seg_sum->ss_gen = tail->st_allocp_gen >> SEC_PER_SEG_SHIFT;
+		return true;
+	}
+	if (!seg_is_fresh(&sc->superblock, sega))
+		return false;
+	for (int i = 0; i < SEG_SUM_CNT; ++i)
+		if (!is_zero_block(buf + i * SECTOR_SIZE))
+			return false;
+	for (int i = 0; i < BLOCKS_PER_SEG; ++i) {
+		seg_sum->ss_rm[i] = BLOCK_INVALID;
+		seg_sum->ss_csum[i] = 0;
+	}
+	seg_sum->ss_allocp = 0;
+	seg_sum->ss_gen = 0;
+	return true;
+}
+
+/*
+Description:
+    Copy the checksums in the segment summary @seg_sum of segment @sega
+    to the checksum table
+*/
+static void
+seg_csum_load(struct g_logstor_softc *sc, uint32_t sega, struct _seg_sum *seg_sum)
+{
+
+	memcpy(&sc->sec_csum[sega2sa(sega)], seg_sum->ss_csum, BLOCKS_PER_SEG * sizeof(uint32_t));
+	sc->seg_csum_loaded[sega / NBBY] |= 1 << (sega % NBBY);
+}
+
+/*
+Description:
+    Get the checksum of sector @sa
+
+    The checksums of a segment are loaded from its segment summary the
+    first time a sector in it is read. After that the table is updated
+    by _logstor_write().
+*/
+static uint32_t
+sec_csum_get(struct g_logstor_softc *sc, uint32_t sa)
+{
+	uint32_t sega = sa >> SEC_PER_SEG_SHIFT;
+
+	MY_ASSERT((sa & (SECTORS_PER_SEG - 1)) < SEG_SUM_OFFSET);
+	if ((sc->seg_csum_loaded[sega / NBBY] & (1 << (sega % NBBY))) == 0) {
+		if (!seg_sum_read(sc, sega, &sc->ss_buf)) {
+			printf("%s: segment summary %u checksum error\n", __func__, sega);
+			MY_PANIC();
+		}
+		seg_csum_load(sc, sega, &sc->ss_buf);
+	}
+	return sc->sec_csum[sa];
+}
+
+/*
+Description:
+    Verify the checksum of sector @sa that is read into @buf
+*/
+static void
+sec_csum_check(struct g_logstor_softc *sc, const void *buf, uint32_t sa)
+{
+
+	if (crc32c(0, buf, SECTOR_SIZE) != sec_csum_get(sc, sa)) {
+		printf("%s: sector %u checksum error\n", __func__, sa);
+		MY_PANIC();
+	}
+}
+
+static bool
+superblock_is_valid(struct _superblock *sb)
+{
+
+	return sb->magic == G_LOGSTOR_MAGIC &&
+	    sb->version == G_LOGSTOR_VERSION &&
+	    sb->sb_csum == crc32c(0, sb, offsetof(struct _superblock, sb_csum));
+}
+
+/*
+  Segment 0 is used to store superblock so there are SECTORS_PER_SEG sectors
+  for storing superblock. Each time the superblock is synced, it is stored
+  in the next sector. When it reachs the end of segment 0, it wraps around
+  to sector 0.
+
+  A superblock with a bad checksum is a torn write and is skipped, so the
+  search starts from the first valid one and wraps around.
+*/
+static int
+superblock_read(struct g_logstor_softc *sc)
+{
+	typeof(sc->superblock.sb_gen) sb_gen;
+	int i, first, error;
+	struct _superblock *sb;
+	char buf[2][SECTOR_SIZE];
+
+	// get the first valid superblock
+	sb = (struct _superblock *)buf[0];
+	for (first = 0; first < SB_CNT; first++) {
+		my_read(NULL, sb, first, LOGSTOR_IO_SUPERBLOCK);
+		if (superblock_is_valid(sb))
+			break;
+	}
+	if (first == SB_CNT) {
+		error = EINVAL;
+		goto exit;
+	}
+	sb_gen = sb->sb_gen;
+	for (i = 1 ; i < SB_CNT; i++) {
+		sb = (struct _superblock *)buf[i%2];
+		my_read(NULL, sb, (first + i) % SB_CNT, LOGSTOR_IO_SUPERBLOCK);
+		if (!superblock_is_valid(sb))
+			break;
+		if (sb->sb_gen != (typeof(sb_gen))(sb_gen + 1))
+			break;
+		sb_gen = sb->sb_gen;
+	}
+	sc->sb_sa = (first + i - 1) % SB_CNT;
+	sb = (struct _superblock *)buf[(i-1)%2]; // get the previous valid superblock
+	if (sb->sector_size != SECTOR_SIZE || sb->idx_bits != IDX_BITS ||
+	    sb->sb_cnt != SB_CNT ||
+	    sb->seg_shift < SEG_SHIFT_MIN || sb->seg_shift > SEG_SHIFT_MAX) {
+		printf("%s: unsupported geometry sector size %u index bits %u "
+		    "superblocks %u segment shift %u\n", __func__, sb->sector_size,
+		    sb->idx_bits, sb->sb_cnt, sb->seg_shift);
+		error = EINVAL;
+		goto exit;
+	}
+	geom_set(sb->seg_shift);
+	geom_layout_set(sb->zoned, sb->seg_cnt, sb->tier_seg_cnt);
+	if (sb->seg_allocp >= geom.seg_end || sb->seg_allocp < geom.seg_first ||
+	    sb->ss_allocp > SEG_SUM_OFFSET) {
+		error = EINVAL;
+		goto exit;
+	}
+	if (geom.tiered && (sb->tier_seg_cnt >= sb->seg_cnt ||
+	    sb->tier_seg_allocp < sb->tier_seg_cnt ||
+	    sb->tier_seg_allocp >= sb->seg_cnt || sb->tier_ss_allocp > SEG_SUM_OFFSET ||
+	    sb->tier_seg_fresh < sb->tier_seg_cnt || sb->tier_seg_fresh > sb->seg_cnt)) {
+		error = EINVAL;
+		goto exit;
+	}
+	for (i=0; i<FD_COUNT; ++i)
+		MY_ASSERT(sb->fh[i].root != SECTOR_CACHE);
+	memcpy(&sc->superblock, sb, sizeof(sc->superblock));
+	sc->sb_modified = false;
+	error = 0;
+exit:
+	return error;
+}
+
+static void
+superblock_write(struct g_logstor_softc *sc)
+{
+	size_t sb_size = sizeof(sc->superblock);
+	char buf[SECTOR_SIZE];
+
+	//if (!sc->sb_modified)
+	//	return;
+
+	for (int i = 0; i < FD_COUNT; ++i) {
+		MY_ASSERT(sc->superblock.fh[i].root != SECTOR_CACHE);
+	}
+	sc->superblock.sb_gen++;
+	sc->superblock.ss_allocp = sc->ss_allocp;
+	sc->superblock.sb_csum = crc32c(0, &sc->superblock,
+	    offsetof(struct _superblock, sb_csum));
+	if (++sc->sb_sa == SB_CNT)
+		sc->sb_sa = 0;
+	memcpy(buf, &sc->superblock, sb_size);
+	memset(buf + sb_size, 0, SECTOR_SIZE - sb_size);
+	my_write(sc, buf, sc->sb_sa, LOGSTOR_IO_SUPERBLOCK);
+	sc->sb_modified = false;
+	sc->other_write_count++;
+
+	// this is the new checkpoint, the sectors pinned for the old one are free now
+	memset(sc->sec_pinned, 0, howmany(sc->superblock.seg_cnt * SECTORS_PER_SEG, NBBY));
+	// the capacity tier may have free sectors again
+	sc->tier_full = false;
+	// and so are those of the warm state once it is not pointed to
+	if (sc->superblock.warm_sa == SECTOR_NULL)
+		sc->warm_sec_cnt = 0;
+	sc->ckpt_seg_cnt = 0;
+	sc->unlogged = false;
+}
+
+// @kind is the kind of the sector for the statistics, LOGSTOR_IO_XXX
+static void
+my_read(struct g_logstor_softc *sc, void *buf, uint32_t sa, int kind)
+{
+//MY_BREAK(sa == );
+	MY_ASSERT(sc == NULL || sa < sc->superblock.seg_cnt * SECTORS_PER_SEG);
+	memcpy(buf, ram_sec(sa), SECTOR_SIZE);
+	STATS_INC(dev_read[kind]);
+	if (kind == LOGSTOR_IO_DATA && (sa >> SEC_PER_SEG_SHIFT) >= geom.seg_end)
+		STATS_INC(tier_read);
+}
+
+// read the @cnt sectors from @sa in one request, they are in one segment
+static void
+my_read_run(struct g_logstor_softc *sc, void *buf, uint32_t sa, uint32_t cnt, int kind)
+{
+
+	MY_ASSERT(cnt != 0 && (sa >> SEC_PER_SEG_SHIFT) == ((sa + cnt - 1) >> SEC_PER_SEG_SHIFT));
+	MY_ASSERT(sc == NULL || sa + cnt <= sc->superblock.seg_cnt * SECTORS_PER_SEG);
+	memcpy(buf, ram_sec(sa), (size_t)cnt * SECTOR_SIZE);
+	STATS_ADD(dev_read[kind], cnt);
+	if (kind == LOGSTOR_IO_DATA && (sa >> SEC_PER_SEG_SHIFT) >= geom.seg_end)
+		STATS_ADD(tier_read, cnt);
+}
+
+static void
+my_write(struct g_logstor_softc *sc, const void *buf, uint32_t sa, int kind)
+{
+//MY_BREAK(sa == );
+	MY_ASSERT(sc == NULL || sa < sc->superblock.seg_cnt * SECTORS_PER_SEG);
+	zone_wp_advance(sa);
+	ram_disk_copy_nt(ram_sec(sa), buf);
+	STATS_INC(dev_write[kind]);
+}
+
+// write @buf at the write pointer of the sequential zone @zone and return its sector address
+static uint32_t
+zone_append(struct g_logstor_softc *sc, const void *buf, uint32_t zone, int kind)
+{
+	uint32_t sa = (zone << zone_emu.zone_shift) + zone_wp_get(zone);
+
+	MY_ASSERT(zone >= zone_emu.conv_cnt);
+
+	my_write(sc, buf, sa, kind);
+	return sa;
+}
+
+// make the writes to the downstream disk durable
+static void
+my_sync(struct g_logstor_softc *sc __unused)
+{
+	// the RAM disk has no volatile cache
+}
+
+/*
+Description:
+  Allocate a segment for writing
+
+Output:
+  Store the segment address into @seg_sum->sega
+  Initialize @seg_sum->sum.alloc_p to 0
+*/
+static void
+seg_alloc(struct g_logstor_softc *sc)
+{
+	uint64_t start = stats_time();
+	int flags = LOGSTOR_TF_SEG_ALLOC;
+
+	// write the previous segment summary to disk
+	// it is written even if no sector in that segment is written and
+	// is marked as full so that roll forward will go on to the next segment
+	uint32_t sega = sc->superblock.seg_allocp;
+
+	sc->ss_allocp = SEG_SUM_OFFSET;
+	sc->ss_modified = true;
+	seg_sum_write(sc);
+	if (geom.zoned)
+		zone_finish(sega);
+
+	MY_ASSERT(sc->superblock.seg_allocp < sc->superblock.seg_cnt);
+	sc->superblock.seg_allocp = seg_next(sc, sega);
+	if (sc->superblock.seg_allocp < sega)
+		flags |= LOGSTOR_TF_SEG_WRAP;
+	// the first SB_CNT sectors are superblock
+	sc->ss_allocp = seg_log_start(sc->superblock.seg_allocp);
+	++sc->superblock.seg_gen;
+	++sc->ckpt_seg_cnt;
+
+	if (sc->superblock.seg_allocp == sc->seg_allocp_start)
+		// has accessed all the segment summary blocks
+		MY_PANIC();
+	if (geom.zoned && sc->superblock.seg_allocp == sc->zone_free_sega) {
+		printf("%s: no free zone\n", __func__);
+		MY_PANIC();
+	}
+	// read reverse map
+	sc->seg_allocp_sa = sega2sa(sc->superblock.seg_allocp);
+	seg_sum_cur_read(sc);
+	if (geom.zoned) {
+		// the segment is cleaned, the sectors of its last use are gone
+		zone_reset(sc->superblock.seg_allocp);
+		for (int i = 0; i < BLOCKS_PER_SEG; ++i)
+			sc->seg_sum.ss_rm[i] = BLOCK_INVALID;
+	}
+	trace(LOGSTOR_EV_SEG_ALLOC, flags, sc->superblock.seg_allocp,
+	    sc->seg_allocp_sa, start, stats_time());
+	trace_flag(flags);
+}
+
+/*
+Description:
+    Read the segment summary of the segment for allocation
+*/
+static void
+seg_sum_cur_read(struct g_logstor_softc *sc)
+{
+	uint32_t sega = sc->superblock.seg_allocp;
+
+	if (!seg_sum_read(sc, sega, &sc->seg_sum)) {
+		printf("%s: segment summary %u checksum error\n", __func__, sega);
+		MY_PANIC();
+	}
+	sc->seg_sum.ss_gen = sc->superblock.seg_gen;
+	seg_csum_load(sc, sega, &sc->seg_sum);
+}
+
+/*
+  Zoned mode
+
+  On a zoned disk a segment is a zone and its sectors are written in order
+  at the write pointer, so a segment is reused only when all its sectors are
+  dead and its zone has been reset. The dead sectors are not reused in place.
+
+  The segments are cleaned in the log order, so the segments written after a
+  checkpoint still have consecutive generations for roll forward. The live
+  sectors of the segment after the cleaned ones are moved to the log head,
+  the dirty metadata by the checkpoint that ends the cleaning. After the
+  checkpoint the cleaned segments are free and the zone of a free segment is
+  reset when the log head allocates it. The segments after the log head and
+  before %zone_free_sega are free, and so are the segments up to
+  %zone_clean_sega once the next checkpoint is made. Each cleaning leaves
+  room for the checkpoint, which may write back the whole fbuf cache.
+
+  The segment summaries are stored in the conventional zones after the
+  superblocks since the summary of the segment being filled is written at
+  each flush. The segment summary sectors at the end of the zones are not
+  used. A packed sector is written before the next sector so the write
+  pointer doesn't pass it. A moved block that only the snapshot maps is
+  flagged BLOCK_SNAP in the reverse map, roll forward would otherwise map
+  it in the current file over a newer write. Deduplication is not supported since a sector
+  shared by blocks can't be moved without finding all the blocks.
+*/
+
+// the number of free segments after the log head
+static inline uint32_t
+zone_free_cnt(struct g_logstor_softc *sc)
+{
+	return seg_dist(sc, sc->superblock.seg_allocp, sc->zone_free_sega) - 1;
+}
+
+// the free segments to keep with a fbuf cache of @fbuf_count
+static uint32_t
+zone_free_min(int fbuf_count)
+{
+	// each round of cleaning must gain more than its checkpoint takes
+	return 4 * (howmany(fbuf_count, BLOCKS_PER_SEG) + 1) + 4;
+}
+
+/*
+Description:
+    Write the live sector @data of @ba to the log head, or to the capacity
+    tier while migrating
+
+Return:
+    the sector address where it is written, SECTOR_NULL if the capacity
+    tier is full
+*/
+static uint32_t
+sec_reloc_write(struct g_logstor_softc *sc, uint32_t ba, void *data)
+{
+	uint32_t sa;
+
+	if (sc->tier_mig)
+		return tier_write(sc, ba, data);
+	sc->zone_reloc = true;
+	sa = _logstor_write(sc, ba, data);
+	sc->zone_reloc = false;
+	return sa;
+}
+
+/*
+Description:
+    The reverse map of the live block @ba moved from @sa
+    Until the checkpoint that ends the cleaning roll forward would replay
+    the moved sector to the current file. A block that only the snapshot
+    maps at @sa is flagged BLOCK_SNAP so the newer mapping of the current
+    file is kept, after a crash the snapshot maps the old sector that is
+    not reused before that checkpoint.
+*/
+static uint32_t
+sec_reloc_rev(struct g_logstor_softc *sc, uint32_t ba, uint32_t sa)
+{
+
+	if (file_read_4byte(sc, sc->superblock.fd_cur, ba) == sa)
+		return ba;
+	return ba | BLOCK_SNAP;
+}
+
+// map the block @ba in the current and the snapshot files from @sa_old to @sa_new
+static void
+sec_remap(struct g_logstor_softc *sc, uint32_t ba, uint32_t sa_old, uint32_t sa_new)
+{
+	struct _rcache *rc;
+	uint8_t fd[] = {
+	    sc->superblock.fd_cur,
+	    sc->superblock.fd_snap,
+	};
+
+	for (int i = 0; i < NUM_OF_ELEMS(fd); ++i)
+		if (file_read_4byte(sc, fd[i], ba) == sa_old)
+			file_write_4byte(sc, fd[i], ba, sa_new);
+	// the cached data is unchanged, only where it is read from
+	if ((rc = rcache_find(sc, ba)) != NULL && rc->sa == sa_old)
+		rc->sa = sa_new;
+}
+
+/*
+Description:
+    Move the packed sector @pack at @sa, see sec_reloc_write()
+    The dead fragments are dropped so roll forward doesn't replay them and
+    the ones only the snapshot maps are flagged BLOCK_SNAP
+*/
+static void
+sec_reloc_pack(struct g_logstor_softc *sc, uint32_t sa, union _pack_sec *pack)
+{
+	uint32_t ba[PACK_FRAG_MAX];
+	uint32_t sa_new;
+	int i;
+
+	for (i = 0; i < pack->hdr.ph_cnt; ++i) {
+		ba[i] = pack->hdr.ph_frag[i].ba;
+		if (ba[i] == BLOCK_INVALID)
+			continue;
+		if (IS_BLOCK_SNAP(ba[i]))
+			ba[i] -= BLOCK_SNAP;
+		if (!sc->is_sec_valid_fp(sc, SA_FRAG(sa, i), ba[i]))
+			ba[i] = pack->hdr.ph_frag[i].ba = BLOCK_INVALID;
+		else
+			pack->hdr.ph_frag[i].ba = sec_reloc_rev(sc, ba[i], SA_FRAG(sa, i));
+	}
+	sa_new = sec_reloc_write(sc, BLOCK_PACKED, pack);
+	if (sa_new == SECTOR_NULL)
+		return;
+	for (i = 0; i < pack->hdr.ph_cnt; ++i)
+		if (ba[i] != BLOCK_INVALID)
+			sec_remap(sc, ba[i], SA_FRAG(sa, i), SA_FRAG(sa_new, i));
+}
+
+/*
+Description:
+    Move the live sectors of segment @sega to the log head
+*/
+static void
+zone_clean_seg(struct g_logstor_softc *sc, uint32_t sega, struct _seg_sum *seg_sum, void *buf)
+{
+
+	MY_ASSERT(sega != sc->superblock.seg_allocp);
+	if (!seg_sum_read(sc, sega, seg_sum)) {
+		printf("%s: segment summary %u checksum error\n", __func__, sega);
+		MY_PANIC();
+	}
+	for (uint32_t i = seg_log_start(sega); i < SEG_SUM_OFFSET; ++i) {
+		uint32_t sa = sega2sa(sega) + i;
+		uint32_t ba = seg_sum->ss_rm[i];
+
+		fbuf_clean_queue_check(sc);
+		if (!is_sec_valid(sc, sa, ba))
+			continue;
+		if (IS_FBUF_ADDR(ba)) {
+			// it is written to the log head by the checkpoint
+			fbuf_dirty(sc, fbuf_access(sc, (union fbuf_addr)ba));
+			continue;
+		}
+		if (ba == BLOCK_WARM) {
+			// the warm state is dropped by the checkpoint
+			sc->superblock.warm_sa = SECTOR_NULL;
+			continue;
+		}
+		my_read(sc, buf, sa, LOGSTOR_IO_DATA);
+		sec_csum_check(sc, buf, sa);
+		if (ba == BLOCK_PACKED)
+			sec_reloc_pack(sc, sa, buf);
+		else {
+			if (IS_BLOCK_SNAP(ba))
+				ba -= BLOCK_SNAP;
+			sec_remap(sc, ba, sa,
+			    sec_reloc_write(sc, sec_reloc_rev(sc, ba, sa), buf));
+		}
+	}
+}
+
+/*
+Description:
+    Clean the segments until there are @free_min free segments
+    A round of cleaning moves the live sectors of the segments while the
+    free segments left can take the checkpoint that ends the round. The
+    cleaning goes on to twice @free_min to amortize the checkpoint.
+*/
+static void
+zone_clean(struct g_logstor_softc *sc, uint32_t free_min)
+{
+	uint32_t ckpt_seg = howmany(sc->fbuf_count, BLOCKS_PER_SEG) + 1;
+	uint32_t seg_cnt = geom.seg_end - geom.seg_first;
+	uint32_t clean_cnt = 0;
+	struct _seg_sum *seg_sum;
+	char *buf;
+
+	seg_sum = malloc(sizeof(*seg_sum));
+	MY_ASSERT(seg_sum != NULL);
+	buf = malloc(SECTOR_SIZE);
+	MY_ASSERT(buf != NULL);
+	while (zone_free_cnt(sc) < free_min) {
+		uint32_t cnt = 0;
+
+		// moving the sectors of a segment may fill another one
+		while (zone_free_cnt(sc) > ckpt_seg + 1 &&
+		    seg_dist(sc, sc->superblock.seg_allocp, sc->zone_clean_sega) <= 2 * free_min &&
+		    seg_next(sc, sc->zone_clean_sega) != sc->superblock.seg_allocp) {
+			zone_clean_seg(sc, sc->zone_clean_sega, seg_sum, buf);
+			sc->zone_clean_sega = seg_next(sc, sc->zone_clean_sega);
+			++cnt;
+		}
+		clean_cnt += cnt;
+		if (cnt == 0 || clean_cnt > seg_cnt) {
+			printf("%s: no free zone, %u free zones\n", __func__,
+			    zone_free_cnt(sc));
+			MY_PANIC();
+		}
+		// the cleaned segments are free after this checkpoint
+		sc->superblock.zone_free_sega = sc->zone_clean_sega;
+		md_flush(sc);
+		sc->zone_free_sega = sc->zone_clean_sega;
+	}
+	free(buf);
+	free(seg_sum);
+}
+
+/*
+  Two tiers
+
+  A volume can span a fast disk and a larger capacity disk. The first
+  %tier_seg_cnt segments are on the fast tier and the log only goes round
+  them, so the new writes and all the metadata are on the fast tier. The
+  rest of the segments are the capacity tier, it is written by migration
+  only.
+
+  The segments ahead of the log head hold the oldest sectors of the log.
+  Their data sectors that are still live have survived a whole lap of the
+  fast tier and are cold, so they are migrated to the capacity tier before
+  the log head gets there. A round of migration moves the segments from
+  tier_mig_cnt() to twice that ahead of the log head and ends with a
+  checkpoint, after which the migrated sectors are free for the log head.
+  The migrated sectors are pinned until then like any superseded sector,
+  so a crash before the checkpoint only loses the copies on the capacity
+  tier. The metadata and the warm state stay on the fast tier.
+
+  The capacity tier is allocated like the log, its sectors are taken in
+  order skipping the live and the pinned ones, but it is not replayed by
+  roll forward. Its allocation pointer and its current segment summary
+  are saved by each checkpoint. When it is full the cold sectors stay on
+  the fast tier until a checkpoint frees its pinned sectors. A read goes to the tier
+  its sector address falls in. Deduplication is not supported since a
+  sector shared by blocks can't be moved without finding all the blocks.
+*/
+
+// the segments moved by a round of migration
+static uint32_t
+tier_mig_cnt(struct g_logstor_softc *sc __unused)
+{
+	return MAX(2, (geom.seg_end - geom.seg_first) / CKPT_SEG_RATIO);
+}
+
+static void
+tier_sum_read(struct g_logstor_softc *sc)
+{
+	uint32_t sega = sc->superblock.tier_seg_allocp;
+
+	if (!seg_sum_read(sc, sega, &sc->tier_sum)) {
+		printf("%s: segment summary %u checksum error\n", __func__, sega);
+		MY_PANIC();
+	}
+	seg_csum_load(sc, sega, &sc->tier_sum);
+	sc->tier_ss_modified = false;
+}
+
+static void
+tier_open(struct g_logstor_softc *sc)
+{
+
+	tier_sum_read(sc);
+	sc->tier_mig_sega = seg_next(sc, sc->superblock.seg_allocp);
+}
+
+// write out the segment summary of the capacity tier
+static void
+tier_sum_write(struct g_logstor_softc *sc)
+{
+
+	if (!sc->tier_ss_modified)
+		return;
+	sc->tier_sum.ss_allocp = sc->superblock.tier_ss_allocp;
+	sc->tier_sum.ss_gen = 0;
+	seg_sum_save(sc, sc->superblock.tier_seg_allocp, &sc->tier_sum);
+	sc->superblock.tier_seg_fresh = MAX(sc->superblock.tier_seg_fresh,
+	    sc->superblock.tier_seg_allocp + 1);
+	sc->tier_ss_modified = false;
+	sc->other_write_count += SEG_SUM_CNT;
+}
+
+/*
+Description:
+    Write the sector @data of @ba to the capacity tier
+
+Return:
+    the sector address where it is written, SECTOR_NULL if the tier is full
+*/
+static uint32_t
+tier_write(struct g_logstor_softc *sc, uint32_t ba, void *data)
+{
+	struct _seg_sum *seg_sum = &sc->tier_sum;
+	uint32_t sega_start = sc->superblock.tier_seg_allocp;
+	uint32_t sega, sa, i;
+
+	for (;;) {
+		sega = sc->superblock.tier_seg_allocp;
+		for (i = sc->superblock.tier_ss_allocp; i < SEG_SUM_OFFSET; ++i) {
+			sa = sega2sa(sega) + i;
+			if (is_sec_valid(sc, sa, seg_sum->ss_rm[i]) || is_sec_pinned(sc, sa))
+				continue;
+			seg_sum->ss_rm[i] = ba;
+			my_write(sc, data, sa, LOGSTOR_IO_DATA);
+			seg_sum->ss_csum[i] = sc->sec_csum[sa] = crc32c(0, data, SECTOR_SIZE);
+			sc->superblock.tier_ss_allocp = i + 1;
+			sc->tier_ss_modified = true;
+			++sc->other_write_count;
+			STATS_INC(tier_migrate);
+			return sa;
+		}
+		tier_sum_write(sc);
+		if (++sega == sc->superblock.seg_cnt)
+			sega = geom.seg_end;
+		sc->superblock.tier_seg_allocp = sega;
+		sc->superblock.tier_ss_allocp = 0;
+		tier_sum_read(sc);
+		if (sega == sega_start) {
+			sc->tier_full = true;
+			return SECTOR_NULL;
+		}
+	}
 }
 
 /*
-  write out the segment summary
-  segment summary is at the end of a segment
+Description:
+    Move the live data sectors of segment @sega to the capacity tier
+    until it is full
 */
 static void
-seg_sum_write(struct g_logstor_softc *sc)
+tier_migrate_seg(struct g_logstor_softc *sc, uint32_t sega, struct _seg_sum *seg_sum, void *buf)
 {
-	uint32_t sa;
 
-	if (!sc->ss_modified)
-		return;
-	sa = sc->seg_allocp_sa + SEG_SUM_OFFSET;
-	my_write(sc, (void *)&sc->seg_sum, sa);
-	sc->ss_modified = false;
-	sc->other_write_count++; // the write for the segment summary
+	MY_ASSERT(sega != sc->superblock.seg_allocp);
+	if (!seg_sum_read(sc, sega, seg_sum)) {
+		printf("%s: segment summary %u checksum error\n", __func__, sega);
+		MY_PANIC();
+	}
+	for (uint32_t i = seg_log_start(sega); i < SEG_SUM_OFFSET; ++i) {
+		uint32_t sa = sega2sa(sega) + i;
+		uint32_t ba = seg_sum->ss_rm[i];
+		uint32_t sa_new;
+
+		if ((ba >= BLOCK_MAX && ba != BLOCK_PACKED) || !is_sec_valid(sc, sa, ba))
+			continue;
+		fbuf_clean_queue_check(sc);
+		my_read(sc, buf, sa, LOGSTOR_IO_DATA);
+		sec_csum_check(sc, buf, sa);
+		if (ba == BLOCK_PACKED)
+			sec_reloc_pack(sc, sa, buf);
+		else if ((sa_new = sec_reloc_write(sc, ba, buf)) != SECTOR_NULL)
+			sec_remap(sc, ba, sa, sa_new);
+		if (sc->tier_full)
+			break;
+	}
 }
 
 /*
-  Segment 0 is used to store superblock so there are SECTORS_PER_SEG sectors
-  for storing superblock. Each time the superblock is synced, it is stored
-  in the next sector. When it reachs the end of segment 0, it wraps around
-  to sector 0.
+Description:
+    Migrate the segments ahead of the log head, see "Two tiers"
 */
-static int
-superblock_read(struct g_logstor_softc *sc)
+static void
+tier_migrate(struct g_logstor_softc *sc)
 {
-	typeof(sc->superblock.sb_gen) sb_gen;
-	int i, error;
-	struct _superblock *sb;
-	char buf[2][SECTOR_SIZE];
-
-	// get the superblock
-	sb = (struct _superblock *)buf[0];
-	memcpy(sb, ram_disk, SECTOR_SIZE);
-	if (sb->magic != G_LOGSTOR_MAGIC ||
-	    sb->seg_allocp >= sb->seg_cnt) {
-		error = EINVAL;
-		goto exit;
-	}
-	sb_gen = sb->sb_gen;
-	for (i = 1 ; i < SB_CNT; i++) {
-		sb = (struct _superblock *)buf[i%2];
-		memcpy(sb, ram_disk + i * SECTOR_SIZE, SECTOR_SIZE);
-		if (sb->magic != G_LOGSTOR_MAGIC)
-			break;
-		if (sb->sb_gen != sb_gen + 1)
+	uint32_t head = sc->superblock.seg_allocp;
+	uint32_t mig_cnt = tier_mig_cnt(sc);
+	uint32_t cnt = 0;
+	struct _seg_sum *seg_sum;
+	char *buf;
+
+	// the log head has got to the segments not migrated
+	if (sc->tier_mig_sega == head || seg_dist(sc, head, sc->tier_mig_sega) > 2 * mig_cnt)
+		sc->tier_mig_sega = seg_next(sc, head);
+	seg_sum = malloc(sizeof(*seg_sum));
+	MY_ASSERT(seg_sum != NULL);
+	buf = malloc(SECTOR_SIZE);
+	MY_ASSERT(buf != NULL);
+	sc->tier_mig = true;
+	for (;;) {
+		// writing back the metadata may move the log head
+		uint32_t dist;
+
+		head = sc->superblock.seg_allocp;
+		dist = seg_dist(sc, head, sc->tier_mig_sega);
+		if (dist == 0 || dist > 2 * mig_cnt || seg_next(sc, sc->tier_mig_sega) == head)
 			break;
-		sb_gen = sb->sb_gen;
-	}
-	if (i == SECTORS_PER_SEG) {
-		error = EINVAL;
-		goto exit;
-	}
-	sc->sb_sa = (i - 1);
-	sb = (struct _superblock *)buf[(i-1)%2]; // get the previous valid superblock
-	if (sb->seg_allocp >= sb->seg_cnt) {
-		error = EINVAL;
-		goto exit;
+		// the cold sectors stay on the fast tier when the capacity tier is full
+		if (!sc->tier_full) {
+			tier_migrate_seg(sc, sc->tier_mig_sega, seg_sum, buf);
+			++cnt;
+		}
+		sc->tier_mig_sega = seg_next(sc, sc->tier_mig_sega);
 	}
-	for (i=0; i<FD_COUNT; ++i)
-		MY_ASSERT(sb->fh[i].root != SECTOR_CACHE);
-	memcpy(&sc->superblock, sb, sizeof(sc->superblock));
-	sc->sb_modified = false;
-	error = 0;
-exit:
-	return error;
+	sc->tier_mig = false;
+	free(buf);
+	free(seg_sum);
+	// the migrated sectors are free after this checkpoint
+	if (cnt != 0)
+		md_flush(sc);
 }
 
+/*
+Description:
+    Roll forward from the checkpoint in the superblock
+
+    Starting from the checkpointed log position, the segments written after
+    the checkpoint are those with consecutive generation numbers. Their
+    reverse maps are replayed to the forward map in the same order they
+    were written.
+
+    A sector in the replayed range is either written after the checkpoint
+    or is skipped by _logstor_write() because it was still valid, so only
+    the sectors that are not valid are replayed. This is the same test
+    _logstor_write() uses to choose the sector to write. A sector skipped
+    because it is pinned has its reverse map removed by _logstor_write().
+
+    Metadata sectors are not replayed since the forward map is rebuilt from
+    the data sectors. The trim commands after the checkpoint are lost.
+
+    A segment summary with a bad checksum ends the log. The replay stops
+    at the first data sector with a bad checksum since the writes after
+    it can't be trusted either.
+*/
 static void
-superblock_write(struct g_logstor_softc *sc)
+logstor_roll_forward(struct g_logstor_softc *sc)
 {
-	size_t sb_size = sizeof(sc->superblock);
-	char buf[SECTOR_SIZE];
+	struct _seg_sum *seg_sum;
+	uint32_t sega, gen, ss_start, seg_cnt, end_allocp;
+	uint32_t ckpt_sega = sc->superblock.seg_allocp;
+	uint32_t ckpt_allocp = sc->superblock.ss_allocp;
+	unsigned replay_cnt;
+	char *buf;
+
+	seg_sum = malloc(sizeof(*seg_sum));
+	MY_ASSERT(seg_sum != NULL);
+	buf = malloc(SECTOR_SIZE);
+	MY_ASSERT(buf != NULL);
+
+	// find the end of the log
+	sega = ckpt_sega;
+	gen = sc->superblock.seg_gen;
+	end_allocp = ckpt_allocp;
+	for (seg_cnt = 0; seg_cnt < sc->superblock.seg_cnt; ++seg_cnt) {
+		if (!seg_sum_read(sc, sega, seg_sum) ||
+		    seg_sum->ss_gen != (gen & SEG_GEN_MASK))
+			break;
+		end_allocp = MAX(seg_sum->ss_allocp, end_allocp);
+		if (end_allocp != SEG_SUM_OFFSET)
+			break;
+		sega = seg_next(sc, sega);
+		++gen;
+		end_allocp = seg_log_start(sega);
+	}
+	// new data are appended from the end of the log
+	sc->superblock.seg_allocp = sega;
+	sc->superblock.seg_gen = gen;
+	sc->ss_allocp = end_allocp;
+	sc->seg_allocp_sa = sega2sa(sega);
+	seg_sum_cur_read(sc);
+	sc->ss_modified = false;
+	if (geom.zoned) {
+		// the sectors written after the last segment summary are lost
+		// but the zone takes the writes at its write pointer only
+		sc->ss_allocp = MAX(end_allocp, MIN(zone_wp_get(sega), SEG_SUM_OFFSET));
+		for (uint32_t i = end_allocp; i < sc->ss_allocp; ++i)
+			sc->seg_sum.ss_rm[i] = BLOCK_INVALID;
+		sc->ss_modified = sc->ss_allocp != end_allocp;
+	}
 
-	//if (!sc->sb_modified)
-	//	return;
+	// replay the segments from the checkpoint to the end of the log
+	replay_cnt = 0;
+	sega = ckpt_sega;
+	ss_start = ckpt_allocp;
+	for (uint32_t n = 0; n <= seg_cnt; ++n) {
+		uint32_t ss_end;
+
+		seg_sum_read(sc, sega, seg_sum);
+		ss_end = n == seg_cnt ? end_allocp : SEG_SUM_OFFSET;
+		for (uint32_t i = ss_start; i < ss_end; ++i) {
+			uint32_t sa = sega2sa(sega) + i;
+			uint32_t ba = seg_sum->ss_rm[i];
+
+			if (ba >= BLOCK_MAX && ba != BLOCK_PACKED) // metadata or unused sector
+				continue;
+			fbuf_clean_queue_check(sc);
+			my_read(sc, buf, sa, LOGSTOR_IO_DATA);
+			if (crc32c(0, buf, SECTOR_SIZE) != seg_sum->ss_csum[i]) {
+				printf("%s: sector %u checksum error, replay stopped\n",
+				    __func__, sa);
+				goto end;
+			}
+			if (is_sec_valid(sc, sa, ba))
+				continue;
+			if (ba == BLOCK_PACKED)
+				replay_cnt += pack_replay(sc, sa, (union _pack_sec *)buf);
+			else {
+				file_write_4byte(sc, sc->superblock.fd_cur, ba, sa);
+				++replay_cnt;
+			}
+		}
+		sega = seg_next(sc, sega);
+		ss_start = seg_log_start(sega);
+	}
+end:
+	free(buf);
+	free(seg_sum);
 
-	for (int i = 0; i < FD_COUNT; ++i) {
-		MY_ASSERT(sc->superblock.fh[i].root != SECTOR_CACHE);
+	if (replay_cnt != 0) {
+#if defined(MY_DEBUG)
+		printf("%s: %u blocks replayed\n", __func__, replay_cnt);
+#endif
+		md_flush(sc);	// make a new checkpoint
 	}
-	sc->superblock.sb_gen++;
-	if (++sc->sb_sa == SB_CNT)
-		sc->sb_sa = 0;
-	memcpy(buf, &sc->superblock, sb_size);
-	memset(buf + sb_size, 0, SECTOR_SIZE - sb_size);
-	my_write(sc, buf, sc->sb_sa);
-	sc->sb_modified = false;
-	sc->other_write_count++;
 }
 
-static void
-my_read(struct g_logstor_softc *sc, void *buf, uint32_t sa)
+static bool
+is_warm_valid(struct g_logstor_softc *sc, uint32_t sa)
 {
-//MY_BREAK(sa == );
-	MY_ASSERT(sc == NULL || sa < sc->superblock.seg_cnt * SECTORS_PER_SEG);
-	memcpy(buf, ram_disk + (off_t)sa * SECTOR_SIZE, SECTOR_SIZE);
+
+	for (int i = 0; i < sc->warm_sec_cnt; ++i)
+		if (sc->warm_sec[i] == sa)
+			return true;
+	return false;
 }
 
+/*
+Description:
+    Write the warm state for the next open, see "Warm restart"
+    It is not written during a snapshot since the next open has to
+    rebuild the references of the merged files anyway.
+*/
 static void
-my_write(struct g_logstor_softc *sc, const void *buf, uint32_t sa)
+warm_save(struct g_logstor_softc *sc)
 {
-//MY_BREAK(sa == );
-	MY_ASSERT(sc == NULL || sa < sc->superblock.seg_cnt * SECTORS_PER_SEG);
-	memcpy(ram_disk + (off_t)sa * SECTOR_SIZE , buf, SECTOR_SIZE);
+	struct _warm_hdr *hdr;
+	struct _dedup_ref *ref;
+	uint32_t *body;
+	uint32_t leaf_max = sc->fbuf_count * 3 / 4;
+	uint32_t leaf_cnt = 0, ref_cnt = 0, word_cnt, sec_cnt;
+
+	sc->superblock.warm_sa = SECTOR_NULL;
+	sc->warm_sec_cnt = 0;
+	if (sc->superblock.fd_prev != FD_INVALID)
+		return;
+
+	for (int i = 0; i < DEDUP_REF_BUCKET_CNT; ++i)
+		LIST_FOREACH(ref, &sc->dedup_ref_ba[i], ba_link)
+			++ref_cnt;
+	word_cnt = leaf_max + ref_cnt * 2;
+	body = calloc(howmany(word_cnt, SECTOR_SIZE / 4), SECTOR_SIZE);
+	MY_ASSERT(body != NULL);
+
+	// the accessed leaves first so they are read first
+	for (int pass = 0; pass < 2; ++pass)
+		for (int i = 0; i < sc->fbuf_count && leaf_cnt < leaf_max; ++i) {
+			struct _fbuf *fbuf = &sc->fbufs[i];
+			union fbuf_addr ma = fbuf->ma;
+
+			if (ma.uint32 == BLOCK_INVALID || ma.depth != FBUF_LEAF_DEPTH ||
+			    fbuf->fc.accessed != (pass == 0))
+				continue;
+			if (ma.fd != sc->superblock.fd_cur && ma.fd != sc->superblock.fd_snap)
+				continue;
+			body[leaf_cnt++] = ma.uint32;
+		}
+	word_cnt = leaf_cnt + ref_cnt * 2;
+	if (howmany(word_cnt, SECTOR_SIZE / 4) > WARM_SEC_MAX) {
+		ref_cnt = WARM_NO_REF;
+		word_cnt = leaf_cnt;
+	} else {
+		uint32_t *p = &body[leaf_cnt];
+
+		for (int i = 0; i < DEDUP_REF_BUCKET_CNT; ++i)
+			LIST_FOREACH(ref, &sc->dedup_ref_ba[i], ba_link) {
+				*p++ = ref->sa;
+				*p++ = ref->ba;
+			}
+	}
+	sec_cnt = howmany(word_cnt, SECTOR_SIZE / 4);
+
+	hdr = calloc(1, sizeof(*hdr));
+	MY_ASSERT(hdr != NULL);
+	hdr->wh_magic = WARM_MAGIC;
+	hdr->wh_leaf_cnt = leaf_cnt;
+	hdr->wh_ref_cnt = ref_cnt;
+	hdr->wh_sec_cnt = sec_cnt;
+	for (uint32_t i = 0; i < sec_cnt; ++i) {
+		hdr->wh_sa[i] = _logstor_write(sc, BLOCK_WARM, &body[i * (SECTOR_SIZE / 4)]);
+		sc->warm_sec[sc->warm_sec_cnt++] = hdr->wh_sa[i];
+	}
+	sc->superblock.warm_sa = _logstor_write(sc, BLOCK_WARM, hdr);
+	sc->warm_sec[sc->warm_sec_cnt++] = sc->superblock.warm_sa;
+	free(hdr);
+	free(body);
 }
 
 /*
 Description:
-  Allocate a segment for writing
+    Load the warm state written by the last close, see "Warm restart"
 
-Output:
-  Store the segment address into @seg_sum->sega
-  Initialize @seg_sum->sum.alloc_p to 0
+Return:
+    true if the deduplication references are loaded
 */
-static void
-seg_alloc(struct g_logstor_softc *sc)
+static bool
+warm_load(struct g_logstor_softc *sc)
 {
+	struct _warm_hdr *hdr;
+	uint32_t *body;
+	uint32_t *p;
+	bool ref_loaded;
+
+	sc->warm_sec_cnt = 0;
+	sc->warm_leaf = NULL;
+	sc->warm_leaf_cnt = 0;
+	if (sc->superblock.warm_sa == SECTOR_NULL)
+		return false;
 
-	// write the previous segment summary to disk if it has been modified
-	seg_sum_write(sc);
+	hdr = malloc(sizeof(*hdr));
+	MY_ASSERT(hdr != NULL);
+	my_read(sc, hdr, sc->superblock.warm_sa, LOGSTOR_IO_DATA);
+	sec_csum_check(sc, hdr, sc->superblock.warm_sa);
+	MY_ASSERT(hdr->wh_magic == WARM_MAGIC);
+	MY_ASSERT(hdr->wh_sec_cnt <= WARM_SEC_MAX);
+	body = malloc(hdr->wh_sec_cnt * SECTOR_SIZE + 1);
+	MY_ASSERT(body != NULL);
+	for (uint32_t i = 0; i < hdr->wh_sec_cnt; ++i) {
+		my_read(sc, &body[i * (SECTOR_SIZE / 4)], hdr->wh_sa[i], LOGSTOR_IO_DATA);
+		sec_csum_check(sc, &body[i * (SECTOR_SIZE / 4)], hdr->wh_sa[i]);
+		sc->warm_sec[sc->warm_sec_cnt++] = hdr->wh_sa[i];
+	}
+	sc->warm_sec[sc->warm_sec_cnt++] = sc->superblock.warm_sa;
+
+	sc->warm_leaf_cnt = hdr->wh_leaf_cnt;
+	sc->warm_leaf = malloc(sc->warm_leaf_cnt * sizeof(uint32_t) + 1);
+	MY_ASSERT(sc->warm_leaf != NULL);
+	memcpy(sc->warm_leaf, body, sc->warm_leaf_cnt * sizeof(uint32_t));
+	ref_loaded = hdr->wh_ref_cnt != WARM_NO_REF;
+	p = &body[hdr->wh_leaf_cnt];
+	for (uint32_t i = 0; ref_loaded && i < hdr->wh_ref_cnt; ++i, p += 2)
+		dedup_ref_add(sc, p[0], p[1]);
+#if defined(MY_DEBUG)
+	printf("%s: %u leaves, %d references\n", __func__,
+	    hdr->wh_leaf_cnt, ref_loaded ? (int)hdr->wh_ref_cnt : -1);
+#endif
+	// the next checkpoint drops it
+	sc->superblock.warm_sa = SECTOR_NULL;
+	free(body);
+	free(hdr);
+	return ref_loaded;
+}
 
-	MY_ASSERT(sc->superblock.seg_allocp < sc->superblock.seg_cnt);
-	if (++sc->superblock.seg_allocp == sc->superblock.seg_cnt) {
-		sc->superblock.seg_allocp = 0;
-		sc->ss_allocp = SB_CNT; // the first SB_CNT sectors are superblock
-	} else
-		sc->ss_allocp = 0;
+// read the leaves of the warm state into the fbuf cache
+static void
+warm_prefetch(struct g_logstor_softc *sc)
+{
 
-	if (sc->superblock.seg_allocp == sc->seg_allocp_start)
-		// has accessed all the segment summary blocks
-		MY_PANIC();
-	// read reverse map
-	sc->seg_allocp_sa = sega2sa(sc->superblock.seg_allocp);
-	my_read(sc, &sc->seg_sum, sc->seg_allocp_sa + SEG_SUM_OFFSET);
+	for (uint32_t i = 0; i < sc->warm_leaf_cnt; ++i) {
+		union fbuf_addr ma = {.uint32 = sc->warm_leaf[i]};
+		uint32_t root = sc->superblock.fh[ma.fd].root;
+
+		if (ma.fd != sc->superblock.fd_cur && ma.fd != sc->superblock.fd_snap)
+			continue;
+		if (root == SECTOR_NULL || root == SECTOR_DEL)
+			continue;
+		fbuf_clean_queue_check(sc);
+		fbuf_access(sc, ma);
+	}
+	free(sc->warm_leaf);
+	sc->warm_leaf = NULL;
+	sc->warm_leaf_cnt = 0;
 }
 
 /*********************************************************
@@ -998,7 +4698,7 @@ file_read_4byte(struct g_logstor_softc *sc, uint8_t fd, uint32_t ba)
 
 	fbuf = file_access_4byte(sc, fd, ba * 4, &eidx);
 	if (fbuf)
-		sa = fbuf->data[eidx] & 0x7fffffff;
+		sa = fbuf->data[eidx] & ~SA_RSVD;
 	else
 		sa = SECTOR_NULL;
 	return sa;
@@ -1012,12 +4712,16 @@ Parameters:
 	%fd: file descriptor
 	%ba: block address
 	%sa: sector address
+
+Return:
+	The old sector address of the @ba
 */
-static void
+static uint32_t
 file_write_4byte(struct g_logstor_softc *sc, uint8_t fd, uint32_t ba, uint32_t sa)
 {
 	struct _fbuf *fbuf;
 	uint32_t eidx;	// the offset in 4 bytes within the file buffer data
+	uint32_t sa_old;
 
 	MY_ASSERT(fd < FD_COUNT);
 	MY_ASSERT(ba < BLOCK_MAX);
@@ -1025,17 +4729,31 @@ file_write_4byte(struct g_logstor_softc *sc, uint8_t fd, uint32_t ba, uint32_t s
 
 	fbuf = file_access_4byte(sc, fd, ba * 4, &eidx);
 	MY_ASSERT(fbuf != NULL);
+	sa_old = fbuf->data[eidx] & ~SA_RSVD;
 	fbuf->data[eidx] = sa;
+	sec_pin(sc, sa_old & SA_MASK);
 	if (!fbuf->fc.modified) {
-		// move to QUEUE_F0_DIRTY
 		MY_ASSERT(fbuf->queue_which == QUEUE_F0_CLEAN);
-		fbuf->fc.modified = true;
+		fbuf_dirty(sc, fbuf);
+	} else
+		MY_ASSERT(fbuf->queue_which == QUEUE_F0_DIRTY);
+	return sa_old;
+}
+
+// mark @fbuf modified, a leaf is moved to QUEUE_F0_DIRTY
+static void
+fbuf_dirty(struct g_logstor_softc *sc, struct _fbuf *fbuf)
+{
+
+	if (fbuf->fc.modified)
+		return;
+	fbuf->fc.modified = true;
+	if (fbuf->queue_which == QUEUE_F0_CLEAN) {
 		if (fbuf == sc->fbuf_allocp)
 			sc->fbuf_allocp = fbuf->fc.queue_next;
 		fbuf_queue_remove(sc, fbuf);
 		fbuf_queue_insert_head(sc, QUEUE_F0_DIRTY, fbuf);
-	} else
-		MY_ASSERT(fbuf->queue_which == QUEUE_F0_DIRTY);
+	}
 }
 
 
@@ -1168,20 +4886,16 @@ ma2sa(struct g_logstor_softc *sc, union fbuf_addr ma)
 }
 
 /*
-  Initialize metadata file buffer
+  Initialize metadata file buffer with @fbuf_count buffers
+  logstor_open() uses FBUF_MIN, logsmicro uses other sizes to measure
+  the cache
 */
 static void
-fbuf_mod_init(struct g_logstor_softc *sc)
+fbuf_mod_init(struct g_logstor_softc *sc, int fbuf_count)
 {
-	int fbuf_count;
 	int i;
 
-	//fbuf_count = sc.superblock.block_cnt / (SECTOR_SIZE / 4);
-	fbuf_count = FBUF_MIN;
-	if (fbuf_count < FBUF_MIN)
-		fbuf_count = FBUF_MIN;
-	if (fbuf_count > FBUF_MAX)
-		fbuf_count = FBUF_MAX;
+	MY_ASSERT(fbuf_count > FBUF_CLEAN_THRESHOLD * 2);
 	sc->fbuf_count = fbuf_count;
 	sc->fbufs = malloc(fbuf_count * sizeof(*sc->fbufs));
 	MY_ASSERT(sc->fbufs != NULL);
@@ -1211,16 +4925,51 @@ fbuf_mod_init(struct g_logstor_softc *sc)
 		fbuf_bucket_insert_head(sc, FBUF_BUCKET_LAST, fbuf);
 	}
 	sc->fbuf_allocp = &sc->fbufs[0];;
+	sc->fbuf_wb_active = false;
 	sc->fbuf_hit = sc->fbuf_miss = 0;
 }
 
-// there are 3 kinds of metadata in the system, the fbuf cache, segment summary block and superblock
+/*
+  there are 3 kinds of metadata in the system, the fbuf cache, segment summary block and superblock
+  flushing all of them makes a checkpoint
+
+  the fbuf cache is flushed first since writing it changes both the
+  segment summary and the superblock
+*/
 static void
 md_flush(struct g_logstor_softc *sc)
 {
-	seg_sum_write(sc);
+	uint64_t start = stats_time();
+
 	fbuf_cache_flush(sc);
+	seg_sum_write(sc);
+	if (geom.tiered)
+		tier_sum_write(sc);
 	superblock_write(sc);
+	trace(LOGSTOR_EV_MD_FLUSH, 0, 0, sc->sb_sa, start, stats_time());
+	trace_flag(LOGSTOR_TF_MD_FLUSH);
+}
+
+/*
+  Make a checkpoint after 1/CKPT_SEG_RATIO of the segments have been allocated.
+  This bounds both the time to roll forward and the sectors pinned by the checkpoint.
+  In zoned mode the segments are cleaned once the free ones run low, which
+  makes checkpoints too. With two tiers the segments are migrated before
+  the log head gets to them, also with a checkpoint.
+  Not during snapshot since the files used by the snapshot are not consistent yet
+*/
+static void
+md_checkpoint_check(struct g_logstor_softc *sc)
+{
+	if (sc->superblock.fd_prev != FD_INVALID)
+		return;
+	if (geom.zoned && zone_free_cnt(sc) < zone_free_min(sc->fbuf_count))
+		zone_clean(sc, zone_free_min(sc->fbuf_count));
+	else if (geom.tiered &&
+	    seg_dist(sc, sc->superblock.seg_allocp, sc->tier_mig_sega) < tier_mig_cnt(sc))
+		tier_migrate(sc);
+	else if (sc->ckpt_seg_cnt >= sc->superblock.seg_cnt / CKPT_SEG_RATIO)
+		md_flush(sc);
 }
 
 static void
@@ -1246,10 +4995,15 @@ fbuf_clean_queue_check(struct g_logstor_softc *sc)
 	struct _fbuf_sentinel *queue_sentinel;
 	struct _fbuf *fbuf;
 
+	fbuf_writeback(sc);
 	if (sc->fbuf_queue_len[QUEUE_F0_CLEAN] > FBUF_CLEAN_THRESHOLD)
 		return;
 
-	md_flush(sc);
+	// only the fbufs are written back, the superblock is written at the checkpoint
+	uint64_t start = stats_time();
+	fbuf_cache_flush(sc);
+	trace(LOGSTOR_EV_CACHE_FLUSH, 0, 0, 0, start, stats_time());
+	trace_flag(LOGSTOR_TF_CACHE_FLUSH);
 
 	// move all internal nodes with child_cnt 0 to clean queue and last bucket
 	for (int q = QUEUE_F1; q < QUEUE_CNT; ++q) {
@@ -1280,6 +5034,54 @@ fbuf_clean_queue_check(struct g_logstor_softc *sc)
 	}
 }
 
+/*
+Description:
+    Write back the dirty leaves incrementally
+
+    Once the number of dirty leaves exceeds the high watermark, at most
+    FBUF_WB_BATCH of the oldest dirty leaves are written back for each
+    operation until it drops to the low watermark. The parents modified
+    by the leaves are written back at the checkpoint, so a parent is
+    written once for many leaves.
+
+    This keeps the clean queue from running out and the latency of
+    flushing the whole cache off the user operations.
+*/
+static void
+fbuf_writeback(struct g_logstor_softc *sc)
+{
+	struct _fbuf_sentinel *dirty_sentinel;
+	struct _fbuf *fbuf;
+
+	if (!sc->fbuf_wb_active) {
+		if (sc->fbuf_queue_len[QUEUE_F0_DIRTY] * 100 < sc->fbuf_count * FBUF_DIRTY_HIGH)
+			return;
+		sc->fbuf_wb_active = true;
+	}
+	uint64_t start = stats_time();
+	int i;
+
+	dirty_sentinel = &sc->fbuf_queue[QUEUE_F0_DIRTY];
+	for (i = 0; i < FBUF_WB_BATCH; ++i) {
+		if (sc->fbuf_queue_len[QUEUE_F0_DIRTY] * 100 <= sc->fbuf_count * FBUF_DIRTY_LOW) {
+			sc->fbuf_wb_active = false;
+			break;
+		}
+		// the fbuf at the tail has been dirty for the longest time
+		fbuf = dirty_sentinel->fc.queue_prev;
+		MY_ASSERT(fbuf->queue_which == QUEUE_F0_DIRTY);
+		MY_ASSERT(fbuf->fc.modified);
+		fbuf_write(sc, fbuf);
+		fbuf_queue_remove(sc, fbuf);
+		fbuf_queue_insert_head(sc, QUEUE_F0_CLEAN, fbuf);
+	}
+	if (i > 0) {
+		// the number of leaves written back is traced as the sa
+		trace(LOGSTOR_EV_FBUF_WB, 0, 0, i, start, stats_time());
+		trace_flag(LOGSTOR_TF_FBUF_WB);
+	}
+}
+
 // write back all the dirty fbufs to disk
 static void
 fbuf_cache_flush(struct g_logstor_softc *sc)
@@ -1508,10 +5310,11 @@ fbuf_bucket_remove(struct _fbuf *fbuf)
 
 /*
 Description:
-    Search the file buffer with the tag value of @ma. Return NULL if not found
+    Find the file buffer with the tag value of @ma without counting
+    the hit or miss. Return NULL if not found
 */
 static struct _fbuf *
-fbuf_search(struct g_logstor_softc *sc, union fbuf_addr ma)
+fbuf_find(struct g_logstor_softc *sc, union fbuf_addr ma)
 {
 	unsigned	hash;	// hash value
 	struct _fbuf	*fbuf;
@@ -1523,13 +5326,32 @@ fbuf_search(struct g_logstor_softc *sc, union fbuf_addr ma)
 	bucket_sentinel = &sc->fbuf_bucket[hash];
 	fbuf = bucket_sentinel->fc.queue_next;
 	while (fbuf != (struct _fbuf *)bucket_sentinel) {
-		if (fbuf->ma.uint32 == ma.uint32) { // cache hit
-			++sc->fbuf_hit;
+		if (fbuf->ma.uint32 == ma.uint32)
 			return fbuf;
-		}
 		fbuf = fbuf->bucket_next;
 	}
+	return NULL;
+}
+
+/*
+Description:
+    Search the file buffer with the tag value of @ma. Return NULL if not found
+*/
+static struct _fbuf *
+fbuf_search(struct g_logstor_softc *sc, union fbuf_addr ma)
+{
+	struct _fbuf	*fbuf;
+
+	fbuf = fbuf_find(sc, ma);
+	if (fbuf != NULL) { // cache hit
+		++sc->fbuf_hit;
+		STATS_INC(fbuf_hit);
+		return fbuf;
+	}
+	struct _thread_stats *ts = thread_stats_get();
 	++sc->fbuf_miss;
+	++ts->st.fbuf_miss;
+	trace_miss(ts);
 	return NULL;	// cache miss
 }
 
@@ -1567,6 +5389,7 @@ again:
 	MY_ASSERT(!fbuf->fc.modified);
 	MY_ASSERT(fbuf->child_cnt == 0);
 	sc->fbuf_allocp = fbuf->fc.queue_next;
+	fbuf->fc.prefetched = false;
 	if (depth != FBUF_LEAF_DEPTH) {
 		// for fbuf allocated for internal nodes insert it immediately
 		// to its internal queue
@@ -1594,7 +5417,7 @@ static struct _fbuf *
 fbuf_access(struct g_logstor_softc *sc, union fbuf_addr ma)
 {
 	uint32_t sa;	// sector address where the metadata is stored
-	unsigned index;
+	unsigned index = 0;	// index in the parent, set before there is a parent
 	union fbuf_addr	ima;	// the intermediate metadata address
 	struct _fbuf *parent;	// parent buffer
 	struct _fbuf *fbuf;
@@ -1619,6 +5442,8 @@ fbuf_access(struct g_logstor_softc *sc, union fbuf_addr ma)
 		ima.depth = i;
 		fbuf = fbuf_search(sc, ima);
 		if (fbuf == NULL) {
+			uint64_t start = stats_time();
+
 			fbuf = fbuf_alloc(sc, ima, i);	// allocate a fbuf from clean queue
 			fbuf->parent = parent;
 			if (parent) {
@@ -1635,8 +5460,12 @@ fbuf_access(struct g_logstor_softc *sc, union fbuf_addr ma)
 					sc->superblock.fh[ma.fd].root = SECTOR_CACHE;
 			} else {
 				MY_ASSERT(sa >= SB_CNT);
-				my_read(sc, fbuf->data, sa);
+				my_read(sc, fbuf->data, sa, LOGSTOR_IO_FBUF);
+				sec_csum_check(sc, fbuf->data, sa);
 			}
+			uint64_t end = stats_time();
+			logstor_hist_add(&stats_get()->lat[LOGSTOR_OP_FBUF_MISS], end - start);
+			trace(LOGSTOR_OP_FBUF_MISS, i, ima.uint32, sa, start, end);
 #if defined(MY_DEBUG)
 			fbuf->sa = sa;
 			if (parent)
@@ -1657,9 +5486,116 @@ fbuf_access(struct g_logstor_softc *sc, union fbuf_addr ma)
 	} // for
 end:
 	fbuf->fc.accessed = true;
+	if (fbuf->fc.prefetched) {
+		fbuf->fc.prefetched = false;
+		STATS_INC(fbuf_prefetch_hit);
+	}
 	return fbuf;
 }
 
+// read the leaf for block @ba of the files of the forward map ahead
+static void
+fbuf_prefetch_leaf(struct g_logstor_softc *sc, uint32_t ba)
+{
+	uint8_t fd[] = {
+	    sc->superblock.fd_cur,
+	    sc->superblock.fd_prev,
+	    sc->superblock.fd_snap,
+	};
+	union fbuf_addr ma = {.meta = 0x7F};
+	struct _fbuf *fbuf;
+
+	ma.index = ba / (SECTOR_SIZE/4);
+	ma.depth = FBUF_LEAF_DEPTH;
+	for (int i = 0; i < NUM_OF_ELEMS(fd); ++i) {
+		if (fd[i] == FD_INVALID)
+			continue;
+		if (sc->superblock.fh[fd[i]].root == SECTOR_NULL ||
+		    sc->superblock.fh[fd[i]].root == SECTOR_DEL)
+			continue;
+		ma.fd = fd[i];
+		if (fbuf_find(sc, ma) != NULL)
+			continue;
+		fbuf_clean_queue_check(sc);
+		fbuf = fbuf_access(sc, ma);
+		// it is replaced first if the stream does not come
+		fbuf->fc.accessed = false;
+		fbuf->fc.prefetched = true;
+		STATS_INC(fbuf_prefetch);
+	}
+}
+
+/*
+Description:
+    Match the read of block @ba to a stream and read the leaves ahead of
+    it, see "Forward map prefetch"
+*/
+static void
+fbuf_prefetch(struct g_logstor_softc *sc, uint32_t ba)
+{
+	struct _pf_stream *s;
+	int64_t dist, step, limit;
+	int i;
+
+	for (i = 0; i < PF_STREAM_CNT; ++i) {
+		s = &sc->pf_stream[i];
+		if (ba == s->last_ba)
+			return;
+		if (s->stride != 0 && ba == (uint32_t)(s->last_ba + s->stride))
+			break;
+	}
+	if (i < PF_STREAM_CNT) {
+		// the stream goes on
+		++s->hits;
+		if (ba / (SECTOR_SIZE/4) != s->last_ba / (SECTOR_SIZE/4) &&
+		    s->window < PF_WINDOW_MAX)
+			s->window *= 2;
+	} else {
+		for (i = 0; i < PF_STREAM_CNT; ++i) {
+			s = &sc->pf_stream[i];
+			dist = (int64_t)ba - s->last_ba;
+			if (dist >= -PF_STRIDE_MAX && dist <= PF_STRIDE_MAX)
+				break;
+		}
+		if (i < PF_STREAM_CNT) {
+			// a new stride for the stream
+			s->stride = ba - s->last_ba;
+		} else {
+			s = &sc->pf_stream[sc->pf_stream_next];
+			sc->pf_stream_next = (sc->pf_stream_next + 1) % PF_STREAM_CNT;
+			s->stride = 0;
+		}
+		s->hits = 0;
+		s->window = 1;
+		s->pf_ba = ba;
+	}
+	s->last_ba = ba;
+	if (s->hits < PF_CONFIRM)
+		return;
+
+	// the leaves ahead up to the window
+	if (s->stride > -(SECTOR_SIZE/4) && s->stride < SECTOR_SIZE/4) {
+		step = s->stride > 0 ? SECTOR_SIZE/4 : -(SECTOR_SIZE/4);
+		limit = s->window * (SECTOR_SIZE/4);
+	} else {
+		step = s->stride;
+		limit = s->window * (s->stride > 0 ? s->stride : -s->stride);
+	}
+	// the stream has passed the leaves read ahead
+	if ((s->pf_ba - ba) * (step > 0 ? 1 : -1) < 0)
+		s->pf_ba = ba;
+	for (i = 0; i < PF_BATCH; ++i) {
+		int64_t next = s->pf_ba + step;
+
+		if ((next - ba) * (step > 0 ? 1 : -1) > limit)
+			break;
+		if (next < 0 || next >= sc->superblock.block_cnt)
+			break;
+		s->pf_ba = next;
+		fbuf_prefetch_leaf(sc, next);
+	}
+}
+
 static void
 fbuf_write(struct g_logstor_softc *sc, struct _fbuf *fbuf)
 {
@@ -1680,11 +5616,13 @@ fbuf_write(struct g_logstor_softc *sc, struct _fbuf *fbuf)
 		MY_ASSERT(fbuf->ma.depth != 0);
 		MY_ASSERT(parent->ma.depth == fbuf->ma.depth - 1);
 		pindex = ma_index_get(fbuf->ma, fbuf->ma.depth - 1);
+		sec_pin(sc, parent->data[pindex]);
 		parent->data[pindex] = sa;
 		parent->fc.modified = true;
 	} else {
 		MY_ASSERT(fbuf->ma.depth == 0);
 		// store the root sector address to the corresponding file table in super block
+		sec_pin(sc, sc->superblock.fh[fbuf->ma.fd].root);
 		sc->superblock.fh[fbuf->ma.fd].root = sa;
 		sc->sb_modified = true;
 	}
@@ -1776,18 +5714,31 @@ sa2ba(struct g_logstor_softc *sc, uint32_t sa)
 {
 	static uint32_t seg_sum_cache_sa;
 	static struct _seg_sum seg_sum_cache;
-	uint32_t seg_sa;
+	uint32_t seg_sa, ba;
 	unsigned seg_off;
 
-	seg_sa = sa & ~(SECTORS_PER_SEG - 1);
+	seg_sa = sa & SA_MASK & ~(SECTORS_PER_SEG - 1);
 	seg_off = sa & (SECTORS_PER_SEG - 1);
 	MY_ASSERT(seg_sa != 0 || seg_off >= SB_CNT);
-	MY_ASSERT(seg_off != SEG_SUM_OFFSET);
+	MY_ASSERT(seg_off < SEG_SUM_OFFSET);
 	if (seg_sa != seg_sum_cache_sa) {
-		my_read(sc, &seg_sum_cache, seg_sa + SEG_SUM_OFFSET);
+		seg_sum_read(sc, seg_sa >> SEC_PER_SEG_SHIFT, &seg_sum_cache);
 		seg_sum_cache_sa = seg_sa;
 	}
-	return (seg_sum_cache.ss_rm[seg_off]);
+	ba = seg_sum_cache.ss_rm[seg_off];
+	if (ba == BLOCK_PACKED) {
+		union _pack_sec pack;
+
+		MY_ASSERT(SA_IS_FRAG(sa));
+		if ((sa & SA_MASK) == sc->pack_sa)
+			pack = sc->pack;
+		else
+			my_read(sc, &pack, sa & SA_MASK, LOGSTOR_IO_DATA);
+		ba = pack.hdr.ph_frag[SA_FRAG_IDX(sa)].ba;
+	}
+	if (IS_BLOCK_SNAP(ba))
+		ba -= BLOCK_SNAP;
+	return (ba);
 }
 
 /*
@@ -1810,7 +5761,7 @@ logstor_check(struct g_logstor_softc *sc)
 #endif
 		if (sa != SECTOR_NULL) {
 			uint32_t ba_exp = sa2ba(sc, sa);
-			if (ba_exp != ba) {
+			if (ba_exp != ba && dedup_ref_find(sc, sa, ba) == NULL) {
 				printf("ERROR %s: ba %u sa %u ba_exp %u\n",
 				    __func__, ba, sa, ba_exp);
 				MY_PANIC();
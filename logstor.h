@@ -31,30 +31,195 @@ void my_break(void);
 #endif
 
 #define	G_LOGSTOR_MAGIC	0x4C4F4753	// "LOGS": Log-Structured Storage
-#define	G_LOGSTOR_VERSION	0
+#define	G_LOGSTOR_VERSION	1
 
 #define	SECTOR_SIZE	0x1000	// 4K
 
+// flags for logstor_write
+#define	LOGSTOR_FUA	0x1	// forced unit access, the block is durable on return
+
+// the sector address returned for a block in the write buffer
+#define	LOGSTOR_SA_WBUF	2
+
 struct g_logstor_softc;
+struct logstor_cq;
+
+/*
+  Asynchronous requests
+  A request is completed by calling @done in a worker thread or, if @done
+  is NULL, by putting it on the completion queue @cq for logstor_reap().
+  The request and its data must stay valid until it is completed.
+  The requests in flight are executed by several workers, so they are
+  executed and completed in any order, not in the order of submission,
+  even on one completion queue. A write that overlaps another request in
+  flight may land before or after it. A flush makes durable only the
+  writes completed before the flush was submitted. A request that must
+  follow another is submitted after the other is completed.
+*/
+enum {
+	LOGSTOR_REQ_READ,
+	LOGSTOR_REQ_WRITE,
+	LOGSTOR_REQ_DELETE,
+	LOGSTOR_REQ_FLUSH,
+};
+
+struct logstor_req {
+	int op;			// LOGSTOR_REQ_XXX
+	int flags;		// LOGSTOR_FUA for a write
+	uint32_t ba;		// the first block
+	uint32_t cnt;		// number of blocks, not used by a flush
+	void *data;		// @cnt blocks for a read or a write
+	void (*done)(struct logstor_req *req);
+	struct logstor_cq *cq;
+	void *priv;		// for the caller
+	int error;		// set when the request is completed
+	struct logstor_req *next;	// used by logstor
+};
+
+/*
+  Statistics returned by logstor_get_stats()
+  The caller sets %version and %size so the layout can be extended.
+*/
+#define LOGSTOR_STATS_VERSION	5
+
+// latency histogram: the values below 16 ns are exact, above that each
+// power of 2 is divided into 16 buckets
+#define LOGSTOR_HIST_SUB_BITS	4
+#define LOGSTOR_HIST_CNT	((64 - LOGSTOR_HIST_SUB_BITS + 1) << LOGSTOR_HIST_SUB_BITS)
+
+enum {
+	LOGSTOR_OP_READ,
+	LOGSTOR_OP_WRITE,
+	LOGSTOR_OP_DELETE,
+	LOGSTOR_OP_FLUSH,
+	LOGSTOR_OP_SNAPSHOT,
+	LOGSTOR_OP_FBUF_MISS,	// reading a metadata block on a cache miss
+	LOGSTOR_OP_CNT,
+};
+
+// the kinds of the device reads and writes
+enum {
+	LOGSTOR_IO_DATA,
+	LOGSTOR_IO_FBUF,
+	LOGSTOR_IO_SEG_SUM,
+	LOGSTOR_IO_SUPERBLOCK,
+	LOGSTOR_IO_CNT,
+};
+
+struct logstor_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t bucket[LOGSTOR_HIST_CNT];
+};
+
+/*
+  Event trace
+  The events are the operations LOGSTOR_OP_XXX and LOGSTOR_EV_XXX below.
+  logstor_trace_dump() writes a struct logstor_trace_hdr followed by
+  the events.
+*/
+#define LOGSTOR_TRACE_MAGIC	0x4C545243	// "LTRC"
+#define LOGSTOR_TRACE_VERSION	1
+
+enum {
+	LOGSTOR_EV_MD_FLUSH = LOGSTOR_OP_CNT,	// checkpoint
+	LOGSTOR_EV_CACHE_FLUSH,	// all the dirty fbufs are written back
+	LOGSTOR_EV_FBUF_WB,	// incremental write back, sa is the number of leaves
+	LOGSTOR_EV_SEG_ALLOC,	// ba is the segment, sa is its first sector
+	LOGSTOR_EV_CNT,
+};
+
+// trace flags, what happened during an event
+#define LOGSTOR_TF_MISS_MASK	0x03	// fbuf misses, saturated at 3. depth for LOGSTOR_OP_FBUF_MISS
+#define LOGSTOR_TF_MD_FLUSH	0x04
+#define LOGSTOR_TF_CACHE_FLUSH	0x08
+#define LOGSTOR_TF_FBUF_WB	0x10
+#define LOGSTOR_TF_SEG_ALLOC	0x20
+#define LOGSTOR_TF_SEG_WRAP	0x40	// the segment allocation wrapped around
+
+struct logstor_trace_ev {
+	uint64_t ts_ns;		// start time, CLOCK_MONOTONIC
+	uint32_t dur_ns;	// duration, saturated
+	uint32_t ba;
+	uint32_t sa;
+	uint8_t ev;
+	uint8_t flags;		// LOGSTOR_TF_XXX
+	uint16_t tid;		// thread number
+};
+
+struct logstor_trace_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t ev_size;	// sizeof(struct logstor_trace_ev)
+	uint64_t ev_cnt;
+};
+
+struct logstor_stats {
+	uint32_t version;	// LOGSTOR_STATS_VERSION
+	uint32_t size;		// sizeof(struct logstor_stats)
+	uint64_t fbuf_hit;
+	uint64_t fbuf_miss;
+	uint64_t comp_block;	// data blocks stored compressed
+	uint64_t dedup_block;	// data blocks deduplicated
+	uint64_t zero_block;	// all zero data blocks eliminated
+	uint64_t fbuf_prefetch;	// leaves read ahead
+	uint64_t fbuf_prefetch_hit;	// leaves read ahead and accessed later
+	uint64_t tier_migrate;	// sectors migrated to the capacity tier
+	uint64_t tier_read;	// data sectors read from the capacity tier
+	uint64_t wbuf_hit;	// reads served by the write buffer
+	uint64_t wbuf_absorb;	// writes absorbed by a buffered block
+	uint64_t wbuf_destage;	// blocks written from the write buffer to the log
+	uint64_t rcache_hit;	// reads served by the read cache
+	uint64_t rcache_miss;	// reads not served by the read cache when it is on
+	uint64_t rcache_ra_block;	// blocks read ahead into the read cache
+	uint64_t rcache_ra_io;	// requests that read runs of blocks ahead
+	uint64_t dev_read[LOGSTOR_IO_CNT];	// sectors read from the device
+	uint64_t dev_write[LOGSTOR_IO_CNT];	// sectors written to the device
+	struct logstor_hist lat[LOGSTOR_OP_CNT];
+};
 
 uint32_t logstor_init_disk(void);
+uint32_t logstor_init_disk_geom(uint32_t seg_size);
 void logstor_fini(void);
 
 struct g_logstor_softc *logstor_open(void);
 void logstor_close(struct g_logstor_softc *sc);
 uint32_t logstor_read(struct g_logstor_softc *sc, uint32_t ba, void *data);
-uint32_t logstor_write(struct g_logstor_softc *sc, uint32_t ba, void *data);
+uint32_t logstor_write(struct g_logstor_softc *sc, uint32_t ba, void *data, int flags);
+int logstor_flush(struct g_logstor_softc *sc);
 void logstor_snapshot(struct g_logstor_softc *sc);
 void logstor_rollback(struct g_logstor_softc *sc);
 int logstor_delete(struct g_logstor_softc *sc, off_t offset, void *data, off_t length);
 uint32_t logstor_get_block_cnt(struct g_logstor_softc *sc);
+int logstor_is_zoned(struct g_logstor_softc *sc);
+int logstor_is_tiered(struct g_logstor_softc *sc);
 unsigned logstor_get_data_write_count(struct g_logstor_softc *sc);
 unsigned logstor_get_other_write_count(struct g_logstor_softc *sc);
 unsigned logstor_get_fbuf_hit(struct g_logstor_softc *sc);
 unsigned logstor_get_fbuf_miss(struct g_logstor_softc *sc);
+unsigned logstor_get_comp_block_count(struct g_logstor_softc *sc);
+void logstor_set_compress(struct g_logstor_softc *sc, int on);
+unsigned logstor_get_dedup_block_count(struct g_logstor_softc *sc);
+unsigned logstor_get_zero_block_count(struct g_logstor_softc *sc);
+int logstor_get_stats(struct g_logstor_softc *sc, struct logstor_stats *stats);
+void logstor_hist_add(struct logstor_hist *hist, uint64_t ns);
+uint64_t logstor_hist_percentile(const struct logstor_hist *hist, double pct);
+void logstor_trace_set(int on);
+int logstor_trace_dump(const char *path);
+void logstor_set_dedup(struct g_logstor_softc *sc, int on);
+void logstor_set_prefetch(struct g_logstor_softc *sc, int on);
+void logstor_set_wbuf(struct g_logstor_softc *sc, unsigned block_cnt);
+void logstor_set_rcache(struct g_logstor_softc *sc, unsigned block_cnt);
+void logstor_set_async(struct g_logstor_softc *sc, int thread_cnt);
+int logstor_submit(struct g_logstor_softc *sc, struct logstor_req *req);
+struct logstor_cq *logstor_cq_create(void);
+void logstor_cq_destroy(struct logstor_cq *cq);
+struct logstor_req *logstor_reap(struct logstor_cq *cq, int wait);
 #if defined(MY_DEBUG)
 void logstor_queue_check(struct g_logstor_softc *sc);
 void logstor_hash_check(struct g_logstor_softc *sc);
+void logstor_crash(struct g_logstor_softc *sc);
 #endif
 
 extern uint32_t gdb_cond0;	// for debug
@@ -0,0 +1,191 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  Decode the event trace written by logstor_trace_dump()
+
+  The events of all the threads are merged in time order and printed one
+  per line. With -t only the events that take at least the threshold are
+  printed, with the internal events of the same thread that happened
+  during them, which tells where the time of a stalled operation went.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "logstor.h"
+
+static const char *ev_name[LOGSTOR_EV_CNT] = {
+	[LOGSTOR_OP_READ] = "read",
+	[LOGSTOR_OP_WRITE] = "write",
+	[LOGSTOR_OP_DELETE] = "delete",
+	[LOGSTOR_OP_FLUSH] = "flush",
+	[LOGSTOR_OP_SNAPSHOT] = "snapshot",
+	[LOGSTOR_OP_FBUF_MISS] = "fbuf_miss",
+	[LOGSTOR_EV_MD_FLUSH] = "md_flush",
+	[LOGSTOR_EV_CACHE_FLUSH] = "cache_flush",
+	[LOGSTOR_EV_FBUF_WB] = "fbuf_wb",
+	[LOGSTOR_EV_SEG_ALLOC] = "seg_alloc",
+};
+
+static struct logstor_trace_ev *evs;
+static uint64_t ev_cnt;
+static uint64_t ts_base;	// time of the first event
+
+static int
+ev_cmp(const void *a, const void *b)
+{
+	const struct logstor_trace_ev *x = a, *y = b;
+
+	if (x->ts_ns != y->ts_ns)
+		return x->ts_ns < y->ts_ns ? -1 : 1;
+	return (int)x->tid - (int)y->tid;
+}
+
+static void
+ev_print(const struct logstor_trace_ev *e, bool nested)
+{
+	const char *name = e->ev < LOGSTOR_EV_CNT ? ev_name[e->ev] : "unknown";
+
+	printf("%s%14.3f tid %3u %-11s ba %10u sa %10u dur %10.3f us",
+	    nested ? "  " : "", (e->ts_ns - ts_base) / 1e3, e->tid, name,
+	    e->ba, e->sa, e->dur_ns / 1e3);
+	if (e->ev == LOGSTOR_OP_FBUF_MISS)
+		printf(" depth %u", e->flags & LOGSTOR_TF_MISS_MASK);
+	else if (e->flags & LOGSTOR_TF_MISS_MASK)
+		printf(" miss %u%s", e->flags & LOGSTOR_TF_MISS_MASK,
+		    (e->flags & LOGSTOR_TF_MISS_MASK) == LOGSTOR_TF_MISS_MASK ? "+" : "");
+	if (e->flags & LOGSTOR_TF_MD_FLUSH)
+		printf(" md_flush");
+	if (e->flags & LOGSTOR_TF_CACHE_FLUSH)
+		printf(" cache_flush");
+	if (e->flags & LOGSTOR_TF_FBUF_WB)
+		printf(" fbuf_wb");
+	if (e->flags & LOGSTOR_TF_SEG_ALLOC)
+		printf(" seg_alloc");
+	if (e->flags & LOGSTOR_TF_SEG_WRAP)
+		printf(" wrap");
+	printf("\n");
+}
+
+/*
+Description:
+    Print the events of the same thread that happened during event @i
+    They are recorded before the event since an event is recorded at
+    its end.
+*/
+static void
+ev_print_nested(uint64_t i)
+{
+	const struct logstor_trace_ev *e = &evs[i];
+	uint64_t end = e->ts_ns + e->dur_ns;
+
+	for (uint64_t j = i + 1; j < ev_cnt && evs[j].ts_ns <= end; ++j)
+		if (evs[j].tid == e->tid && evs[j].ts_ns + evs[j].dur_ns <= end)
+			ev_print(&evs[j], true);
+}
+
+static void
+summary_print(void)
+{
+	uint64_t cnt[LOGSTOR_EV_CNT] = {0};
+	uint64_t sum[LOGSTOR_EV_CNT] = {0};
+	uint64_t max[LOGSTOR_EV_CNT] = {0};
+
+	for (uint64_t i = 0; i < ev_cnt; ++i) {
+		int ev = evs[i].ev;
+
+		if (ev >= LOGSTOR_EV_CNT)
+			continue;
+		++cnt[ev];
+		sum[ev] += evs[i].dur_ns;
+		if (evs[i].dur_ns > max[ev])
+			max[ev] = evs[i].dur_ns;
+	}
+	printf("%-11s %10s %12s %12s\n", "event", "count", "avg us", "max us");
+	for (int ev = 0; ev < LOGSTOR_EV_CNT; ++ev)
+		if (cnt[ev] != 0)
+			printf("%-11s %10lu %12.3f %12.3f\n", ev_name[ev], cnt[ev],
+			    sum[ev] / 1e3 / cnt[ev], max[ev] / 1e3);
+}
+
+static void
+usage(const char *prog)
+{
+
+	fprintf(stderr,
+	    "usage: %s [-s] [-t threshold_us] trace_file\n"
+	    "  -s    print the summary of each event only\n"
+	    "  -t    print only the events that take at least threshold_us\n",
+	    prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct logstor_trace_hdr hdr;
+	bool summary = false;
+	double threshold = -1;
+	FILE *fp;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "st:h")) != -1) {
+		switch (ch) {
+		case 's':
+			summary = true;
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	fp = fopen(argv[optind], "r");
+	if (fp == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.magic != LOGSTOR_TRACE_MAGIC ||
+	    hdr.version != LOGSTOR_TRACE_VERSION ||
+	    hdr.ev_size != sizeof(struct logstor_trace_ev)) {
+		fprintf(stderr, "%s: not a logstor trace of version %d\n",
+		    argv[optind], LOGSTOR_TRACE_VERSION);
+		return 1;
+	}
+	ev_cnt = hdr.ev_cnt;
+	evs = malloc(ev_cnt * sizeof(*evs) + 1);
+	if (evs == NULL || fread(evs, sizeof(*evs), ev_cnt, fp) != ev_cnt) {
+		fprintf(stderr, "%s: truncated\n", argv[optind]);
+		return 1;
+	}
+	fclose(fp);
+	qsort(evs, ev_cnt, sizeof(*evs), ev_cmp);
+	ts_base = ev_cnt ? evs[0].ts_ns : 0;
+
+	if (summary) {
+		summary_print();
+		return 0;
+	}
+	for (uint64_t i = 0; i < ev_cnt; ++i) {
+		if (threshold < 0) {
+			ev_print(&evs[i], false);
+		} else if (evs[i].dur_ns >= threshold * 1e3 && evs[i].ev < LOGSTOR_OP_FBUF_MISS) {
+			ev_print(&evs[i], false);
+			ev_print_nested(i);
+		}
+	}
+	free(evs);
+	return 0;
+}
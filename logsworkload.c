@@ -0,0 +1,350 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "logstor.h"
+#include "logsreport.h"
+#include "logsworkload.h"
+
+const char *wl_name[WL_CNT] = {
+	[WL_UNIFORM] = "uniform",
+	[WL_ZIPF] = "zipf",
+	[WL_HOTCOLD] = "hotcold",
+	[WL_SEQ] = "seq",
+};
+
+const char *fmt_name[FMT_CNT] = {
+	[FMT_AUTO] = "auto",
+	[FMT_CSV] = "csv",
+	[FMT_BLKPARSE] = "blkparse",
+	[FMT_LOGSTOR] = "logstor",
+};
+
+// a uniform random number in [0, 1)
+static inline double
+rng_double(uint64_t *state)
+{
+
+	return (rng_next(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/*
+Description:
+    Initialize the generator @g of g->n blocks
+    The Zipfian generator is the algorithm of Gray et al. "Quickly
+    Generating Billion-Record Synthetic Databases" as used by YCSB.
+*/
+void
+wl_gen_init(struct wl_gen *g)
+{
+	double zeta2 = 1 + pow(0.5, g->zipf_theta);
+
+	if (g->workload != WL_ZIPF)
+		return;
+	g->zipf_zetan = 0;
+	for (uint32_t i = 1; i <= g->n; ++i)
+		g->zipf_zetan += 1 / pow(i, g->zipf_theta);
+	g->zipf_alpha = 1 / (1 - g->zipf_theta);
+	g->zipf_eta = (1 - pow(2.0 / g->n, 1 - g->zipf_theta)) /
+	    (1 - zeta2 / g->zipf_zetan);
+}
+
+static uint32_t
+zipf_next(const struct wl_gen *g, uint64_t *rng)
+{
+	double u = rng_double(rng);
+	double uz = u * g->zipf_zetan;
+	uint64_t rank;
+
+	if (uz < 1)
+		rank = 0;
+	else if (uz < 1 + pow(0.5, g->zipf_theta))
+		rank = 1;
+	else
+		rank = g->n * pow(g->zipf_eta * u - g->zipf_eta + 1, g->zipf_alpha);
+	if (rank >= g->n)
+		rank = g->n - 1;
+	// scatter the popular blocks over the working set
+	return rank * 2654435761ULL % g->n;
+}
+
+/*
+Description:
+    Return the next block address of generator @g
+    @rng and @seq_next are the state of the calling thread
+*/
+uint32_t
+wl_gen_next(const struct wl_gen *g, uint64_t *rng, uint32_t *seq_next)
+{
+	uint32_t hot_cnt;
+	uint32_t ba;
+
+	switch (g->workload) {
+	case WL_ZIPF:
+		return zipf_next(g, rng);
+	case WL_HOTCOLD:
+		hot_cnt = (uint64_t)g->n * g->hot_pct / 100;
+		if (hot_cnt == 0 || hot_cnt == g->n)
+			return rng_next(rng) % g->n;
+		if (rng_next(rng) % 100 < g->hot_access_pct)
+			return rng_next(rng) % hot_cnt;
+		return hot_cnt + rng_next(rng) % (g->n - hot_cnt);
+	case WL_SEQ:
+		ba = *seq_next;
+		if (++*seq_next == g->n)
+			*seq_next = 0;
+		return ba;
+	default:
+		return rng_next(rng) % g->n;
+	}
+}
+
+static void
+rec_add(struct wl_trace *tr, uint64_t ts_ns, int op, uint64_t offset, uint64_t length)
+{
+	struct wl_rec *rec;
+	uint64_t end;
+
+	if (tr->cnt == tr->max) {
+		tr->max = tr->max ? tr->max * 2 : 4096;
+		tr->recs = realloc(tr->recs, tr->max * sizeof(*tr->recs));
+		if (tr->recs == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	rec = &tr->recs[tr->cnt++];
+	rec->ts_ns = ts_ns;
+	rec->op = op;
+	if (op == REP_FLUSH) {
+		rec->ba = 0;
+		rec->cnt = 0;
+		return;
+	}
+	// cover all the blocks the byte range touches
+	end = (offset + (length ? length : 1) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	rec->ba = offset / SECTOR_SIZE;
+	rec->cnt = end - rec->ba;
+}
+
+static int
+op_parse(char c)
+{
+
+	switch (c) {
+	case 'R': case 'r':
+		return REP_READ;
+	case 'W': case 'w':
+		return REP_WRITE;
+	case 'D': case 'd': case 'T': case 't':
+		return REP_TRIM;
+	case 'F': case 'f':
+		return REP_FLUSH;
+	default:
+		return -1;
+	}
+}
+
+/*
+Description:
+    Load a trace of lines "timestamp_us,op,offset,length"
+    Empty lines and lines starting with '#' are skipped.
+*/
+static void
+csv_load(struct wl_trace *tr, FILE *fp)
+{
+	char line[256];
+	double ts;
+	char op[16];
+	uint64_t offset, length;
+	int lineno = 0;
+	int n;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		++lineno;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		offset = length = 0;
+		n = sscanf(line, "%lf , %15[^, \t\n] , %lu , %lu", &ts, op, &offset, &length);
+		if (n < 2 || op_parse(op[0]) < 0 ||
+		    (op_parse(op[0]) != REP_FLUSH && n != 4)) {
+			fprintf(stderr, "%s:%d: bad record\n", tr->path, lineno);
+			exit(1);
+		}
+		rec_add(tr, ts * 1000, op_parse(op[0]), offset, length);
+	}
+}
+
+/*
+Description:
+    Load the text output of blkparse
+    The lines are "dev cpu seq time pid action rwbs [sector + count]".
+    The RWBS field tells the type of the request, a flush has no sector.
+    The lines of the other actions and the summary at the end are skipped.
+*/
+static void
+blkparse_load(struct wl_trace *tr, FILE *fp)
+{
+	char line[512];
+	char dev[32], action[8], rwbs[16];
+	double ts;
+	uint64_t sector;
+	unsigned count;
+	int op, n;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		n = sscanf(line, "%31s %*u %*u %lf %*u %7s %15s %lu + %u",
+		    dev, &ts, action, rwbs, &sector, &count);
+		if (n < 4 || strcmp(action, tr->action) != 0)
+			continue;
+		// a write with the preflush or FUA flag is replayed as a write
+		if (n != 6)
+			op = strchr(rwbs, 'F') != NULL ? REP_FLUSH : -1;
+		else if (strchr(rwbs, 'D') != NULL)
+			op = REP_TRIM;
+		else if (strchr(rwbs, 'W') != NULL)
+			op = REP_WRITE;
+		else if (strchr(rwbs, 'R') != NULL)
+			op = REP_READ;
+		else
+			op = -1;
+		if (op < 0)
+			continue;
+		rec_add(tr, ts * 1e9, op, op == REP_FLUSH ? 0 : sector * 512,
+		    op == REP_FLUSH ? 0 : (uint64_t)count * 512);
+	}
+}
+
+static int
+ev_cmp(const void *a, const void *b)
+{
+	const struct logstor_trace_ev *x = a, *y = b;
+
+	if (x->ts_ns != y->ts_ns)
+		return x->ts_ns < y->ts_ns ? -1 : 1;
+	return (int)x->tid - (int)y->tid;
+}
+
+/*
+Description:
+    Load the public operations of a logstor event trace
+    The events are in per thread rings so they are sorted by their start
+    time first. For a delete the sa field of the event is the block count.
+*/
+static void
+logstor_load(struct wl_trace *tr, FILE *fp)
+{
+	struct logstor_trace_hdr hdr;
+	struct logstor_trace_ev *evs;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.magic != LOGSTOR_TRACE_MAGIC ||
+	    hdr.version != LOGSTOR_TRACE_VERSION ||
+	    hdr.ev_size != sizeof(struct logstor_trace_ev)) {
+		fprintf(stderr, "%s: not a logstor trace of version %d\n",
+		    tr->path, LOGSTOR_TRACE_VERSION);
+		exit(1);
+	}
+	evs = malloc(hdr.ev_cnt * sizeof(*evs) + 1);
+	if (evs == NULL || fread(evs, sizeof(*evs), hdr.ev_cnt, fp) != hdr.ev_cnt) {
+		fprintf(stderr, "%s: truncated\n", tr->path);
+		exit(1);
+	}
+	qsort(evs, hdr.ev_cnt, sizeof(*evs), ev_cmp);
+	for (uint64_t i = 0; i < hdr.ev_cnt; ++i) {
+		struct logstor_trace_ev *e = &evs[i];
+
+		switch (e->ev) {
+		case LOGSTOR_OP_READ:
+			rec_add(tr, e->ts_ns, REP_READ, (uint64_t)e->ba * SECTOR_SIZE, SECTOR_SIZE);
+			break;
+		case LOGSTOR_OP_WRITE:
+			rec_add(tr, e->ts_ns, REP_WRITE, (uint64_t)e->ba * SECTOR_SIZE, SECTOR_SIZE);
+			break;
+		case LOGSTOR_OP_DELETE:
+			rec_add(tr, e->ts_ns, REP_TRIM, (uint64_t)e->ba * SECTOR_SIZE,
+			    (uint64_t)e->sa * SECTOR_SIZE);
+			break;
+		case LOGSTOR_OP_FLUSH:
+			rec_add(tr, e->ts_ns, REP_FLUSH, 0, 0);
+			break;
+		}
+	}
+	free(evs);
+}
+
+/*
+Description:
+    Load the trace @tr->path into @tr->recs
+    The format is detected from the file if @tr->format is FMT_AUTO.
+    The timestamps are made relative to the first record.
+*/
+void
+wl_trace_load(struct wl_trace *tr)
+{
+	FILE *fp;
+	uint32_t magic;
+	uint64_t ts_base;
+
+	fp = fopen(tr->path, "r");
+	if (fp == NULL) {
+		perror(tr->path);
+		exit(1);
+	}
+	if (tr->format == FMT_AUTO) {
+		char line[512];
+
+		if (fread(&magic, sizeof(magic), 1, fp) == 1 && magic == LOGSTOR_TRACE_MAGIC)
+			tr->format = FMT_LOGSTOR;
+		else {
+			// the first record tells csv from blkparse
+			rewind(fp);
+			tr->format = FMT_BLKPARSE;
+			while (fgets(line, sizeof(line), fp) != NULL) {
+				if (line[0] == '#' || line[0] == '\n')
+					continue;
+				if (strchr(line, ',') != NULL && strchr(line, '+') == NULL)
+					tr->format = FMT_CSV;
+				break;
+			}
+		}
+		rewind(fp);
+	}
+	switch (tr->format) {
+	case FMT_CSV:
+		csv_load(tr, fp);
+		break;
+	case FMT_BLKPARSE:
+		blkparse_load(tr, fp);
+		break;
+	case FMT_LOGSTOR:
+		logstor_load(tr, fp);
+		break;
+	}
+	fclose(fp);
+
+	// make the timestamps relative to the first record
+	ts_base = ~(uint64_t)0;
+	for (uint64_t i = 0; i < tr->cnt; ++i)
+		if (tr->recs[i].ts_ns < ts_base)
+			ts_base = tr->recs[i].ts_ns;
+	for (uint64_t i = 0; i < tr->cnt; ++i)
+		tr->recs[i].ts_ns -= ts_base;
+}
+
+void
+wl_trace_free(struct wl_trace *tr)
+{
+
+	free(tr->recs);
+	tr->recs = NULL;
+	tr->cnt = tr->max = 0;
+}
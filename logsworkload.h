@@ -0,0 +1,74 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  The workloads of the benchmark tools
+
+  A synthetic workload generates block addresses with one of the address
+  distributions. A recorded workload is a block trace loaded into memory
+  as records of the REP_* operations of logsreport.h.
+*/
+enum {
+	WL_UNIFORM,
+	WL_ZIPF,
+	WL_HOTCOLD,
+	WL_SEQ,
+	WL_CNT,
+};
+
+enum {
+	FMT_AUTO,
+	FMT_CSV,
+	FMT_BLKPARSE,
+	FMT_LOGSTOR,
+	FMT_CNT,
+};
+
+extern const char *wl_name[WL_CNT];
+extern const char *fmt_name[FMT_CNT];
+
+struct wl_gen {
+	int workload;
+	uint32_t n;		// number of blocks in the working set
+	double zipf_theta;
+	int hot_pct;		// percent of the working set that is hot
+	int hot_access_pct;	// percent of the accesses that go to the hot blocks
+	// constants of the Zipfian generator
+	double zipf_zetan, zipf_alpha, zipf_eta;
+};
+
+struct wl_rec {
+	uint64_t ts_ns;		// time since the first record
+	uint32_t ba;		// first block, not yet wrapped
+	uint32_t cnt;		// number of blocks, 0 for flush
+	int op;			// REP_*
+};
+
+struct wl_trace {
+	const char *path;
+	int format;
+	const char *action;	// the blkparse action to load
+	struct wl_rec *recs;
+	uint64_t cnt;
+	uint64_t max;
+};
+
+// xorshift64*
+static inline uint64_t
+rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+void wl_gen_init(struct wl_gen *g);
+uint32_t wl_gen_next(const struct wl_gen *g, uint64_t *rng, uint32_t *seq_next);
+void wl_trace_load(struct wl_trace *tr);
+void wl_trace_free(struct wl_trace *tr);
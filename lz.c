@@ -0,0 +1,214 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS	12
+#define LZ_MIN_MATCH	4
+#define LZ_LAST_LITERALS 5	// the last 5 bytes are always literals
+#define LZ_MFLIMIT	12	// a match must start before the last 12 bytes
+#define LZ_SKIP_SHIFT	6	// search faster in the incompressible data
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static inline unsigned
+lz_hash(uint32_t seq)
+{
+	return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// write the length that doesn't fit in the token
+static inline uint8_t *
+len_write(uint8_t *op, unsigned len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+int
+lz_compress(const void *src, int src_len, void *dst, int dst_cap)
+{
+	uint16_t htab[1 << LZ_HASH_BITS];
+	const uint8_t *base = src;
+	const uint8_t *ip = base;
+	const uint8_t *anchor = base;
+	const uint8_t *end = base + src_len;
+	const uint8_t *mflimit = end - LZ_MFLIMIT;
+	const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+	uint8_t *op = dst;
+	uint8_t *oend = op + dst_cap;
+	unsigned lit;
+
+	if (src_len >= LZ_MFLIMIT) {
+		// the stale entries are harmless since a match is always verified
+		memset(htab, 0, sizeof(htab));
+		unsigned search = 1 << LZ_SKIP_SHIFT;
+
+		++ip;
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			unsigned h = lz_hash(seq);
+			const uint8_t *ref = base + htab[h];
+
+			htab[h] = ip - base;
+			if (ref >= ip || read32(ref) != seq) {
+				ip += search++ >> LZ_SKIP_SHIFT;
+				continue;
+			}
+			search = 1 << LZ_SKIP_SHIFT;
+
+			// extend the match backward and forward
+			while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				--ip;
+				--ref;
+			}
+			const uint8_t *mp = ip + LZ_MIN_MATCH;
+			const uint8_t *rp = ref + LZ_MIN_MATCH;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			// compare 8 bytes each time
+			while (mp + 8 <= matchlimit) {
+				uint64_t diff = read64(mp) ^ read64(rp);
+
+				if (diff != 0) {
+					mp += __builtin_ctzll(diff) >> 3;
+					goto match_end;
+				}
+				mp += 8;
+				rp += 8;
+			}
+#endif
+			while (mp < matchlimit && *mp == *rp) {
+				++mp;
+				++rp;
+			}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+match_end:
+#endif
+			lit = ip - anchor;
+			unsigned mlen = mp - ip - LZ_MIN_MATCH;
+
+			// token + literal length + literals + offset + match length
+			if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend)
+				return 0;
+			uint8_t *token = op++;
+			*token = (lit < 15 ? lit : 15) << 4 | (mlen < 15 ? mlen : 15);
+			if (lit >= 15)
+				op = len_write(op, lit - 15);
+			memcpy(op, anchor, lit);
+			op += lit;
+			*op++ = (ip - ref) & 0xFF;
+			*op++ = (ip - ref) >> 8;
+			if (mlen >= 15)
+				op = len_write(op, mlen - 15);
+			ip = anchor = mp;
+		}
+	}
+	// the last literals
+	lit = end - anchor;
+	if (op + 1 + lit / 255 + 1 + lit > oend)
+		return 0;
+	*op++ = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = len_write(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+	return op - (uint8_t *)dst;
+}
+
+int
+lz_decompress(const void *src, int src_len, void *dst, int dst_cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + src_len;
+	uint8_t *op = dst;
+	uint8_t *oend = op + dst_cap;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		unsigned lit = token >> 4;
+		unsigned mlen = token & 15;
+		unsigned off;
+		uint8_t b;
+
+		if (lit == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > iend - ip || lit > oend - op)
+			return -1;
+		if (lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+			memcpy(op, ip, 16);	// a fixed size copy is much faster
+		else
+			memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == iend) // the last sequence has no match
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > op - (uint8_t *)dst)
+			return -1;
+		if (mlen == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ_MIN_MATCH;
+		if (mlen > oend - op)
+			return -1;
+		const uint8_t *ref = op - off;
+		uint8_t *mend = op + mlen;
+		if (off == 1) {
+			// a run of the same byte
+			memset(op, *ref, mlen);
+			op = mend;
+		} else if (off >= 8) {
+			// each 8 bytes copy doesn't overlap
+			if (mlen <= 16 && oend - op >= 16) {
+				memcpy(op, ref, 8);
+				memcpy(op + 8, ref + 8, 8);
+				op = mend;
+			}
+			for (; op + 8 <= mend; op += 8, ref += 8)
+				memcpy(op, ref, 8);
+		}
+		// the match may overlap the output so copy byte by byte
+		while (op < mend)
+			*op++ = *ref++;
+	}
+	return op - (uint8_t *)dst;
+}
@@ -0,0 +1,15 @@
+/*
+Author: Wuyang Chung
+e-mail: wy-chung@outlook.com
+*/
+
+/*
+  A fast LZ77 codec in the LZ4 block format
+
+  lz_compress() returns the compressed length or 0 if the compressed data
+  don't fit in @dst_cap bytes. @src_len must be less than 64K.
+  lz_decompress() returns the decompressed length or -1 if @src is corrupted
+  or the decompressed data don't fit in @dst_cap bytes.
+*/
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap);
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap);